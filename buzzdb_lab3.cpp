@@ -18,9 +18,27 @@
 #include <shared_mutex>
 #include <cassert>
 #include <cstring> 
+#include <cstdlib>
 #include <exception>
 #include <atomic>
 #include <set>
+#include <iomanip>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <numeric>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <linux/io_uring.h>
+#include <type_traits>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define UNUSED(p)  ((void)(p))
 
@@ -180,8 +198,14 @@ public:
 
 static constexpr size_t PAGE_SIZE = 4096;  // Fixed page size
 static constexpr size_t MAX_SLOTS = 512;   // Fixed number of slots
-static constexpr size_t MAX_PAGES= 1000;   // Total Number of pages that can be stored
-uint16_t INVALID_VALUE = std::numeric_limits<uint16_t>::max(); // Sentinel value
+static constexpr size_t MAX_PAGES= 1000;   // Pages in a typical test database
+static constexpr uint16_t INVALID_VALUE = std::numeric_limits<uint16_t>::max(); // Sentinel value for slots
+
+using PageID = uint64_t;
+static constexpr PageID INVALID_PAGE = std::numeric_limits<PageID>::max();
+
+// The database file grows in extents of this many pages
+static constexpr size_t FILE_EXTENT_PAGES = 2048;
 
 struct Slot {
     bool empty = true;                 // Is the slot empty?    
@@ -189,10 +213,21 @@ struct Slot {
     uint16_t length = INVALID_VALUE;    // Length of the slot
 };
 
+// Releases a page buffer, unless the page only views a buffer pool frame
+struct PageDataDeleter {
+    bool owned = true;
+
+    void operator()(char* data) const {
+        if (owned) {
+            delete[] data;
+        }
+    }
+};
+
 // Slotted Page class
 class SlottedPage {
 public:
-    std::unique_ptr<char[]> page_data = std::make_unique<char[]>(PAGE_SIZE);
+    std::unique_ptr<char[], PageDataDeleter> page_data{new char[PAGE_SIZE]};
     size_t metadata_size = sizeof(Slot) * MAX_SLOTS;
 
     SlottedPage(){
@@ -205,6 +240,10 @@ public:
         }
     }
 
+    // View an existing frame without touching its contents
+    explicit SlottedPage(char* frame_data)
+        : page_data(frame_data, PageDataDeleter{false}) {}
+
     // Add a tuple, returns true if it fits, false otherwise.
     bool addTuple(std::unique_ptr<Tuple> tuple) {
 
@@ -304,123 +343,992 @@ public:
 
 const std::string database_filename = "buzzdb.dat";
 
+// Asynchronous page I/O: requests are queued without waiting, and each
+// request's callback runs on an I/O thread once it is done. Callbacks must
+// be short and must not block.
+class AsyncIO {
+public:
+    struct Request {
+        bool write = false;
+        uint64_t offset = 0;
+        char* buffer = nullptr;
+        // Called with false if less than PAGE_SIZE bytes were transferred
+        std::function<void(bool)> callback;
+    };
+
+    virtual void submit(std::vector<Request>& requests) = 0;
+    virtual ~AsyncIO() = default;
+};
+
+// io_uring without liburing: the rings are mapped by hand. Submitters fill
+// the submission ring under a mutex; one thread reaps the completion ring.
+class IoUringIO : public AsyncIO {
+private:
+    int file_fd;
+    int ring_fd = -1;
+    unsigned sq_entries = 0;
+    unsigned cq_entries = 0;
+
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    // Requests in the rings; bounded by the completion ring size
+    std::mutex submit_mutex;
+    std::condition_variable slot_cv;
+    size_t in_flight = 0;
+    bool stopping = false;
+    std::thread completion_thread;
+
+    // Bumped with release order before entering the kernel, so that what a
+    // submitter wrote happens-before the callbacks in a way tools can see;
+    // the hand-off through the rings is invisible to them
+    std::atomic<uint64_t> submissions{0};
+
+    template<typename T>
+    static T* at(void* ring, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+    }
+
+    // Queue one entry; user_data 0 is the shutdown marker.
+    // Requires submit_mutex and a free completion slot.
+    void push(uint8_t opcode, const Request* request) {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        if (request != nullptr) {
+            sqe.fd = file_fd;
+            sqe.addr = reinterpret_cast<uint64_t>(request->buffer);
+            sqe.len = PAGE_SIZE;
+            sqe.off = request->offset;
+        }
+        sqe.user_data = reinterpret_cast<uint64_t>(request);
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        in_flight++;
+    }
+
+    void enter(unsigned to_submit) {
+        submissions.fetch_add(1, std::memory_order_release);
+        while (to_submit > 0) {
+            int submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+            if (submitted < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    continue;
+                }
+                std::cerr << "Error: io_uring submission failed. \n";
+                exit(-1);
+            }
+            to_submit -= submitted;
+        }
+    }
+
+    void reap() {
+        while (1) {
+            syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            submissions.load(std::memory_order_acquire);
+            size_t reaped = 0;
+            for (; head != tail; head++, reaped++) {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                Request* request = reinterpret_cast<Request*>(cqe.user_data);
+                if (request != nullptr) {
+                    request->callback(cqe.res == static_cast<int>(PAGE_SIZE));
+                    delete request;
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            std::lock_guard<std::mutex> lock(submit_mutex);
+            in_flight -= reaped;
+            slot_cv.notify_all();
+            if (stopping && in_flight == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    /// @param[in] file_fd      The file the requests refer to.
+    /// @param[in] queue_depth  Submission ring size.
+    IoUringIO(int file_fd, unsigned queue_depth) : file_fd(file_fd) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+        if (ring_fd < 0) {
+            return;
+        }
+        sq_entries = params.sq_entries;
+        cq_entries = params.cq_entries;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return;
+        }
+        if (!single_mmap) {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                return;
+            }
+        }
+        void* sqe_memory = mmap(nullptr, sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqe_memory == MAP_FAILED) {
+            return;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqe_memory);
+
+        void* completion_ring = single_mmap ? sq_ring : cq_ring;
+        sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+        sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+        cq_head = at<unsigned>(completion_ring, params.cq_off.head);
+        cq_tail = at<unsigned>(completion_ring, params.cq_off.tail);
+        cq_mask = at<unsigned>(completion_ring, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(completion_ring, params.cq_off.cqes);
+
+        completion_thread = std::thread(&IoUringIO::reap, this);
+    }
+
+    ~IoUringIO() {
+        if (completion_thread.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(submit_mutex);
+                slot_cv.wait(lock, [this] { return in_flight < cq_entries; });
+                stopping = true;
+                push(IORING_OP_NOP, nullptr);
+                enter(1);
+            }
+            completion_thread.join();
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+        }
+        if (cq_ring != MAP_FAILED) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    // False if the kernel does not offer io_uring (or forbids it)
+    bool is_ready() const {
+        return completion_thread.joinable();
+    }
+
+    void submit(std::vector<Request>& requests) override {
+        std::unique_lock<std::mutex> lock(submit_mutex);
+        unsigned queued = 0;
+        for (Request& request : requests) {
+            // Flush a full submission ring, and never queue more than the
+            // completion ring can report
+            if (queued == sq_entries) {
+                enter(queued);
+                queued = 0;
+            }
+            if (in_flight == cq_entries) {
+                enter(queued);
+                queued = 0;
+                slot_cv.wait(lock, [this] { return in_flight < cq_entries; });
+            }
+            push(request.write ? IORING_OP_WRITE : IORING_OP_READ, new Request(std::move(request)));
+            queued++;
+        }
+        enter(queued);
+    }
+};
+
+// Fallback: a few threads doing blocking pread/pwrite
+class ThreadPoolIO : public AsyncIO {
+private:
+    int file_fd;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::queue<Request> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void work() {
+        while (1) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                request = std::move(queue.front());
+                queue.pop();
+            }
+            ssize_t transferred = request.write
+                ? pwrite(file_fd, request.buffer, PAGE_SIZE, request.offset)
+                : pread(file_fd, request.buffer, PAGE_SIZE, request.offset);
+            request.callback(transferred == static_cast<ssize_t>(PAGE_SIZE));
+        }
+    }
+
+public:
+    ThreadPoolIO(int file_fd, size_t num_threads) : file_fd(file_fd) {
+        for (size_t i = 0; i < num_threads; i++) {
+            workers.emplace_back(&ThreadPoolIO::work, this);
+        }
+    }
+
+    ~ThreadPoolIO() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void submit(std::vector<Request>& requests) override {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            for (Request& request : requests) {
+                queue.push(std::move(request));
+            }
+        }
+        queue_cv.notify_all();
+    }
+};
+
+enum AsyncIOType { IO_URING, THREAD_POOL };
+
+// Number of requests the async backends keep in flight
+constexpr unsigned ASYNC_IO_QUEUE_DEPTH = 64;
+constexpr size_t ASYNC_IO_THREADS = 4;
+
+// io_uring if the kernel offers it, the thread pool otherwise
+std::unique_ptr<AsyncIO> make_async_io(int file_fd, AsyncIOType async_io_type = IO_URING) {
+    if (async_io_type == IO_URING) {
+        auto io_uring = std::make_unique<IoUringIO>(file_fd, ASYNC_IO_QUEUE_DEPTH);
+        if (io_uring->is_ready()) {
+            return io_uring;
+        }
+    }
+    return std::make_unique<ThreadPoolIO>(file_fd, ASYNC_IO_THREADS);
+}
+
 class StorageManager {
 public:    
-    std::fstream fileStream;
-    size_t num_pages = 0;
-    std::mutex io_mutex;
+    int fd = -1;
+    std::atomic<uint64_t> num_pages{0};
 
-public:
-    StorageManager(bool truncate_mode = true){
-        auto flags = truncate_mode ? std::ios::in | std::ios::out | std::ios::trunc 
-        : std::ios::in | std::ios::out;
-        fileStream.open(database_filename, flags);
-        if (!fileStream) {
-            fileStream.clear();
-            fileStream.open(database_filename, truncate_mode ? (std::ios::out | std::ios::trunc) : std::ios::out);
-        }
-        fileStream.close();
-        fileStream.open(database_filename, std::ios::in | std::ios::out);
-
-        // Initialize entire file with empty pages
-        fileStream.seekg(0, std::ios::end);
-        num_pages = fileStream.tellg() / PAGE_SIZE;
-        
-        if (num_pages < MAX_PAGES) {
-            // Pre-allocate all pages
-            char* empty_buffer = new char[PAGE_SIZE]();
-            fileStream.seekp(0, std::ios::end);
-            for (size_t i = num_pages; i < MAX_PAGES; i++) {
-                fileStream.write(empty_buffer, PAGE_SIZE);
+    // Reads and writes are positional and need no latch; only growing the
+    // file is serialized
+    std::mutex extend_mutex;
+
+    // Page I/O counters
+    std::atomic<uint64_t> num_reads{0};
+    std::atomic<uint64_t> num_writes{0};
+
+    // The file was opened with O_DIRECT, so the buffer pool is the only cache
+    bool direct_io = false;
+
+    std::unique_ptr<AsyncIO> async_io;
+
+private:
+    struct AlignedDeleter {
+        void operator()(char* data) const { std::free(data); }
+    };
+
+    // Zeroed, PAGE_SIZE-aligned memory as O_DIRECT requires
+    static std::unique_ptr<char[], AlignedDeleter> aligned_buffer(size_t size) {
+        char* data = static_cast<char*>(std::aligned_alloc(PAGE_SIZE, size));
+        std::memset(data, 0, size);
+        return std::unique_ptr<char[], AlignedDeleter>(data);
+    }
+
+    bool needs_bounce(const char* buffer) const {
+        return direct_io && reinterpret_cast<uintptr_t>(buffer) % PAGE_SIZE != 0;
+    }
+
+    void write_all(const char* buffer, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, buffer, size, offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                std::cerr << "Error: Unable to write data to the file. \n";
+                exit(-1);
+            }
+            buffer += written;
+            size -= written;
+            offset += written;
+        }
+    }
+
+    // Grow the file to at least new_num_pages, rounded up to a whole extent.
+    // Only the last extent is allocated; a jump further out leaves a hole,
+    // which reads back as zeroes. fallocate reserves the blocks without
+    // writing them; file systems without it get zero pages written instead.
+    void grow(uint64_t new_num_pages) {
+        if (new_num_pages <= num_pages) {
+            return;
+        }
+        new_num_pages = (new_num_pages + FILE_EXTENT_PAGES - 1) / FILE_EXTENT_PAGES * FILE_EXTENT_PAGES;
+        uint64_t first_page = std::max<uint64_t>(num_pages, new_num_pages - FILE_EXTENT_PAGES);
+        uint64_t offset = first_page * PAGE_SIZE;
+        uint64_t size = (new_num_pages - first_page) * PAGE_SIZE;
+        if (fallocate(fd, 0, offset, size) != 0) {
+            constexpr uint64_t chunk_size = FILE_EXTENT_PAGES * PAGE_SIZE;
+            auto zeroes = aligned_buffer(chunk_size);
+            for (uint64_t done = 0; done < size; done += chunk_size) {
+                write_all(zeroes.get(), std::min(chunk_size, size - done), offset + done);
             }
-            fileStream.flush();
-            delete[] empty_buffer;
-            num_pages = MAX_PAGES;
         }
+        num_pages = new_num_pages;
+    }
 
+    // Make sure page_id lies inside the file
+    void ensure_page(PageID page_id) {
+        if (page_id >= num_pages) {
+            extend(page_id);
+        }
     }
 
-    ~StorageManager() {
-        if (fileStream.is_open()) {
-            fileStream.close();
+public:
+    /// @param[in] direct_io    Open the file with O_DIRECT. Where the file
+    ///                         system does not support it, buffered I/O is used.
+    StorageManager(bool truncate_mode = true, bool direct_io = false){
+        int flags = O_RDWR | O_CREAT | (truncate_mode ? O_TRUNC : 0);
+        if (direct_io) {
+            fd = open(database_filename.c_str(), flags | O_DIRECT, 0644);
+            this->direct_io = fd >= 0;
+        }
+        if (fd < 0) {
+            fd = open(database_filename.c_str(), flags, 0644);
+        }
+        if (fd < 0) {
+            std::cerr << "Error: Unable to open the database file. \n";
+            exit(-1);
+        }
+
+        // The file is extended lazily as pages get written
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            std::cerr << "Error: Unable to read the size of the database file. \n";
+            exit(-1);
         }
+        num_pages = file_stat.st_size / PAGE_SIZE;
+
+        async_io = make_async_io(fd);
+    }
+
+    ~StorageManager() {
+        async_io.reset();
+        close(fd);
     }
 
     // Read a page from disk
-    std::unique_ptr<SlottedPage> load(uint16_t page_id) {
-        fileStream.seekg(page_id * PAGE_SIZE, std::ios::beg);
+    std::unique_ptr<SlottedPage> load(PageID page_id) {
         auto page = std::make_unique<SlottedPage>();
-        // Read the content of the file into the page
-        if(fileStream.read(page->page_data.get(), PAGE_SIZE)){
-            //std::cout << "Page read successfully from file." << std::endl;
+        load(page_id, page->page_data.get());
+        return page;
+    }
+
+    // Read a page from disk straight into a caller-provided PAGE_SIZE buffer.
+    // Pages past the end of the file were never written and read as zeroes
+    // without any I/O.
+    void load(PageID page_id, char* buffer) {
+        if (page_id >= num_pages) {
+            std::memset(buffer, 0, PAGE_SIZE);
+            return;
         }
-        else{
+        num_reads++;
+        if (needs_bounce(buffer)) {
+            auto aligned = aligned_buffer(PAGE_SIZE);
+            load(page_id, aligned.get());
+            num_reads--;
+            std::memcpy(buffer, aligned.get(), PAGE_SIZE);
+            return;
+        }
+        ssize_t bytes_read;
+        do {
+            bytes_read = pread(fd, buffer, PAGE_SIZE, page_id * PAGE_SIZE);
+        } while (bytes_read < 0 && errno == EINTR);
+        if (bytes_read != static_cast<ssize_t>(PAGE_SIZE)) {
             std::cerr << "Error: Unable to read data from the file. \n";
             exit(-1);
         }
-        return page;
     }
 
-    // Write a page to disk
-    void flush(uint16_t page_id, const SlottedPage& page) {
-        size_t page_offset = page_id * PAGE_SIZE;        
+    // Write a page to disk.
+    // The write is not forced to the device; call sync() for that.
+    void flush(PageID page_id, const SlottedPage& page) {
+        ensure_page(page_id);
+        num_writes++;
+        const char* data = page.page_data.get();
+        std::unique_ptr<char[], AlignedDeleter> aligned;
+        if (needs_bounce(data)) {
+            aligned = aligned_buffer(PAGE_SIZE);
+            std::memcpy(aligned.get(), data, PAGE_SIZE);
+            data = aligned.get();
+        }
+        write_all(data, PAGE_SIZE, page_id * PAGE_SIZE);
+    }
+
+    // Queue page reads and writes without waiting for them. Each request's
+    // callback runs on an I/O thread once the page is done. With direct I/O
+    // the buffers must be PAGE_SIZE-aligned, as frames are.
+    void submit(std::vector<AsyncIO::Request>& requests) {
+        std::vector<AsyncIO::Request> queued;
+        std::vector<AsyncIO::Request> unwritten;
+        for (AsyncIO::Request& request : requests) {
+            if (request.write) {
+                ensure_page(request.offset / PAGE_SIZE);
+                num_writes++;
+            } else if (request.offset / PAGE_SIZE >= num_pages) {
+                unwritten.push_back(std::move(request));
+                continue;
+            } else {
+                num_reads++;
+            }
+            queued.push_back(std::move(request));
+        }
+        if (!queued.empty()) {
+            async_io->submit(queued);
+        }
+        // Reads past the end of the file complete right away, as in load()
+        for (AsyncIO::Request& request : unwritten) {
+            std::memset(request.buffer, 0, PAGE_SIZE);
+            request.callback(true);
+        }
+    }
 
-        // Move the write pointer
-        fileStream.seekp(page_offset, std::ios::beg);
-        fileStream.write(page.page_data.get(), PAGE_SIZE);        
-        fileStream.flush();
+    // Force written pages to the device. A page that may not have
+    // reached it must not be taken for durable, so failure is fatal
+    void sync() {
+        if (fdatasync(fd) != 0) {
+            std::cerr << "Error: Unable to sync the database file. \n";
+            exit(-1);
+        }
     }
 
     // Extend database file by one page
     void extend() {
-        // Create a slotted page
-        auto empty_slotted_page = std::make_unique<SlottedPage>();
+        std::lock_guard<std::mutex> extend_guard(extend_mutex);
+        grow(num_pages + 1);
+    }
+
+    void extend(PageID till_page_id) {
+        std::lock_guard<std::mutex> extend_guard(extend_mutex);
+        // std::cout << "Extending database file till page id : "<<till_page_id<<" \n";
+        grow(till_page_id + 1);
+    }
+
+};
+
+const std::string log_filename = "buzzdb.wal";
+
+// Appends write the log out once this much is buffered
+constexpr size_t LOG_BUFFER_SIZE = 1 << 20;
+
+// The background writer takes a checkpoint once the log has grown by this
+// much since the last one
+constexpr uint64_t LOG_CHECKPOINT_SIZE = 64ull << 20;
+
+// Redo log of page changes. Each logged operation is one record, holding
+// the changes it made to one or more pages: either a full image of a page
+// or a change of a type the client defines and redoes itself. A record's
+// log sequence number (LSN) is the log offset just past it, and every page
+// it changes keeps that LSN in its first eight bytes. A page is written
+// only once the log holds its LSN, so the file never has a change the log
+// lacks; recovery replays the records since the last checkpoint.
+// The first change to a page after a checkpoint starts is logged as a full
+// image, so replay never builds on a page that was torn while written.
+// Appends that wait for the log to reach the disk share one sync, which is
+// whoever flushes first.
+class WriteAheadLog {
+public:
+    // The change type of full page images; clients number theirs from 1
+    static constexpr uint8_t kImage = 0;
+
+    // One page's change within an operation, for append()
+    struct Change {
+        PageID page_id;
+        // The page, which is stamped with the LSN
+        char* page;
+        // The page as it goes into an image, if not page itself
+        const char* image;
+        uint8_t type;
+        const void* payload;
+        uint32_t size;
+    };
+
+    // A change read back from the log
+    struct LoggedChange {
+        PageID page_id;
+        uint8_t type;
+        const char* payload;
+        uint32_t size;
+    };
+
+    std::atomic<uint64_t> num_syncs{0};
+
+private:
+    static constexpr uint64_t kMagic = 0x4c41575a5a5542; // "BUZZWAL" on disk
+    // The file header takes the first page
+    static constexpr uint64_t kFirstLsn = PAGE_SIZE;
+
+    struct FileHeader {
+        uint64_t magic;
+        // Where recovery starts reading
+        uint64_t redo_lsn;
+    };
+
+    struct RecordHeader {
+        uint64_t lsn;
+        // Of the rest of the record, seeded with lsn
+        uint64_t checksum;
+        // Including this header; a multiple of 8
+        uint32_t size;
+        uint32_t num_changes;
+    };
+
+    struct ChangeHeader {
+        PageID page_id;
+        uint32_t size;
+        uint8_t type;
+    };
+
+    int fd = -1;
+
+    std::mutex mutex;
+    std::condition_variable flushed_cv;
+    // The records from written_lsn to end_lsn, and the buffer the flushing
+    // thread writes out meanwhile
+    std::vector<char> buffer;
+    std::vector<char> spare;
+    std::atomic<size_t> buffered{0};
+    uint64_t end_lsn = kFirstLsn;
+    uint64_t written_lsn = kFirstLsn;
+    // Read without the latch to skip flushes that are not needed
+    std::atomic<uint64_t> flushed_lsn{kFirstLsn};
+    bool flushing = false;
+    uint64_t redo_lsn = kFirstLsn;
+    // A page whose LSN is not past this is logged as a full image
+    uint64_t image_lsn = kFirstLsn;
+    // Records of an earlier run are left to replay
+    bool recovery_pending = false;
+    // Anything was logged or replayed, so checkpoints have to be recorded
+    bool used = false;
+
+    static uint32_t padded(uint32_t size) {
+        return (size + 7) & ~7u;
+    }
+
+    static uint64_t checksum(const char* data, size_t size, uint64_t seed) {
+        uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+        for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    void write_all(const char* data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                std::cerr << "Error: Unable to write to the log. \n";
+                exit(-1);
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+    }
+
+    bool read_all(char* data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t bytes_read = pread(fd, data, size, offset);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                return false;
+            }
+            data += bytes_read;
+            size -= bytes_read;
+            offset += bytes_read;
+        }
+        return true;
+    }
 
-        // Make sure stream is open
-        if (!fileStream.is_open()) {
-            fileStream.clear();
-            fileStream.open(database_filename, std::ios::in | std::ios::out);
+    /// Force the log to the device. Records that may not have reached it
+    /// must not be taken for durable, so failure is fatal.
+    void sync() {
+        if (fdatasync(fd) != 0) {
+            std::cerr << "Error: Unable to sync the log. \n";
+            exit(-1);
         }
+    }
 
-        // Move the write pointer
-        fileStream.seekp(0, std::ios::end);
+    void write_header(uint64_t lsn) {
+        FileHeader header{kMagic, lsn};
+        write_all(reinterpret_cast<const char*>(&header), sizeof(header), 0);
+        sync();
+    }
 
-        // Write the page to the file, extending it
-        if (!fileStream.write(empty_slotted_page->page_data.get(), PAGE_SIZE)) {
-            std::cerr << "Failed to write to file during extend" << std::endl;
+public:
+    explicit WriteAheadLog(bool truncate_mode) {
+        fd = open(log_filename.c_str(), O_RDWR | O_CREAT | (truncate_mode ? O_TRUNC : 0), 0644);
+        if (fd < 0) {
+            std::cerr << "Error: Unable to open the log. \n";
+            exit(-1);
+        }
+        FileHeader header{};
+        if (!read_all(reinterpret_cast<char*>(&header), sizeof(header), 0) || header.magic != kMagic) {
+            write_header(kFirstLsn);
             return;
         }
-        fileStream.flush();
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            std::cerr << "Error: Unable to read the size of the log. \n";
+            exit(-1);
+        }
+        uint64_t file_size = file_stat.st_size;
+        redo_lsn = header.redo_lsn;
+        if (file_size > redo_lsn) {
+            // Whatever follows the last intact record is torn; new records
+            // start past it, so it can never pass for one
+            recovery_pending = true;
+            end_lsn = (file_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        } else {
+            end_lsn = redo_lsn;
+        }
+        written_lsn = flushed_lsn = image_lsn = end_lsn;
+    }
+
+    ~WriteAheadLog() {
+        close(fd);
+    }
+
+    /// Log the changes of one operation as a record and stamp the pages
+    /// with its LSN. A change to a page not logged since the last
+    /// checkpoint started is turned into a full image. The caller holds
+    /// the pages exclusively.
+    /// @return     The LSN of the record.
+    uint64_t append(Change* changes, size_t num_changes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        assert(!recovery_pending);
+        used = true;
+        uint32_t size = sizeof(RecordHeader);
+        for (size_t i = 0; i < num_changes; i++) {
+            Change& change = changes[i];
+            uint64_t page_lsn;
+            std::memcpy(&page_lsn, change.page, sizeof(page_lsn));
+            if (change.type == kImage || page_lsn <= image_lsn) {
+                change.type = kImage;
+                change.payload = change.image != nullptr ? change.image : change.page;
+                change.size = PAGE_SIZE;
+            }
+            size += sizeof(ChangeHeader) + padded(change.size);
+        }
+        uint64_t lsn = end_lsn + size;
+
+        size_t start = buffer.size();
+        buffer.resize(start + size);
+        char* record = buffer.data() + start;
+        RecordHeader* header = reinterpret_cast<RecordHeader*>(record);
+        header->lsn = lsn;
+        header->size = size;
+        header->num_changes = num_changes;
+        char* position = record + sizeof(RecordHeader);
+        for (size_t i = 0; i < num_changes; i++) {
+            const Change& change = changes[i];
+            std::memcpy(change.page, &lsn, sizeof(lsn));
+            ChangeHeader* change_header = reinterpret_cast<ChangeHeader*>(position);
+            *change_header = ChangeHeader{change.page_id, change.size, change.type};
+            position += sizeof(ChangeHeader);
+            std::memcpy(position, change.payload, change.size);
+            if (change.type == kImage) {
+                std::memcpy(position, &lsn, sizeof(lsn));
+            }
+            std::memset(position + change.size, 0, padded(change.size) - change.size);
+            position += padded(change.size);
+        }
+        header->checksum = checksum(record + offsetof(RecordHeader, size),
+                                    size - offsetof(RecordHeader, size), lsn);
+        end_lsn = lsn;
+        buffered.store(buffer.size(), std::memory_order_relaxed);
+        return lsn;
+    }
 
-        // Update number of pages
-        num_pages += 1;
+    /// Bytes appended but not yet written out
+    size_t buffered_bytes() const {
+        return buffered.load(std::memory_order_relaxed);
     }
 
-    void extend(uint64_t till_page_id) {
-        std::lock_guard<std::mutex>  io_guard(io_mutex); 
-        uint64_t write_size = std::max(static_cast<uint64_t>(0), till_page_id + 1 - num_pages) * PAGE_SIZE;
-        if(write_size > 0 ) {
-            // std::cout << "Extending database file till page id : "<<till_page_id<<" \n";
-            char* buffer = new char[write_size];
-            std::memset(buffer, 0, write_size);
+    /// Wait until the log is durable up to lsn. If no thread is writing
+    /// it, this one writes out and syncs everything appended so far, on
+    /// behalf of every thread waiting meanwhile.
+    void flush(uint64_t lsn) {
+        if (lsn <= flushed_lsn.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        lsn = std::min(lsn, end_lsn);
+        while (flushed_lsn < lsn) {
+            if (flushing) {
+                flushed_cv.wait(lock);
+                continue;
+            }
+            flushing = true;
+            std::swap(buffer, spare);
+            buffered.store(0, std::memory_order_relaxed);
+            uint64_t offset = written_lsn;
+            uint64_t end = end_lsn;
+            written_lsn = end;
+            lock.unlock();
+
+            write_all(spare.data(), spare.size(), offset);
+            sync();
+            num_syncs++;
+
+            lock.lock();
+            spare.clear();
+            flushed_lsn = end;
+            flushing = false;
+            flushed_cv.notify_all();
+        }
+    }
 
-            fileStream.seekp(0, std::ios::end);
-            fileStream.write(buffer, write_size);
-            fileStream.flush();
-            
-            num_pages = till_page_id+1;
+    uint64_t get_end_lsn() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return end_lsn;
+    }
+
+    /// The log written since the last checkpoint
+    uint64_t size_since_checkpoint() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return end_lsn - redo_lsn;
+    }
+
+    /// Start a checkpoint: from here on, the first change to each page is
+    /// logged as an image.
+    /// @return     The LSN recovery may start from once every page dirty
+    ///             now has been written and synced.
+    uint64_t begin_checkpoint() {
+        std::lock_guard<std::mutex> lock(mutex);
+        image_lsn = end_lsn;
+        return end_lsn;
+    }
+
+    /// Let recovery start from lsn and drop the log before it. Skipped
+    /// while an earlier run's records have not been replayed, or if this
+    /// run never logged, which leaves the log to whoever else has it open.
+    void end_checkpoint(uint64_t lsn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!used || recovery_pending || lsn <= redo_lsn) {
+                return;
+            }
         }
+        flush(lsn);
+        write_header(lsn);
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t dropped = lsn / PAGE_SIZE * PAGE_SIZE;
+        if (dropped > redo_lsn / PAGE_SIZE * PAGE_SIZE) {
+            // Best effort; without hole punching the log only grows
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, kFirstLsn, dropped - kFirstLsn);
+        }
+        redo_lsn = lsn;
     }
 
+    /// Hand the intact records of an earlier run, from the last
+    /// checkpoint on, to visit(lsn, changes) in log order. Only the first
+    /// call after opening the log does anything; appends may follow it.
+    /// @return     false if there was nothing to recover.
+    template<typename Visitor>
+    bool replay(Visitor visit) {
+        if (!recovery_pending) {
+            return false;
+        }
+        std::vector<char> record;
+        std::vector<LoggedChange> changes;
+        uint64_t lsn = redo_lsn;
+        while (1) {
+            RecordHeader header;
+            if (!read_all(reinterpret_cast<char*>(&header), sizeof(header), lsn) ||
+                header.size < sizeof(RecordHeader) || header.size % 8 != 0 ||
+                header.lsn != lsn + header.size) {
+                break;
+            }
+            record.resize(header.size);
+            if (!read_all(record.data(), header.size, lsn) ||
+                checksum(record.data() + offsetof(RecordHeader, size),
+                         header.size - offsetof(RecordHeader, size), header.lsn) != header.checksum) {
+                break;
+            }
+            changes.clear();
+            size_t position = sizeof(RecordHeader);
+            for (uint32_t i = 0; i < header.num_changes && position + sizeof(ChangeHeader) <= header.size; i++) {
+                ChangeHeader change;
+                std::memcpy(&change, record.data() + position, sizeof(change));
+                position += sizeof(ChangeHeader);
+                if (position + padded(change.size) > header.size) {
+                    break;
+                }
+                changes.push_back({change.page_id, change.type, record.data() + position, change.size});
+                position += padded(change.size);
+            }
+            if (changes.size() != header.num_changes) {
+                break;
+            }
+            visit(header.lsn, changes);
+            lsn = header.lsn;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        recovery_pending = false;
+        used = true;
+        return true;
+    }
 };
 
-using PageID = uint16_t;
+using FrameID = uint32_t;
+static constexpr FrameID INVALID_FRAME = std::numeric_limits<FrameID>::max();
+
+// A page reference kept in memory, such as a child of an inner node, may be
+// swizzled: it then holds the frame of the resident page, tagged with the
+// top bit, and is followed without a page table probe. References are
+// unswizzled before their page is evicted and whenever a page is written,
+// so only page ids ever reach the disk.
+static constexpr PageID SWIZZLED_TAG = PageID(1) << 63;
+
+inline bool is_swizzled(PageID reference) {
+    return (reference & SWIZZLED_TAG) != 0 && reference != INVALID_PAGE;
+}
+
+inline FrameID swizzled_frame(PageID reference) {
+    return static_cast<FrameID>(reference & ~SWIZZLED_TAG);
+}
+
+// Maps resident page ids to frame indexes.
+// Open addressing with linear probing; the table is sized once for the pool,
+// so lookups and inserts on the fix_page path never allocate.
+class PageTable {
+private:
+    struct Entry {
+        PageID page_id = INVALID_PAGE;
+        FrameID frame_id = INVALID_FRAME;
+    };
+
+    std::vector<Entry> entries;
+    size_t mask;
+
+    size_t slot_of(PageID page_id) const {
+        // Fibonacci hashing spreads consecutive page ids over the table
+        return static_cast<size_t>((page_id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    }
+
+public:
+    PageTable(size_t max_entries) {
+        size_t capacity = 16;
+        while (capacity < 2 * max_entries) {
+            capacity *= 2;
+        }
+        entries.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    FrameID find(PageID page_id) const {
+        for (size_t slot = slot_of(page_id); ; slot = (slot + 1) & mask) {
+            if (entries[slot].page_id == page_id) {
+                return entries[slot].frame_id;
+            }
+            if (entries[slot].page_id == INVALID_PAGE) {
+                return INVALID_FRAME;
+            }
+        }
+    }
+
+    void insert(PageID page_id, FrameID frame_id) {
+        size_t slot = slot_of(page_id);
+        while (entries[slot].page_id != INVALID_PAGE &&
+               entries[slot].page_id != page_id) {
+            slot = (slot + 1) & mask;
+        }
+        entries[slot].page_id = page_id;
+        entries[slot].frame_id = frame_id;
+    }
+
+    void erase(PageID page_id) {
+        size_t slot = slot_of(page_id);
+        while (entries[slot].page_id != page_id) {
+            if (entries[slot].page_id == INVALID_PAGE) {
+                return;
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        // Backward-shift the rest of the probe run so no tombstones are needed
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask;
+             entries[next].page_id != INVALID_PAGE;
+             next = (next + 1) & mask) {
+            size_t home = slot_of(entries[next].page_id);
+            // Move the entry if its home slot does not lie in (hole, next]
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                entries[hole] = entries[next];
+                hole = next;
+            }
+        }
+        entries[hole] = Entry();
+    }
+};
 
 class Policy {
 public:
     virtual bool touch(PageID page_id) = 0;
-    virtual PageID evict() = 0;
+    // Evict the best victim among the pages the caller allows to leave
+    virtual PageID evict(const std::function<bool(PageID)>& evictable) = 0;
+    // The next pages evict() would pick, coldest first, without evicting them
+    virtual std::vector<PageID> victims(size_t count) const = 0;
+    // Forget a page that leaves the pool without going through evict()
+    virtual void erase(PageID page_id) = 0;
+    // The number of pages the pool can hold changed
+    virtual void resize(size_t capacity) = 0;
     virtual ~Policy() = default;
+
+    PageID evict() {
+        return evict([](PageID) { return true; });
+    }
 };
 
 void printList(std::string list_name, const std::list<PageID>& myList) {
@@ -443,6 +1351,8 @@ private:
 
 public:
 
+    using Policy::evict;
+
     LruPolicy(size_t cacheSize) : cacheSize(cacheSize) {}
 
     bool touch(PageID page_id) override {
@@ -470,853 +1380,6489 @@ public:
         return found;
     }
 
-    PageID evict() override {
-        // Evict the least recently used page
-        PageID evictedPageId = INVALID_VALUE;
-        if(lruList.size() != 0){
-            evictedPageId = lruList.back();
-            map.erase(evictedPageId);
-            lruList.pop_back();
+    PageID evict(const std::function<bool(PageID)>& evictable) override {
+        // Evict the least recently used page that may leave
+        for (auto it = lruList.rbegin(); it != lruList.rend(); ++it) {
+            if (evictable(*it)) {
+                PageID evictedPageId = *it;
+                map.erase(evictedPageId);
+                lruList.erase(std::next(it).base());
+                return evictedPageId;
+            }
         }
-        return evictedPageId;
+        return INVALID_PAGE;
     }
 
-};
+    std::vector<PageID> victims(size_t count) const override {
+        std::vector<PageID> pages;
+        for (auto it = lruList.rbegin(); it != lruList.rend() && pages.size() < count; ++it) {
+            pages.push_back(*it);
+        }
+        return pages;
+    }
 
-constexpr size_t MAX_PAGES_IN_MEMORY = 10;
+    void erase(PageID page_id) override {
+        auto it = map.find(page_id);
+        if (it != map.end()) {
+            lruList.erase(it->second);
+            map.erase(it);
+        }
+    }
 
-class BufferManager {
+    void resize(size_t capacity) override {
+        cacheSize = capacity;
+        while (lruList.size() > cacheSize) {
+            evict();
+        }
+    }
+
+};
+
+// CLOCK: a ring of slots with one reference bit each and a sweeping hand.
+// A hit only sets a bit, so there is no ordering to maintain.
+class ClockPolicy : public Policy {
 private:
-    using PageMap = std::unordered_map<PageID, SlottedPage>;
+    std::vector<PageID> ring;
+    std::vector<uint8_t> referenced;
+    std::vector<FrameID> free_slots;
 
-    StorageManager storage_manager;
-    PageMap pageMap;
-    std::unique_ptr<Policy> policy;
+    // Finds the slot of a page without allocating
+    PageTable slots;
+
+    size_t hand = 0;
+
+    void clear_slot(FrameID slot) {
+        slots.erase(ring[slot]);
+        ring[slot] = INVALID_PAGE;
+        referenced[slot] = 0;
+        free_slots.push_back(slot);
+    }
 
 public:
-    BufferManager(bool storage_manager_truncate_mode = true): 
-        storage_manager(storage_manager_truncate_mode),
-        policy(std::make_unique<LruPolicy>(MAX_PAGES_IN_MEMORY)) {
-            storage_manager.extend(MAX_PAGES);
+    using Policy::evict;
+
+    ClockPolicy(size_t cacheSize) : slots(cacheSize) {
+        resize(cacheSize);
     }
-    
-    ~BufferManager() {
-        for (auto& pair : pageMap) {
-            flushPage(pair.first);
+
+    bool touch(PageID page_id) override {
+        FrameID slot = slots.find(page_id);
+        if (slot != INVALID_FRAME) {
+            // Only write the bit when it changes
+            if (!referenced[slot]) {
+                referenced[slot] = 1;
+            }
+            return true;
         }
-    }
 
-    SlottedPage& fix_page(int page_id) {
-        auto it = pageMap.find(page_id);
-        if (it != pageMap.end()) {
-            policy->touch(page_id);
-            return pageMap.find(page_id)->second;
+        if (free_slots.empty()) {
+            evict();
         }
+        slot = free_slots.back();
+        free_slots.pop_back();
+        ring[slot] = page_id;
+        referenced[slot] = 1;
+        slots.insert(page_id, slot);
+        return false;
+    }
 
-        if (pageMap.size() >= MAX_PAGES_IN_MEMORY) {
-            auto evictedPageId = policy->evict();
-            if(evictedPageId != INVALID_VALUE){
-                // std::cout << "Evicting page " << evictedPageId << "\n";
-                storage_manager.flush(evictedPageId, 
-                                      pageMap[evictedPageId]);
+    PageID evict(const std::function<bool(PageID)>& evictable) override {
+        // The first sweep clears the reference bits it passes, so two sweeps
+        // find a victim unless every page is excluded by the caller
+        for (size_t step = 0; step < 2 * ring.size(); step++) {
+            FrameID slot = hand;
+            hand = (hand + 1) % ring.size();
+            PageID page_id = ring[slot];
+            if (page_id == INVALID_PAGE) {
+                continue;
+            }
+            if (referenced[slot]) {
+                referenced[slot] = 0;
+            } else if (evictable(page_id)) {
+                clear_slot(slot);
+                return page_id;
             }
         }
-
-        auto page = storage_manager.load(page_id);
-        policy->touch(page_id);
-        // std::cout << "Loading page: " << page_id << "\n";
-        pageMap[page_id] = std::move(*page);
-        return pageMap[page_id];
+        return INVALID_PAGE;
     }
 
-    void flushPage(int page_id) {
-        storage_manager.flush(page_id, pageMap[page_id]);
+    std::vector<PageID> victims(size_t count) const override {
+        // Unreferenced pages go first, in hand order, then the referenced ones
+        std::vector<PageID> pages;
+        for (uint8_t pass = 0; pass < 2; pass++) {
+            for (size_t step = 0; step < ring.size() && pages.size() < count; step++) {
+                size_t slot = (hand + step) % ring.size();
+                if (ring[slot] != INVALID_PAGE && referenced[slot] == pass) {
+                    pages.push_back(ring[slot]);
+                }
+            }
+        }
+        return pages;
     }
 
-    void extend(){
-        storage_manager.extend();
-    }
-    
-    size_t getNumPages(){
-        return storage_manager.num_pages;
+    void erase(PageID page_id) override {
+        FrameID slot = slots.find(page_id);
+        if (slot != INVALID_FRAME) {
+            clear_slot(slot);
+        }
     }
 
+    void resize(size_t capacity) override {
+        // Keep the pages in hand order and drop the ones that no longer fit
+        std::vector<std::pair<PageID, uint8_t>> pages;
+        for (size_t step = 0; step < ring.size(); step++) {
+            size_t slot = (hand + step) % ring.size();
+            if (ring[slot] != INVALID_PAGE) {
+                pages.emplace_back(ring[slot], referenced[slot]);
+            }
+        }
+        if (pages.size() > capacity) {
+            pages.erase(pages.begin(), pages.end() - capacity);
+        }
+
+        ring.assign(capacity, INVALID_PAGE);
+        referenced.assign(capacity, 0);
+        slots = PageTable(capacity);
+        free_slots.clear();
+        for (size_t slot = capacity; slot > pages.size(); slot--) {
+            free_slots.push_back(slot - 1);
+        }
+        for (FrameID slot = 0; slot < pages.size(); slot++) {
+            ring[slot] = pages[slot].first;
+            referenced[slot] = pages[slot].second;
+            slots.insert(pages[slot].first, slot);
+        }
+        hand = 0;
+    }
 };
 
-template<typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize>
-class BTree {
-    public:
-        struct Node {
-            /// The level in the tree.
-            uint16_t level;
+// 2Q (Johnson and Shasha): pages seen once wait in the A1in FIFO.
+// They are promoted to the Am LRU list only when referenced again after
+// falling out of A1in, which A1out remembers. A large scan therefore
+// cycles through A1in and leaves the hot pages in Am alone.
+class TwoQPolicy : public Policy {
+private:
+    enum Queue : uint8_t { A1IN, AM, A1OUT };
 
-            /// The number of children.
-            uint16_t count;
+    struct Entry {
+        Queue queue;
+        std::list<PageID>::iterator position;
+    };
 
-            /// TODO: Add additional members as needed
-            uint64_t page_id;
-            uint16_t splits;
-            uint64_t parent;
-            bool dirty;
+    std::list<PageID> a1in;
+    std::list<PageID> am;
+    std::list<PageID> a1out;
+    std::unordered_map<PageID, Entry> map;
 
-            // Constructor
-            Node(uint16_t level, uint16_t count)
-                : level(level), count(count), page_id(0), splits(0),
-                parent(0), dirty(false) {}
+    size_t cacheSize;
+    size_t kin;
+    size_t kout;
 
-            /// Is the node a leaf node?
-            bool is_leaf() const { return level == 0; }
-            bool is_full(uint32_t capacity) const { return count >= capacity; }
-            bool splits_needed(uint32_t capacity) const { return count > capacity; }
-            void is_dirty() { dirty = true; }
-        };
+    PageID evict_from(Queue queue, const std::function<bool(PageID)>& evictable) {
+        std::list<PageID>& list = queue == A1IN ? a1in : am;
+        for (auto it = list.rbegin(); it != list.rend(); ++it) {
+            if (!evictable(*it)) {
+                continue;
+            }
+            PageID evictedPageId = *it;
+            auto position = std::next(it).base();
+            if (queue == A1IN) {
+                // Remember the page in A1out; splicing does not allocate
+                a1out.splice(a1out.begin(), a1in, position);
+                map[evictedPageId] = {A1OUT, a1out.begin()};
+                trim_a1out();
+            } else {
+                am.erase(position);
+                map.erase(evictedPageId);
+            }
+            return evictedPageId;
+        }
+        return INVALID_PAGE;
+    }
 
-        struct InnerNode: public Node {
-            /// The capacity of a node.
-            /// TODO think about the capacity that the nodes have.
-            static constexpr uint32_t kCapacity = 42;
+    void trim_a1out() {
+        while (a1out.size() > kout) {
+            map.erase(a1out.back());
+            a1out.pop_back();
+        }
+    }
 
-            /// The keys.
-            KeyT keys[kCapacity - 1];
+public:
+    using Policy::evict;
 
-            /// The children.
-            uint64_t children[kCapacity];
+    TwoQPolicy(size_t cacheSize) {
+        resize(cacheSize);
+    }
 
-            /// Constructor.
-            InnerNode() : Node(0, 0) {}
+    bool touch(PageID page_id) override {
+        auto it = map.find(page_id);
+        if (it != map.end() && it->second.queue == AM) {
+            am.splice(am.begin(), am, it->second.position);
+            return true;
+        }
+        if (it != map.end() && it->second.queue == A1IN) {
+            return true;
+        }
 
-            /// Get the index of the first key that is not less than than a provided key.
-            /// @param[in] key          The key that should be searched.
-            std::pair<uint32_t, bool> lower_bound(const KeyT &key) {
-            // TODO: remove the below lines of code 
-                // and add your implementation here
-                // UNUSED(key);
-                if (this->count == 0) {
-                    return {0, false};
-                }
-                if (key < keys[0]) {
-                    return {0, false};
-                }
-                for (uint32_t i = 0; i < static_cast<uint32_t>(this->count - 1); i++) {
-                    if (key >= keys[i] && key < keys[i + 1]) {
-                        return {i + 1, false};
-                    }
-                }
-                return {this->count - 1, false};
-            }
+        if (a1in.size() + am.size() >= cacheSize) {
+            evict();
+            it = map.find(page_id);
+        }
+        if (it != map.end()) {
+            // Seen again shortly after leaving A1in: the page is hot
+            am.splice(am.begin(), a1out, it->second.position);
+            it->second = {AM, am.begin()};
+        } else {
+            a1in.push_front(page_id);
+            map[page_id] = {A1IN, a1in.begin()};
+        }
+        return false;
+    }
 
-            /// Insert a key.
-            /// @param[in] key          The separator that should be inserted.
-            /// @param[in] split_page   The id of the split page that should be inserted.
-            void insert(const KeyT &key, uint64_t split_page) {
-            // TODO: remove the below lines of code 
-                // and add your implementation here
-            // UNUSED(key);
-            // UNUSED(split_page);
-            uint32_t position = lower_bound(key).first;
-            for (uint32_t i = this -> count; i > position; i--) {
-                keys[i] = keys[i-1];
-                children[i + 1] = children[i];
-            }
-            keys[position] = key;
-            children[position + 1] = split_page;
-            this -> count++;
-            this -> dirty = true;
+    PageID evict(const std::function<bool(PageID)>& evictable) override {
+        Queue first = (a1in.size() > kin || am.empty()) ? A1IN : AM;
+        PageID evictedPageId = evict_from(first, evictable);
+        if (evictedPageId == INVALID_PAGE) {
+            evictedPageId = evict_from(first == A1IN ? AM : A1IN, evictable);
+        }
+        return evictedPageId;
+    }
+
+    std::vector<PageID> victims(size_t count) const override {
+        std::vector<PageID> pages;
+        bool a1in_first = a1in.size() > kin || am.empty();
+        for (const std::list<PageID>* list : {a1in_first ? &a1in : &am, a1in_first ? &am : &a1in}) {
+            for (auto it = list->rbegin(); it != list->rend() && pages.size() < count; ++it) {
+                pages.push_back(*it);
             }
+        }
+        return pages;
+    }
 
-            /// Split the inner node.
-            /// @param[in] inner_node       The inner node being split.
-            /// @return                 The separator key.
-            KeyT split(InnerNode* inner_node) {
-                // TODO: remove the below lines of code 
-                // and add your implementation here
-                // UNUSED(inner_node);
-                uint32_t mid = this->count / 2;
-                KeyT separator = keys[mid];
-                uint32_t j = 0;
-                for (uint32_t i = mid + 1; i < this->count; i++) {
-                    inner_node->keys[j] = keys[i];
-                    inner_node->children[j] = children[i];
-                    j++;
-                }
-                inner_node->children[j] = children[this->count];
-                
-                inner_node->count = this->count - mid - 1;
-                inner_node->level = this->level;
-                this->count = mid;
+    void erase(PageID page_id) override {
+        auto it = map.find(page_id);
+        if (it != map.end() && it->second.queue != A1OUT) {
+            (it->second.queue == A1IN ? a1in : am).erase(it->second.position);
+            map.erase(it);
+        }
+    }
 
-                this->dirty = true;
-                inner_node->dirty = true;
-                return separator;
-            }
+    void resize(size_t capacity) override {
+        cacheSize = capacity;
+        // The sizes recommended in the paper: A1in a quarter of the pool,
+        // A1out as many entries as half the pool
+        kin = std::max<size_t>(1, capacity / 4);
+        kout = std::max<size_t>(1, capacity / 2);
+        while (a1in.size() + am.size() > cacheSize) {
+            evict();
+        }
+        trim_a1out();
+    }
+};
 
-        };
+// ARC (Megiddo and Modha): T1 holds pages seen once recently, T2 pages seen
+// at least twice. The ghost lists B1 and B2 remember pages evicted from
+// each, and hits on them shift the target size of T1 towards whichever
+// side would have kept the page. Scans only churn T1.
+class ArcPolicy : public Policy {
+private:
+    enum Queue : uint8_t { T1, T2, B1, B2 };
 
-        struct LeafNode: public Node {
-            /// The capacity of a node.
-            /// TODO think about the capacity that the nodes have.
-            static constexpr uint32_t kCapacity = 42;
+    struct Entry {
+        Queue queue;
+        std::list<PageID>::iterator position;
+    };
 
-            /// The keys.
-            KeyT keys[kCapacity];
+    std::list<PageID> lists[4];
+    std::unordered_map<PageID, Entry> map;
 
-            /// The values.
-            ValueT values[kCapacity];
+    size_t cacheSize;
 
-            /// Constructor.
-            LeafNode() : Node(0, 0) {}
+    // Target size of T1
+    size_t target = 0;
 
-            uint32_t find_position(const KeyT &key) {
-                uint32_t pos = 0;
-                while (pos < this -> count && keys[pos] < key) {
-                    pos++;
-                }
-                return pos;
-            }
+    size_t resident() const {
+        return lists[T1].size() + lists[T2].size();
+    }
 
-            /// Insert a key.
-            /// @param[in] key          The key that should be inserted.
-            /// @param[in] value        The value that should be inserted.
-            void insert(const KeyT &key, const ValueT &value) {
-                // HINT
-                // UNUSED(key);
-                // UNUSED(value);
-                // uint32_t position = find_position(key);
-                // if (position < this -> count && keys[position] == key) {
-                //     values[position] = value;
-                //     this -> dirty = true;
-                //     return;
-                // }
+    void move_to(Entry& entry, Queue queue) {
+        lists[queue].splice(lists[queue].begin(), lists[entry.queue], entry.position);
+        entry = {queue, lists[queue].begin()};
+    }
 
-                // for (uint32_t i = this -> count; i > position; i--) {
-                //     keys[i] = keys[i - 1];
-                //     values[i] = values[i - 1];
-                // }
-                // keys[position] = key;
-                // values[position] = value;
-                // this -> count++;
-                // this -> dirty = true;
-                uint32_t position = find_position(key);
-                if (position < this->count && keys[position] == key) {
-                    values[position] = value;
-                    this->dirty = true;
-                    return;
-                }
-                for (uint32_t i = this->count; i > position; i--) {
-                    keys[i] = keys[i - 1];
-                    values[i] = values[i - 1];
-                }
-                keys[position] = key;
-                values[position] = value;
-                this->count++;
-                this->dirty = true;
-            }
+    void drop_lru(Queue queue) {
+        map.erase(lists[queue].back());
+        lists[queue].pop_back();
+    }
 
-            /// Erase a key.
-            void erase(const KeyT &key) {
-                // HINT
-                // UNUSED(key);
-                uint32_t position = find_position(key);
-                if (position >= this -> count || keys[position] != key) {
-                    return;
-                }
-                for (uint32_t i = position; i < static_cast<uint32_t>(this -> count - 1); i++) {
-                    keys[i] = keys[i + 1];
-                    values[i] = values[i + 1];
-                }
-                this -> count--;
-                this -> dirty = true;
-            }
+    // Bound the directory to |T1| + |B1| <= c and a total of 2c entries
+    void trim_ghosts() {
+        while (lists[T1].size() + lists[B1].size() > cacheSize && !lists[B1].empty()) {
+            drop_lru(B1);
+        }
+        while (resident() + lists[B1].size() + lists[B2].size() > 2 * cacheSize &&
+               !lists[B2].empty()) {
+            drop_lru(B2);
+        }
+    }
 
-            /// Split the leaf node.
-            /// @param[in] leaf_node       The leaf node being split
-            /// @return                 The separator key.
-            KeyT split(LeafNode* leaf_node) {
-                // HINT
-                // UNUSED(leaf_node);
-                // uint32_t mid = this -> count / 2;
-                // uint32_t tmp = 0;
-                // for (uint32_t i = mid; i < this -> count; i++) {
-                //     leaf_node -> keys[tmp] = keys[i];
-                //     leaf_node -> values[tmp] = values[i];
-                //     tmp++;
-                // }
-                // leaf_node -> count = this -> count - mid;
-                // leaf_node -> level = 0;
-                // this -> count = mid;
-                // this -> dirty = true;
-                // leaf_node -> dirty = true;
-                // return leaf_node -> keys[0];
-                uint32_t mid = this->count / 2;
-                uint32_t j = 0;
-                for (uint32_t i = mid; i < this->count; i++) {
-                    leaf_node->keys[j] = keys[i];
-                    leaf_node->values[j] = values[i];
-                    j++;
-                }
-                leaf_node->count = j;
-                this->count = mid;
-                return leaf_node->keys[0];
+    bool replace_from_t1() const {
+        return !lists[T1].empty() && (lists[T1].size() > target || lists[T2].empty());
+    }
+
+    PageID evict_from(Queue queue, const std::function<bool(PageID)>& evictable) {
+        for (auto it = lists[queue].rbegin(); it != lists[queue].rend(); ++it) {
+            if (evictable(*it)) {
+                PageID evictedPageId = *it;
+                Entry& entry = map[evictedPageId];
+                move_to(entry, queue == T1 ? B1 : B2);
+                trim_ghosts();
+                return evictedPageId;
             }
+        }
+        return INVALID_PAGE;
+    }
 
-        };
+public:
+    using Policy::evict;
 
-        /// The root.
-        std::optional<uint64_t> root;
+    ArcPolicy(size_t cacheSize) : cacheSize(cacheSize) {}
 
-        /// The buffer manager
-        BufferManager& buffer_manager;
+    bool touch(PageID page_id) override {
+        auto it = map.find(page_id);
+        if (it != map.end() && (it->second.queue == T1 || it->second.queue == T2)) {
+            move_to(it->second, T2);
+            return true;
+        }
 
-        /// Next page id.
-        /// You don't need to worry about about the page allocation.
-        /// (Neither fragmentation, nor persisting free-space bitmaps)
-        /// Just increment the next_page_id whenever you need a new page.
-        uint64_t next_page_id;
+        if (resident() >= cacheSize) {
+            evict();
+            it = map.find(page_id);
+        }
+        if (it == map.end()) {
+            lists[T1].push_front(page_id);
+            map[page_id] = {T1, lists[T1].begin()};
+            trim_ghosts();
+            return false;
+        }
 
-        /// Constructor.
-        BTree(BufferManager &buffer_manager): buffer_manager(buffer_manager) {
-            // TODO
-            next_page_id = 1;
-            root = std::nullopt;
+        // Ghost hit: adapt the target, then the page is frequent
+        size_t b1 = lists[B1].size();
+        size_t b2 = lists[B2].size();
+        if (it->second.queue == B1) {
+            target = std::min(cacheSize, target + std::max<size_t>(b2 / b1, 1));
+        } else {
+            size_t delta = std::max<size_t>(b1 / b2, 1);
+            target = target > delta ? target - delta : 0;
+        }
+        move_to(it->second, T2);
+        return false;
+    }
 
-            while (buffer_manager.getNumPages() < MAX_PAGES) {
-                buffer_manager.extend();
-            }
+    PageID evict(const std::function<bool(PageID)>& evictable) override {
+        Queue first = replace_from_t1() ? T1 : T2;
+        PageID evictedPageId = evict_from(first, evictable);
+        if (evictedPageId == INVALID_PAGE) {
+            evictedPageId = evict_from(first == T1 ? T2 : T1, evictable);
         }
+        return evictedPageId;
+    }
 
-        /// Lookup an entry in the tree.
-        /// @param[in] key      The key that should be searched.
-        std::optional<ValueT> lookup(const KeyT &key) {
-            // TODO
-            // UNUSED(key);
-            // return std::optional<ValueT>();
-            if (!root.has_value()) {
-                return std::nullopt;
-            }
-            uint64_t curr = *root;
-            while (1) {
-                SlottedPage& page = buffer_manager.fix_page(curr);
-                Node* node = reinterpret_cast<Node*>(page.page_data.get());
-                
-                if (node->is_leaf()) {
-                    LeafNode* leaf = reinterpret_cast<LeafNode*>(node);
-                    uint32_t position = leaf->find_position(key);
-                    if (position < leaf->count && leaf->keys[position] == key) {
-                        return leaf->values[position];
-                    }
-                    return std::nullopt;
-                } else {
-                    InnerNode* inner = reinterpret_cast<InnerNode*>(node);
-                    uint32_t position = inner->lower_bound(key).first;
-                    curr = inner->children[position];
-                }
+    std::vector<PageID> victims(size_t count) const override {
+        std::vector<PageID> pages;
+        Queue first = replace_from_t1() ? T1 : T2;
+        for (Queue queue : {first, first == T1 ? T2 : T1}) {
+            for (auto it = lists[queue].rbegin(); it != lists[queue].rend() && pages.size() < count; ++it) {
+                pages.push_back(*it);
             }
         }
+        return pages;
+    }
 
-        /// Erase an entry in the tree.
-        /// @param[in] key      The key that should be searched.
-        void erase(const KeyT &key) {
-            // TODO
-            // UNUSED(key);
-            if (!root.has_value()) {
-                return;
-            }
-            uint64_t curr = *root;
-            while (1) {
-                SlottedPage& page = buffer_manager.fix_page(curr);
-                Node* node = reinterpret_cast<Node*>(page.page_data.get());
+    void erase(PageID page_id) override {
+        auto it = map.find(page_id);
+        if (it != map.end() && (it->second.queue == T1 || it->second.queue == T2)) {
+            lists[it->second.queue].erase(it->second.position);
+            map.erase(it);
+        }
+    }
 
-                if (node -> is_leaf()) {
-                    LeafNode* leaf = reinterpret_cast<LeafNode*>(node);
-                    leaf -> erase(key);
-                    return;
-                } else {
-                    InnerNode* inner = reinterpret_cast<InnerNode*>(node);
-                    uint32_t position = inner -> lower_bound(key).first;
-                    curr = inner -> children[position];
-                }
-            }
+    void resize(size_t capacity) override {
+        cacheSize = capacity;
+        target = std::min(target, cacheSize);
+        while (resident() > cacheSize) {
+            evict();
         }
+        trim_ghosts();
+    }
+};
 
-        /// Inserts a new entry into the tree.
-        /// @param[in] key      The key that should be inserted.
-        /// @param[in] value    The value that should be inserted.
-        void insert(const KeyT &key, const ValueT &value) {
-            // TODO
-            // UNUSED(key);
-            // UNUSED(value);
-            if (!root.has_value()) {
-                uint64_t page_id = next_page_id++;
-                auto& page = buffer_manager.fix_page(page_id);
-                auto leaf = reinterpret_cast<LeafNode*>(page.page_data.get());
-                *leaf = LeafNode();
-                leaf->insert(key, value);
-                root = page_id;
-                return;
-            }
+enum PolicyType { LRU, CLOCK, TWO_Q, ARC };
 
-            uint64_t curr = *root;
-            std::vector<uint64_t> path;
+std::unique_ptr<Policy> make_policy(PolicyType policy_type, size_t capacity) {
+    switch (policy_type) {
+        case CLOCK: return std::make_unique<ClockPolicy>(capacity);
+        case TWO_Q: return std::make_unique<TwoQPolicy>(capacity);
+        case ARC: return std::make_unique<ArcPolicy>(capacity);
+        case LRU: break;
+    }
+    return std::make_unique<LruPolicy>(capacity);
+}
 
-            while (1) {
-                path.push_back(curr);
-                SlottedPage& page = buffer_manager.fix_page(curr);
-                Node* node = reinterpret_cast<Node*>(page.page_data.get());
-
-                if (node->is_leaf()) {
-                    LeafNode* leaf = reinterpret_cast<LeafNode*>(node);
-                    if (!leaf->is_full(LeafNode::kCapacity)) {
-                        leaf->insert(key, value);
-                        return;
-                    }
+// BUFFERED copies pages into a pool of frames with its own replacement.
+// MMAP maps the database file and leaves caching and write-back to the
+// kernel: page i lives at offset i * PAGE_SIZE of the mapping.
+enum StorageMode { BUFFERED, MMAP };
 
-                    uint64_t new_page_id = next_page_id++;
-                    SlottedPage& new_page = buffer_manager.fix_page(new_page_id);
-                    auto new_leaf = reinterpret_cast<LeafNode*>(new_page.page_data.get());
-                    *new_leaf = LeafNode();
+// Whether changes are logged, and whether an operation waits for its log
+// record to be synced (SYNC_COMMIT) or leaves that to the background
+// writer, which syncs the log every BACKGROUND_WRITER_INTERVAL, so a crash
+// loses at most the last few milliseconds (ASYNC_COMMIT). MMAP mode does
+// not log, as the kernel writes mapped pages whenever it likes.
+enum CommitMode { NO_LOGGING, ASYNC_COMMIT, SYNC_COMMIT };
 
-                    KeyT separator = leaf->split(new_leaf);
-                    if (key >= separator) {
-                        new_leaf->insert(key, value);
-                    } else {
-                        leaf->insert(key, value);
-                    }
-                    if (path.size() == 1) {
-                        uint64_t new_root_id = next_page_id++;
-                        auto& new_root_page = buffer_manager.fix_page(new_root_id);
-                        auto new_root = reinterpret_cast<InnerNode*>(new_root_page.page_data.get());
-                        *new_root = InnerNode();
-                        new_root->level = 1;
-                        new_root->children[0] = curr;
-                        new_root->keys[0] = separator;
-                        new_root->children[1] = new_page_id;
-                        new_root->count = 2;
-                        root = new_root_id;
-                    } else {
-                        path.pop_back();
-                        uint64_t parent_id = path.back();
-                        auto& parent_page = buffer_manager.fix_page(parent_id);
-                        auto parent = reinterpret_cast<InnerNode*>(parent_page.page_data.get());
-                        
-                        uint32_t child_idx = 0;
-                        while (child_idx < parent->count && parent->children[child_idx] != curr) {
-                            child_idx++;
-                        }
-                        
-                        for (uint32_t i = parent->count; i > child_idx + 1; i--) {
-                            parent->children[i] = parent->children[i-1];
-                            parent->keys[i-1] = parent->keys[i-2];
-                        }
-                        parent->keys[child_idx] = separator;
-                        parent->children[child_idx + 1] = new_page_id;
-                        parent->count++;
-                    }
-                    return;
-                } else {
-                    InnerNode* inner = reinterpret_cast<InnerNode*>(node);
-                    uint32_t position = inner->lower_bound(key).first;
-                    curr = inner->children[position];
-                }
-            }
+// Access hints passed on to the kernel
+enum AccessPattern { RANDOM_ACCESS, SEQUENTIAL_ACCESS };
 
-        }
+constexpr size_t MAX_PAGES_IN_MEMORY = 10;
 
-        void insertIntoParent(std::vector<uint64_t>& path, KeyT separator, uint64_t new_page_id) {
-            if (path.size() == 1) {
-                uint64_t new_root_id = next_page_id++;
-                auto& new_root_page = buffer_manager.fix_page(new_root_id);
-                auto new_root = reinterpret_cast<InnerNode*>(new_root_page.page_data.get());
-                *new_root = InnerNode();
-                new_root->level = 1;
-                new_root->children[0] = *root;
-                new_root->keys[0] = separator;
-                new_root->children[1] = new_page_id;
-                new_root->count = 1;
-                root = new_root_id;
-            } else {
-                path.pop_back();
-                uint64_t parent_id = path.back();
-                auto& parent_page = buffer_manager.fix_page(parent_id);
-                auto parent = reinterpret_cast<InnerNode*>(parent_page.page_data.get());
-                uint32_t pos = parent->lower_bound(separator).first;
-                
-                for (uint32_t i = parent->count; i > pos; i--) {
-                    parent->keys[i] = parent->keys[i - 1];
-                    parent->children[i + 1] = parent->children[i];
-                }
-                parent->keys[pos] = separator;
-                parent->children[pos + 1] = new_page_id;
-                parent->count++;
-                
-                if (parent->is_full(InnerNode::kCapacity)) {
-                    uint64_t new_inner_id = next_page_id++;
-                    auto& new_inner_page = buffer_manager.fix_page(new_inner_id);
-                    auto new_inner = reinterpret_cast<InnerNode*>(new_inner_page.page_data.get());
-                    *new_inner = InnerNode();
-                    
-                    KeyT new_separator = parent->split(new_inner);
-                    insertIntoParent(path, new_separator, new_inner_id);
-                }
-            }
-        }
-};
+// Default buffer pool budget in bytes
+constexpr size_t DEFAULT_POOL_SIZE = MAX_PAGES_IN_MEMORY * PAGE_SIZE;
 
-int main(int argc, char* argv[]) {
-    bool execute_all = false;
-    std::string selected_test = "-1";
+// How often the background writer looks for cold dirty frames
+constexpr auto BACKGROUND_WRITER_INTERVAL = std::chrono::milliseconds(10);
 
-    if(argc < 2) {
-        execute_all = true;
-    } else {
-        selected_test = argv[1];
+// The pool is split into shards once each gets at least this many frames
+constexpr size_t MIN_FRAMES_PER_SHARD = 128;
+constexpr size_t MAX_BUFFER_SHARDS = 64;
+
+// Frame latch: a shared_mutex plus a version that every exclusive holder
+// bumps on acquire and release (odd while held). Besides locking, a reader
+// may read the frame optimistically, without writing to the latch, and then
+// validate that the version did not move.
+class HybridLatch {
+private:
+    std::shared_mutex mutex;
+    std::atomic<uint64_t> version{0};
+
+    void bump_locked() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
     }
 
-    using BTree = BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024>;
+public:
+    void lock() {
+        mutex.lock();
+        bump_locked();
+    }
 
-    // Test 1: InsertEmptyTree
-    if(execute_all || selected_test == "1") {
-        std::cout<<"...Starting Test 1"<<std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
+    bool try_lock() {
+        if (!mutex.try_lock()) {
+            return false;
+        }
+        bump_locked();
+        return true;
+    }
 
-        ASSERT_WITH_MESSAGE(tree.root.has_value() == false, 
-            "tree.root is not nullptr");
+    void unlock() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        mutex.unlock();
+    }
 
-        tree.insert(42, 21);
+    void lock_shared() { mutex.lock_shared(); }
+    bool try_lock_shared() { return mutex.try_lock_shared(); }
+    void unlock_shared() { mutex.unlock_shared(); }
 
-        ASSERT_WITH_MESSAGE(tree.root.has_value(), 
-            "tree.root is still nullptr after insertion");
-        
-        std::string test = "inserting an element into an empty B-Tree";
+    // Start an optimistic read; an odd version means a writer holds the latch
+    uint64_t optimistic_version() const {
+        return version.load(std::memory_order_acquire);
+    }
 
-        // Fix root page and obtain root node pointer
-        SlottedPage* root_page = &buffer_manager.fix_page(*tree.root);
-        auto root_node = reinterpret_cast<BTree::Node*>(root_page->page_data.get());
+    static bool is_locked(uint64_t version) { return version & 1; }
 
-        ASSERT_WITH_MESSAGE(root_node->is_leaf() == true, 
-            test + " does not create a leaf node.");
-        ASSERT_WITH_MESSAGE(root_node->count == 1,
-            test + " does not create a leaf node with count = 1.");
+    // True if nothing was modified since optimistic_version() returned version
+    bool validate(uint64_t version) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return this->version.load(std::memory_order_relaxed) == version;
+    }
 
-        std::cout << "\033[1m\033[32mPassed: Test 1\033[0m" << std::endl;
+    // Lock exclusively if nothing was modified since version was read
+    bool try_upgrade(uint64_t version) {
+        lock();
+        if (this->version.load(std::memory_order_relaxed) != version + 1) {
+            unlock();
+            return false;
+        }
+        return true;
     }
+};
 
-    // Test 2: InsertLeafNode
-    if(execute_all || selected_test == "2") {
-        std::cout<<"...Starting Test 2"<<std::endl;
-        BufferManager buffer_manager;
-        BTree tree( buffer_manager);
-        
-        ASSERT_WITH_MESSAGE(tree.root.has_value() == false, 
-            "tree.root is not nullptr");
+// Frame descriptor for one PAGE_SIZE slot of the frame array
+struct BufferFrame {
+    // Atomic because optimistic readers check it without any latch
+    std::atomic<PageID> page_id{INVALID_PAGE};
+    SlottedPage page;
 
-        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
-            tree.insert(i, 2 * i);
-        }
-        ASSERT_WITH_MESSAGE(tree.root.has_value(), 
-            "tree.root is still nullptr after insertion");
+    // Number of live PageGuards; pinned frames are never evicted.
+    // Pins are taken under the shard latch, unpinning needs no latch.
+    std::atomic<uint32_t> pin_count{0};
 
-        std::string test = "inserting BTree::LeafNode::kCapacity elements into an empty B-Tree";
+    // The frame differs from the page on disk
+    std::atomic<bool> dirty{false};
 
-        SlottedPage* root_page = &buffer_manager.fix_page(*tree.root);
-        auto root_node = reinterpret_cast<BTree::Node*>(root_page->page_data.get());
-        auto root_inner_node = static_cast<BTree::InnerNode*>(root_node);
+    // The LSN of the last logged change; the page is not written before
+    // the log is durable up to it
+    std::atomic<uint64_t> page_lsn{0};
 
-        ASSERT_WITH_MESSAGE(root_node->is_leaf() == true, 
-            test + " creates an inner node as root.");
-        ASSERT_WITH_MESSAGE(root_inner_node->count == BTree::LeafNode::kCapacity,
-            test + " does not store all elements.");
+    // Set by optimistic reads, which bypass the replacement policy;
+    // eviction gives such a page a second chance
+    std::atomic<bool> referenced{false};
 
-        std::cout << "\033[1m\033[32mPassed: Test 2\033[0m" << std::endl;
-    }
+    // A writer is cleaning the frame outside the shard latch; it cannot be
+    // evicted. Guarded by the shard latch, like unguarded.
+    bool in_writeback = false;
 
-    // Test 3: InsertLeafNodeSplit
-    if (execute_all || selected_test == "3") {
-        std::cout << "...Starting Test 3" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
+    // Handed out unpinned by fix_page; only written back on eviction
+    bool unguarded = false;
 
-        ASSERT_WITH_MESSAGE(tree.root.has_value() == false, 
-            "tree.root is not nullptr");
+    // The frame whose page holds a swizzled reference to this one, and the
+    // number of swizzled references this page holds. Both only change under
+    // the exclusive latch of the frame holding the references; setting
+    // parent_frame also takes this frame's shard latch.
+    std::atomic<FrameID> parent_frame{INVALID_FRAME};
+    std::atomic<uint32_t> swizzled_children{0};
 
-        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
-            tree.insert(i, 2 * i);
-        }
-        ASSERT_WITH_MESSAGE(tree.root.has_value(), 
-            "tree.root is still nullptr after insertion");
-        
-        SlottedPage* root_page = &buffer_manager.fix_page(*tree.root);
-        auto root_node = reinterpret_cast<BTree::Node*>(root_page->page_data.get());
-        auto root_inner_node = static_cast<BTree::InnerNode*>(root_node);
-        
-        assert(root_inner_node->is_leaf());
-        assert(root_inner_node->count == BTree::LeafNode::kCapacity);
+    // Held shared by readers and exclusively by the guard that modifies the
+    // page; optimistic readers only look at its version
+    HybridLatch latch;
 
-        // Let there be a split...
-        tree.insert(424242, 42);
+    explicit BufferFrame(char* frame_data) : page(frame_data) {}
+};
 
-        std::string test =
-            "inserting BTree::LeafNode::kCapacity + 1 elements into an empty B-Tree";
-        
-        ASSERT_WITH_MESSAGE(tree.root.has_value() != false, test + " removes the root :-O");
+class buffer_full_error : public std::exception {
+public:
+    const char* what() const noexcept override {
+        return "buffer is full: every frame is pinned";
+    }
+};
 
-        SlottedPage* root_page1 = &buffer_manager.fix_page(*tree.root);
-        root_node = reinterpret_cast<BTree::Node*>(root_page1->page_data.get());
-        root_inner_node = static_cast<BTree::InnerNode*>(root_node);
+class BufferManager;
 
-        ASSERT_WITH_MESSAGE(root_inner_node->is_leaf() == false, 
-            test + " does not create a root inner node");
-        ASSERT_WITH_MESSAGE(root_inner_node->count == 2, 
-            test + " creates a new root with count != 2");
+// RAII handle on a pinned and latched page.
+// Shared guards on a page may coexist; an exclusive guard is the only one.
+class PageGuard {
+private:
+    BufferManager* buffer_manager = nullptr;
+    BufferFrame* frame = nullptr;
+    bool exclusive = false;
 
-        std::cout << "\033[1m\033[32mPassed: Test 3\033[0m" << std::endl;
-    }
+public:
+    PageGuard() = default;
 
-    // Test 4: LookupEmptyTree
-    if (execute_all || selected_test == "4") {
-        std::cout << "...Starting Test 4" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
+    PageGuard(BufferManager* buffer_manager, BufferFrame* frame, bool exclusive)
+        : buffer_manager(buffer_manager), frame(frame), exclusive(exclusive) {}
 
-        std::string test = "searching for a non-existing element in an empty B-Tree";
+    PageGuard(const PageGuard&) = delete;
+    PageGuard& operator=(const PageGuard&) = delete;
 
-        ASSERT_WITH_MESSAGE(tree.lookup(42).has_value() == false, 
-            test + " seems to return something :-O");
+    PageGuard(PageGuard&& other) noexcept
+        : buffer_manager(other.buffer_manager), frame(other.frame),
+          exclusive(other.exclusive) {
+        other.frame = nullptr;
+    }
 
-        std::cout << "\033[1m\033[32mPassed: Test 4\033[0m" << std::endl;
+    PageGuard& operator=(PageGuard&& other) noexcept {
+        if (this != &other) {
+            release();
+            buffer_manager = other.buffer_manager;
+            frame = other.frame;
+            exclusive = other.exclusive;
+            other.frame = nullptr;
+        }
+        return *this;
     }
 
-    // Test 5: LookupSingleLeaf
-    if (execute_all || selected_test == "5") {
-        std::cout << "...Starting Test 5" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
+    ~PageGuard() { release(); }
 
-        // Fill one page
-        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
-            tree.insert(i, 2 * i);
-            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(), 
-                "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
-        }
+    bool is_valid() const { return frame != nullptr; }
+    bool is_exclusive() const { return exclusive; }
+    PageID page_id() const { return frame->page_id; }
+    SlottedPage& page() const { return frame->page; }
+    BufferFrame* get_frame() const { return frame; }
 
-        // Lookup all values
-        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
-            auto v = tree.lookup(i);
-            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-            ASSERT_WITH_MESSAGE(*v == 2 * i, "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
-        }
+    // Record that the page was modified; requires an exclusive guard
+    void mark_dirty() const {
+        assert(exclusive);
+        frame->dirty = true;
+    }
 
-        std::cout << "\033[1m\033[32mPassed: Test 5\033[0m" << std::endl;
+    // View the page contents as a node or other on-page structure
+    template<typename T>
+    T* as() const {
+        return reinterpret_cast<T*>(frame->page.page_data.get());
     }
 
-    // Test 6: LookupSingleSplit
-    if (execute_all || selected_test == "6") {
-        std::cout << "...Starting Test 6" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
+    // Unlatch and unpin early; the guard is empty afterwards
+    void release();
+};
 
-        // Insert values
-        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
-            tree.insert(i, 2 * i);
-        }
+// Handle on a page that is read without pinning or latching it. Whatever is
+// read through it is only meaningful once validate() returns true, and the
+// reads themselves must not trust any value (e.g. bound array indices).
+class OptimisticGuard {
+private:
+    BufferFrame* frame = nullptr;
+    uint64_t version = 0;
+    PageID page_id_ = INVALID_PAGE;
 
-        tree.insert(BTree::LeafNode::kCapacity, 2 * BTree::LeafNode::kCapacity);
-        ASSERT_WITH_MESSAGE(tree.lookup(BTree::LeafNode::kCapacity).has_value(),
-            "searching for the just inserted key k=" + std::to_string(BTree::LeafNode::kCapacity + 1) + " yields nothing");
+public:
+    OptimisticGuard() = default;
 
-        // Lookup all values
-        for (auto i = 0ul; i < BTree::LeafNode::kCapacity + 1; ++i) {
-            auto v = tree.lookup(i);
-            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-            ASSERT_WITH_MESSAGE(*v == 2 * i, 
-                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
-        }
+    OptimisticGuard(BufferFrame* frame, uint64_t version, PageID page_id)
+        : frame(frame), version(version), page_id_(page_id) {}
 
-        std::cout << "\033[1m\033[32mPassed: Test 6\033[0m" << std::endl;
+    bool is_valid() const { return frame != nullptr; }
+    PageID page_id() const { return page_id_; }
+    uint64_t get_version() const { return version; }
+    BufferFrame* get_frame() const { return frame; }
+
+    template<typename T>
+    const T* as() const {
+        return reinterpret_cast<const T*>(frame->page.page_data.get());
     }
 
-    // Test 7: LookupMultipleSplitsIncreasing
-    if (execute_all || selected_test == "7") {
-        std::cout << "...Starting Test 7" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
-        auto n = 40 * BTree::LeafNode::kCapacity;
+    // The page was neither modified nor evicted since the guard was taken
+    bool validate() const { return frame->latch.validate(version); }
+};
 
-        // Insert values
-        for (auto i = 0ul; i < n; ++i) {
-            tree.insert(i, 2 * i);
-            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(),
-                "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
+class BufferManager {
+public:
+    // Where a page keeps the references to other pages that may be
+    // swizzled: an array and its length
+    using ReferenceFinder = std::pair<PageID*, uint32_t> (*)(char* page);
+
+    // Redoes a logged change of a client-defined type on a page
+    using RedoHandler = void (*)(char* page, uint8_t type, const char* payload, uint32_t size);
+
+private:
+    struct FrameMemoryDeleter {
+        size_t reserved_size;
+
+        void operator()(char* data) const { munmap(data, reserved_size); }
+    };
+
+    struct PageBufferDeleter {
+        void operator()(char* data) const { std::free(data); }
+    };
+    using PageBuffer = std::unique_ptr<char, PageBufferDeleter>;
+
+    // One partition of the pool with its own latch. A page belongs to the
+    // shard its id hashes to and is only cached in that shard's frames,
+    // which are the frames with frame_id % num_shards == shard index.
+    struct BufferShard {
+        std::mutex mutex;
+
+        // Bumped before and after every page table change (odd meanwhile),
+        // so that lookups can also probe the table without the latch
+        std::atomic<uint64_t> version{0};
+
+        // The current page table. Tables replaced by resize() are kept
+        // until destruction, as an optimistic lookup may still probe them.
+        std::atomic<PageTable*> page_table{nullptr};
+        std::vector<std::unique_ptr<PageTable>> page_tables;
+
+        std::unique_ptr<Policy> policy;
+        std::vector<FrameID> free_frames;
+        size_t num_frames = 0;
+        size_t frames_in_writeback = 0;
+        // Frames reserved by prefetch reads that have not completed
+        size_t frames_prefetching = 0;
+        std::condition_variable writeback_done_cv;
+
+        PageTable& table() { return *page_table.load(std::memory_order_relaxed); }
+
+        void begin_table_write() {
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
         }
 
-        // Lookup all values
-        for (auto i = 0ul; i < n; ++i) {
-            auto v = tree.lookup(i);
-            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-            ASSERT_WITH_MESSAGE(*v == 2 * i,
-                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+        void end_table_write() {
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
         }
-        std::cout << "\033[1m\033[32mPassed: Test 7\033[0m" << std::endl;
+    };
+
+    StorageManager storage_manager;
+
+    // One contiguous, page-aligned address range holding every frame.
+    // It is reserved for the largest pool up front, so resizing never
+    // moves a frame; memory is only committed once a frame is used.
+    std::unique_ptr<char, FrameMemoryDeleter> frame_memory;
+    size_t max_frames;
+
+    // Frame descriptors, reserved the same way so that a frame id taken
+    // from a page table can always be dereferenced. Descriptors are
+    // constructed when the pool first grows over them and stay until
+    // destruction. Only resize() changes frame_count, holding every shard
+    // latch.
+    std::unique_ptr<char, FrameMemoryDeleter> descriptor_memory;
+    BufferFrame* frames;
+    size_t frame_count = 0;
+    size_t constructed_frames = 0;
+    std::mutex resize_mutex;
+
+    // Fixed at construction
+    std::unique_ptr<BufferShard[]> shards;
+    size_t num_shards;
+
+    StorageMode storage_mode;
+
+    // MMAP mode: pages below mapped_pages have a descriptor; growing the
+    // file and adding descriptors is serialized
+    std::atomic<size_t> mapped_pages{0};
+    std::mutex mapping_mutex;
+
+    // Prefetch reads not yet completed
+    std::mutex prefetch_mutex;
+    std::condition_variable prefetch_cv;
+    size_t prefetches_in_flight = 0;
+
+    // Background writer state
+    std::thread writer_thread;
+    std::mutex writer_mutex;
+    std::condition_variable writer_cv;
+    std::atomic<bool> writer_wakeup{false};
+    bool stop_writer = false;
+
+    // Null unless swizzling is enabled
+    ReferenceFinder reference_finder = nullptr;
+
+    // Null with NO_LOGGING and in MMAP mode
+    std::unique_ptr<WriteAheadLog> wal;
+    CommitMode commit_mode;
+    std::mutex checkpoint_mutex;
+
+    BufferShard& shard_of(PageID page_id) {
+        // splitmix64 finalizer, so shard choice and page table slot do not
+        // depend on the same bits
+        uint64_t hash = page_id;
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+        hash ^= hash >> 31;
+        return shards[hash % num_shards];
     }
 
-    // Test 8: LookupMultipleSplitsDecreasing
-    if (execute_all || selected_test == "8") {
-        std::cout << "...Starting Test 8" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
-        auto n = 10 * BTree::LeafNode::kCapacity;
+    BufferShard& shard_of_frame(FrameID frame_id) {
+        return shards[frame_id % num_shards];
+    }
 
-        // Insert values
-        for (auto i = n; i > 0; --i) {
-            tree.insert(i, 2 * i);
-            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(),
+    FrameID frame_id_of(const BufferFrame* frame) const {
+        return static_cast<FrameID>(frame - frames);
+    }
+
+    // Turn the swizzled references of a page back into page ids. The caller
+    // holds the frame latch exclusively, which keeps the children resident.
+    void unswizzle_references(BufferFrame& frame) {
+        if (frame.swizzled_children.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        auto [references, count] = reference_finder(frame.page.page_data.get());
+        uint32_t unswizzled = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (is_swizzled(references[i])) {
+                BufferFrame& child = frames[swizzled_frame(references[i])];
+                references[i] = child.page_id;
+                child.parent_frame.store(INVALID_FRAME, std::memory_order_release);
+                unswizzled++;
+            }
+        }
+        assert(unswizzled == frame.swizzled_children);
+        UNUSED(unswizzled);
+        frame.swizzled_children = 0;
+    }
+
+    // Unswizzle the references to and from a page about to be dropped,
+    // without waiting for a latch. The caller holds the shard latch and has
+    // checked that the frame is unpinned.
+    // Returns false if a latch was busy; the page then has to stay.
+    bool try_unswizzle(FrameID frame_id) {
+        BufferFrame& frame = frames[frame_id];
+        if (frame.swizzled_children.load(std::memory_order_acquire) > 0) {
+            if (!frame.latch.try_lock()) {
+                return false;
+            }
+            unswizzle_references(frame);
+            frame.latch.unlock();
+        }
+
+        FrameID parent_id = frame.parent_frame.load(std::memory_order_acquire);
+        if (parent_id == INVALID_FRAME) {
+            return true;
+        }
+        BufferFrame& parent = frames[parent_id];
+        if (!parent.latch.try_lock()) {
+            return false;
+        }
+        // The parent may have unswizzled the reference meanwhile; the shard
+        // latch keeps it from being swizzled again
+        if (frame.parent_frame.load(std::memory_order_relaxed) == parent_id) {
+            auto [references, count] = reference_finder(parent.page.page_data.get());
+            PageID* reference = std::find(references, references + count, SWIZZLED_TAG | frame_id);
+            assert(reference != references + count);
+            *reference = frame.page_id;
+            parent.swizzled_children--;
+            frame.parent_frame.store(INVALID_FRAME, std::memory_order_relaxed);
+        }
+        parent.latch.unlock();
+        return true;
+    }
+
+    // The page of a frame as it goes to disk, with its swizzled references
+    // turned back into page ids; null if it holds none, so the frame can be
+    // written as is. The caller latches the frame, at least shared.
+    PageBuffer unswizzled_copy(const BufferFrame& frame) {
+        if (frame.swizzled_children.load(std::memory_order_relaxed) == 0) {
+            return nullptr;
+        }
+        PageBuffer copy(static_cast<char*>(std::aligned_alloc(PAGE_SIZE, PAGE_SIZE)));
+        std::memcpy(copy.get(), frame.page.page_data.get(), PAGE_SIZE);
+        auto [references, count] = reference_finder(copy.get());
+        for (uint32_t i = 0; i < count; i++) {
+            if (is_swizzled(references[i])) {
+                references[i] = frames[swizzled_frame(references[i])].page_id;
+            }
+        }
+        return copy;
+    }
+
+    // Append the changes of one operation to the log, and note the LSN in
+    // the frames they change
+    uint64_t append_log(WriteAheadLog::Change* changes, size_t num_changes, BufferFrame** changed_frames) {
+        uint64_t lsn = wal->append(changes, num_changes);
+        for (size_t i = 0; i < num_changes; i++) {
+            changed_frames[i]->page_lsn = lsn;
+        }
+        if (wal->buffered_bytes() >= LOG_BUFFER_SIZE) {
+            wal->flush(lsn);
+        }
+        return lsn;
+    }
+
+    // Write a frame back if it is dirty. The caller keeps the frame from
+    // being evicted; the shared latch keeps modifications out meanwhile.
+    void write_back(BufferFrame& frame) {
+        frame.latch.lock_shared();
+        if (frame.dirty.exchange(false)) {
+            if (wal) {
+                wal->flush(frame.page_lsn);
+            }
+            PageBuffer copy = unswizzled_copy(frame);
+            if (copy) {
+                storage_manager.flush(frame.page_id, SlottedPage(copy.get()));
+            } else {
+                storage_manager.flush(frame.page_id, frame.page);
+            }
+        }
+        frame.latch.unlock_shared();
+    }
+
+    // Write back dirty frames with all writes in flight at once and wait for
+    // them. The caller keeps the frames from being evicted. Unless
+    // wait_for_latch is set, a frame latched exclusively is skipped.
+    void write_back_batch(const std::vector<BufferFrame*>& batch, bool wait_for_latch) {
+        std::vector<BufferFrame*> latched;
+        std::vector<PageBuffer> copies;
+        std::vector<AsyncIO::Request> requests;
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        size_t pending = 0;
+        uint64_t max_lsn = 0;
+
+        for (BufferFrame* frame : batch) {
+            if (wait_for_latch) {
+                frame->latch.lock_shared();
+            } else if (!frame->latch.try_lock_shared()) {
+                continue;
+            }
+            latched.push_back(frame);
+            if (!frame->dirty.exchange(false)) {
+                continue;
+            }
+            max_lsn = std::max<uint64_t>(max_lsn, frame->page_lsn);
+            pending++;
+            char* data = frame->page.page_data.get();
+            if (PageBuffer copy = unswizzled_copy(*frame)) {
+                data = copy.get();
+                copies.push_back(std::move(copy));
+            }
+            requests.push_back({true, static_cast<uint64_t>(frame->page_id) * PAGE_SIZE,
+                                data, [&](bool ok) {
+                if (!ok) {
+                    std::cerr << "Error: Unable to write data to the file. \n";
+                    exit(-1);
+                }
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if (--pending == 0) {
+                    done_cv.notify_one();
+                }
+            }});
+        }
+
+        if (!requests.empty()) {
+            if (wal) {
+                wal->flush(max_lsn);
+            }
+            storage_manager.submit(requests);
+            std::unique_lock<std::mutex> lock(done_mutex);
+            done_cv.wait(lock, [&] { return pending == 0; });
+        }
+        for (BufferFrame* frame : latched) {
+            frame->latch.unlock_shared();
+        }
+    }
+
+    // Publish a prefetched page, unless it was loaded meanwhile
+    void finish_prefetch(FrameID frame_id, PageID page_id, bool ok) {
+        if (!ok) {
+            std::cerr << "Error: Unable to read data from the file. \n";
+            exit(-1);
+        }
+        BufferShard& shard = shard_of(page_id);
+        BufferFrame& frame = frames[frame_id];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.table().find(page_id) == INVALID_FRAME) {
+                frame.page_id = page_id;
+                shard.begin_table_write();
+                shard.table().insert(page_id, frame_id);
+                shard.end_table_write();
+                shard.policy->touch(page_id);
+            } else {
+                shard.free_frames.push_back(frame_id);
+            }
+            frame.pin_count--;
+            shard.frames_prefetching--;
+        }
+        shard.writeback_done_cv.notify_all();
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        if (--prefetches_in_flight == 0) {
+            prefetch_cv.notify_all();
+        }
+    }
+
+    // Write back a dirty frame of the shard without holding its latch
+    void write_back_unlatched(BufferShard& shard, BufferFrame& frame,
+                              std::unique_lock<std::mutex>& lock) {
+        frame.in_writeback = true;
+        shard.frames_in_writeback++;
+        lock.unlock();
+        write_back(frame);
+        lock.lock();
+        frame.in_writeback = false;
+        shard.frames_in_writeback--;
+        shard.writeback_done_cv.notify_all();
+    }
+
+    // Return a frame of the shard that holds no page, evicting a clean page
+    // if the shard is full. Returns INVALID_FRAME if the latch had to be
+    // dropped to clean a victim or to wait for the writer; the caller then
+    // retries, as the page it wants may have been loaded meanwhile.
+    // Unless may_wait is set, INVALID_FRAME is returned instead of cleaning
+    // or waiting.
+    FrameID allocate_frame(BufferShard& shard, std::unique_lock<std::mutex>& lock, bool may_wait = true) {
+        if (!shard.free_frames.empty()) {
+            FrameID frame_id = shard.free_frames.back();
+            shard.free_frames.pop_back();
+            return frame_id;
+        }
+
+        auto evictable = [&](PageID page_id) {
+            const BufferFrame& frame = frames[shard.table().find(page_id)];
+            return frame.pin_count == 0 && !frame.in_writeback;
+        };
+
+        // Clean victims only, so the miss path never writes under the latch.
+        // They must come from the cold end the background writer keeps
+        // clean; taking any clean page would throw out hot pages that are
+        // rarely modified, such as the upper levels of a tree.
+        size_t window = std::max<size_t>(1, shard.num_frames / 4);
+        size_t candidates = 0;
+        std::vector<PageID> referenced;
+        PageID evictedPageId = shard.policy->evict([&](PageID page_id) {
+            FrameID frame_id = shard.table().find(page_id);
+            BufferFrame& frame = frames[frame_id];
+            if (!evictable(page_id) || candidates >= window) {
+                return false;
+            }
+            if (frame.dirty) {
+                candidates++;
+                return false;
+            }
+            if (frame.referenced.load(std::memory_order_relaxed)) {
+                candidates++;
+                frame.referenced.store(false, std::memory_order_relaxed);
+                referenced.push_back(page_id);
+                return false;
+            }
+            // A page that cannot be unswizzled right now counts as pinned
+            if (!try_unswizzle(frame_id)) {
+                return false;
+            }
+            candidates++;
+            return true;
+        });
+        // Pages read optimistically count as used now
+        for (PageID page_id : referenced) {
+            shard.policy->touch(page_id);
+        }
+
+        if (evictedPageId == INVALID_PAGE) {
+            if (!referenced.empty()) {
+                return INVALID_FRAME;
+            }
+            // The writer fell behind: clean the coldest dirty page ourselves
+            writer_wakeup = true;
+            writer_cv.notify_one();
+            if (!may_wait) {
+                return INVALID_FRAME;
+            }
+            for (PageID page_id : shard.policy->victims(shard.num_frames)) {
+                if (evictable(page_id) && frames[shard.table().find(page_id)].dirty) {
+                    write_back_unlatched(shard, frames[shard.table().find(page_id)], lock);
+                    return INVALID_FRAME;
+                }
+            }
+            if (shard.frames_in_writeback == 0 && shard.frames_prefetching == 0) {
+                throw buffer_full_error();
+            }
+            shard.writeback_done_cv.wait(lock);
+            return INVALID_FRAME;
+        }
+
+        FrameID frame_id = shard.table().find(evictedPageId);
+        assert(frame_id != INVALID_FRAME);
+        BufferFrame& frame = frames[frame_id];
+        // std::cout << "Evicting page " << evictedPageId << "\n";
+        shard.begin_table_write();
+        shard.table().erase(evictedPageId);
+        shard.end_table_write();
+        frame.page_id = INVALID_PAGE;
+        frame.unguarded = false;
+        frame.page_lsn = 0;
+        return frame_id;
+    }
+
+    static char* reserve_frames(size_t size) {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "Error: Unable to allocate the buffer pool. \n";
+            exit(-1);
+        }
+        return static_cast<char*>(data);
+    }
+
+    static size_t physical_memory_size() {
+        return static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) *
+               static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    // Resize the shard's page table and policy to its current frames
+    void rebuild_shard(size_t shard_id) {
+        BufferShard& shard = shards[shard_id];
+        shard.num_frames = 0;
+        auto page_table = std::make_unique<PageTable>(frame_count / num_shards + 1);
+        for (FrameID frame_id = shard_id; frame_id < frame_count; frame_id += num_shards) {
+            shard.num_frames++;
+            if (frames[frame_id].page_id != INVALID_PAGE) {
+                page_table->insert(frames[frame_id].page_id, frame_id);
+            }
+        }
+        shard.begin_table_write();
+        shard.page_table.store(page_table.get(), std::memory_order_relaxed);
+        shard.end_table_write();
+        shard.page_tables.push_back(std::move(page_table));
+        shard.policy->resize(shard.num_frames);
+    }
+
+    std::vector<std::unique_lock<std::mutex>> lock_all_shards() {
+        // Every other path holds at most one shard latch, so any order works
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+            locks.emplace_back(shards[shard_id].mutex);
+        }
+        return locks;
+    }
+
+    // MMAP mode: the descriptor of a page, growing the file if needed
+    BufferFrame* mapped_frame(PageID page_id) {
+        if (page_id >= mapped_pages.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(mapping_mutex);
+            if (page_id >= max_frames) {
+                std::cerr << "Error: The database file outgrew its mapping. \n";
+                exit(-1);
+            }
+            if (page_id >= frame_count) {
+                storage_manager.extend(page_id);
+                map_pages(page_id + 1);
+            }
+        }
+        return &frames[page_id];
+    }
+
+    // MMAP mode: give pages [frame_count, num_pages) their descriptors
+    void map_pages(size_t num_pages) {
+        size_t old_num_pages = frame_count;
+        add_frames(num_pages);
+        for (FrameID frame_id = old_num_pages; frame_id < num_pages; frame_id++) {
+            frames[frame_id].page_id = frame_id;
+        }
+        mapped_pages.store(frame_count, std::memory_order_release);
+    }
+
+    // Make frames [frame_count, num_frames) part of the pool
+    void add_frames(size_t num_frames) {
+        for (FrameID frame_id = frame_count; frame_id < num_frames; frame_id++) {
+            if (frame_id == constructed_frames) {
+                new (&frames[frame_id]) BufferFrame(frame_memory.get() + frame_id * PAGE_SIZE);
+                constructed_frames++;
+            }
+        }
+        frame_count = num_frames;
+    }
+
+    // Clean the coldest dirty frames so that evictions only have to read
+    void background_writer() {
+        while (1) {
+            {
+                std::unique_lock<std::mutex> lock(writer_mutex);
+                writer_cv.wait_for(lock, BACKGROUND_WRITER_INTERVAL,
+                    [this] { return stop_writer || writer_wakeup; });
+                if (stop_writer) {
+                    break;
+                }
+            }
+            writer_wakeup = false;
+
+            for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+                BufferShard& shard = shards[shard_id];
+                std::unique_lock<std::mutex> lock(shard.mutex);
+
+                // Keep the next quarter of the eviction order clean
+                std::vector<BufferFrame*> batch;
+                for (PageID page_id : shard.policy->victims(std::max<size_t>(1, shard.num_frames / 4))) {
+                    BufferFrame& frame = frames[shard.table().find(page_id)];
+                    if (frame.dirty && frame.pin_count == 0 && !frame.in_writeback && !frame.unguarded) {
+                        frame.in_writeback = true;
+                        batch.push_back(&frame);
+                    }
+                }
+                if (batch.empty()) {
+                    continue;
+                }
+                shard.frames_in_writeback += batch.size();
+
+                // Write the whole batch at once without holding the shard latch
+                lock.unlock();
+                write_back_batch(batch, false);
+                lock.lock();
+
+                for (BufferFrame* frame : batch) {
+                    frame->in_writeback = false;
+                }
+                shard.frames_in_writeback -= batch.size();
+                shard.writeback_done_cv.notify_all();
+            }
+
+            if (wal) {
+                wal->flush(wal->get_end_lsn());
+                if (wal->size_since_checkpoint() > LOG_CHECKPOINT_SIZE) {
+                    checkpoint();
+                }
+            }
+        }
+    }
+
+public:
+    /// @param[in] pool_size        Buffer pool budget in bytes.
+    /// @param[in] policy_type      The replacement policy.
+    /// @param[in] max_pool_size    Largest size resize() may grow the pool to;
+    ///                             0 means the machine's physical memory.
+    /// @param[in] direct_io        Bypass the kernel page cache (O_DIRECT).
+    /// @param[in] storage_mode     MMAP ignores the pool sizes, except that
+    ///                             max_pool_size bounds the mapped file.
+    /// @param[in] commit_mode      Whether changes are logged, and whether
+    ///                             commit() waits for the log.
+    BufferManager(bool storage_manager_truncate_mode = true,
+                  size_t pool_size = DEFAULT_POOL_SIZE,
+                  PolicyType policy_type = LRU,
+                  size_t max_pool_size = 0,
+                  bool direct_io = false,
+                  StorageMode storage_mode = BUFFERED,
+                  CommitMode commit_mode = ASYNC_COMMIT):
+        storage_manager(storage_manager_truncate_mode, direct_io && storage_mode == BUFFERED),
+        max_frames(std::max(pool_size, max_pool_size == 0 ? physical_memory_size() : max_pool_size) / PAGE_SIZE),
+        storage_mode(storage_mode),
+        commit_mode(storage_mode == MMAP ? NO_LOGGING : commit_mode) {
+            if (this->commit_mode != NO_LOGGING) {
+                wal = std::make_unique<WriteAheadLog>(storage_manager_truncate_mode);
+            }
+            size_t num_frames = std::max<size_t>(1, pool_size / PAGE_SIZE);
+            max_frames = std::max(max_frames, num_frames);
+            if (storage_mode == MMAP) {
+                // Beyond the end of the file the mapping is only address space
+                void* data = mmap(nullptr, max_frames * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, storage_manager.fd, 0);
+                if (data == MAP_FAILED) {
+                    std::cerr << "Error: Unable to map the database file. \n";
+                    exit(-1);
+                }
+                frame_memory = std::unique_ptr<char, FrameMemoryDeleter>(
+                    static_cast<char*>(data), FrameMemoryDeleter{max_frames * PAGE_SIZE});
+                num_frames = 0;
+            } else {
+                frame_memory = std::unique_ptr<char, FrameMemoryDeleter>(
+                    reserve_frames(max_frames * PAGE_SIZE), FrameMemoryDeleter{max_frames * PAGE_SIZE});
+            }
+            descriptor_memory = std::unique_ptr<char, FrameMemoryDeleter>(
+                reserve_frames(max_frames * sizeof(BufferFrame)),
+                FrameMemoryDeleter{max_frames * sizeof(BufferFrame)});
+            frames = reinterpret_cast<BufferFrame*>(descriptor_memory.get());
+
+            num_shards = std::clamp<size_t>(num_frames / MIN_FRAMES_PER_SHARD, 1, MAX_BUFFER_SHARDS);
+            shards = std::make_unique<BufferShard[]>(num_shards);
+
+            // Frames never move, so references handed out stay valid
+            add_frames(num_frames);
+            for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+                BufferShard& shard = shards[shard_id];
+                shard.policy = make_policy(policy_type, num_frames / num_shards + 1);
+                for (size_t frame_id = num_frames; frame_id-- > 0; ) {
+                    if (frame_id % num_shards == shard_id) {
+                        shard.free_frames.push_back(frame_id);
+                    }
+                }
+                rebuild_shard(shard_id);
+            }
+            if (storage_mode == MMAP) {
+                map_pages(std::min<size_t>(storage_manager.num_pages, max_frames));
+                return;
+            }
+            writer_thread = std::thread(&BufferManager::background_writer, this);
+    }
+    
+    ~BufferManager() {
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            stop_writer = true;
+        }
+        writer_cv.notify_one();
+        if (writer_thread.joinable()) {
+            writer_thread.join();
+        }
+        drain_prefetches();
+        checkpoint();
+        for (size_t frame_id = 0; frame_id < constructed_frames; frame_id++) {
+            frames[frame_id].~BufferFrame();
+        }
+    }
+
+    // Unpinned access: the reference is only good until the page is evicted.
+    // Use pin_page when other pages are fixed while this one is in use.
+    // The caller may modify the page, so it is treated as dirty.
+    SlottedPage& fix_page(PageID page_id) {
+        PageGuard guard = pin_page(page_id, true);
+        guard.mark_dirty();
+        if (storage_mode == MMAP) {
+            // Mapped pages are never evicted
+            return guard.page();
+        }
+        BufferShard& shard = shard_of(page_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        frames[shard.table().find(page_id)].unguarded = true;
+        return guard.page();
+    }
+
+    // Pin a page and latch it shared or exclusive.
+    // Throws buffer_full_error when every frame of the page's shard is pinned.
+    PageGuard pin_page(PageID page_id, bool exclusive = false) {
+        return pin(page_id, exclusive, false);
+    }
+
+    // Pin a page that the caller overwrites as a whole, such as a newly
+    // allocated node, and latch it exclusively. If it is not cached, it is
+    // zeroed instead of read.
+    PageGuard pin_new_page(PageID page_id) {
+        return pin(page_id, true, true);
+    }
+
+private:
+    PageGuard pin(PageID page_id, bool exclusive, bool overwrite) {
+        if (storage_mode == MMAP) {
+            BufferFrame* frame = mapped_frame(page_id);
+            frame->pin_count++;
+            if (exclusive) {
+                frame->latch.lock();
+            } else {
+                frame->latch.lock_shared();
+            }
+            return PageGuard(this, frame, exclusive);
+        }
+
+        BufferShard& shard = shard_of(page_id);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        BufferFrame* frame = nullptr;
+        bool loading = false;
+
+        while (frame == nullptr) {
+            FrameID frame_id = shard.table().find(page_id);
+            if (frame_id != INVALID_FRAME) {
+                frame = &frames[frame_id];
+                frame->pin_count++;
+                shard.policy->touch(page_id);
+                break;
+            }
+
+            frame_id = allocate_frame(shard, lock);
+            if (frame_id == INVALID_FRAME) {
+                continue;
+            }
+
+            // Publish the page before reading it. Threads that find it
+            // block on the frame latch until the read is done.
+            frame = &frames[frame_id];
+            frame->page_id = page_id;
+            frame->pin_count = 1;
+            bool latched = frame->latch.try_lock();
+            assert(latched);
+            UNUSED(latched);
+            shard.begin_table_write();
+            shard.table().insert(page_id, frame_id);
+            shard.end_table_write();
+            shard.policy->touch(page_id);
+            loading = true;
+        }
+        lock.unlock();
+
+        // Never wait for a frame latch or do I/O while holding a shard latch
+        if (loading) {
+            if (overwrite) {
+                std::memset(frame->page.page_data.get(), 0, PAGE_SIZE);
+            } else {
+                storage_manager.load(page_id, frame->page.page_data.get());
+            }
+            // std::cout << "Loading page: " << page_id << "\n";
+            if (exclusive) {
+                return PageGuard(this, frame, true);
+            }
+            frame->latch.unlock();
+        }
+        if (exclusive) {
+            frame->latch.lock();
+        } else {
+            frame->latch.lock_shared();
+        }
+        return PageGuard(this, frame, exclusive);
+    }
+
+public:
+
+    // Start an optimistic read of a page: no latch is taken and nothing
+    // shared is written. Returns an invalid guard if the page is not
+    // resident or a writer holds it; pin_page then loads or waits for it.
+    // A swizzled reference may be given instead of the page id; it is
+    // followed without probing the page table.
+    OptimisticGuard read_optimistic(PageID page_id) {
+        if (storage_mode == MMAP) {
+            if (page_id >= mapped_pages.load(std::memory_order_acquire)) {
+                return OptimisticGuard();
+            }
+            BufferFrame* frame = &frames[page_id];
+            uint64_t version = frame->latch.optimistic_version();
+            if (HybridLatch::is_locked(version)) {
+                return OptimisticGuard();
+            }
+            return OptimisticGuard(frame, version, page_id);
+        }
+
+        if (is_swizzled(page_id)) {
+            BufferFrame* frame = &frames[swizzled_frame(page_id)];
+            uint64_t version = frame->latch.optimistic_version();
+            if (HybridLatch::is_locked(version)) {
+                return OptimisticGuard();
+            }
+            if (!frame->referenced.load(std::memory_order_relaxed)) {
+                frame->referenced.store(true, std::memory_order_relaxed);
+            }
+            return OptimisticGuard(frame, version, frame->page_id.load(std::memory_order_relaxed));
+        }
+
+        BufferShard& shard = shard_of(page_id);
+        uint64_t table_version = shard.version.load(std::memory_order_acquire);
+        if (table_version & 1) {
+            return OptimisticGuard();
+        }
+        FrameID frame_id = shard.page_table.load(std::memory_order_acquire)->find(page_id);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (frame_id == INVALID_FRAME ||
+            shard.version.load(std::memory_order_relaxed) != table_version) {
+            return OptimisticGuard();
+        }
+
+        BufferFrame* frame = &frames[frame_id];
+        uint64_t version = frame->latch.optimistic_version();
+        // The frame may have been given to another page since the probe
+        if (HybridLatch::is_locked(version) || frame->page_id != page_id) {
+            return OptimisticGuard();
+        }
+        // Only write the hint when it changes, so hot pages stay unshared
+        if (!frame->referenced.load(std::memory_order_relaxed)) {
+            frame->referenced.store(true, std::memory_order_relaxed);
+        }
+        return OptimisticGuard(frame, version, page_id);
+    }
+
+    // Turn an optimistic read into a pinned exclusive guard. Returns an
+    // invalid guard if the page was modified or evicted since the read.
+    PageGuard lock_exclusive(const OptimisticGuard& read) {
+        return lock_read(read, true);
+    }
+
+    // Same for a shared guard
+    PageGuard lock_shared(const OptimisticGuard& read) {
+        return lock_read(read, false);
+    }
+
+private:
+    // Unless wait is set, an exclusive latch is only taken if it is free
+    PageGuard lock_read(const OptimisticGuard& read, bool exclusive, bool wait = true) {
+        BufferFrame* frame = read.get_frame();
+        if (storage_mode == MMAP) {
+            frame->pin_count++;
+        } else {
+            std::lock_guard<std::mutex> lock(shard_of(read.page_id()).mutex);
+            if (frame->page_id != read.page_id()) {
+                return PageGuard();
+            }
+            frame->pin_count++;
+        }
+        if (exclusive && !wait && !frame->latch.try_lock()) {
+            frame->pin_count--;
+            return PageGuard();
+        }
+        PageGuard guard(this, frame, exclusive);
+        if (exclusive) {
+            if (wait) {
+                frame->latch.lock();
+            }
+            // Our own lock made the version odd
+            if (!frame->latch.validate(read.get_version() + 1)) {
+                return PageGuard();
+            }
+        } else {
+            frame->latch.lock_shared();
+            if (!frame->latch.validate(read.get_version())) {
+                return PageGuard();
+            }
+        }
+        return guard;
+    }
+
+public:
+
+    /// Start reading pages into the pool without waiting for them, so that
+    /// many reads are in flight at once. Pages already cached are skipped,
+    /// and so are pages for which no clean frame is at hand.
+    /// @return     The number of reads started.
+    size_t prefetch(const std::vector<PageID>& page_ids) {
+        if (storage_mode == MMAP) {
+            // The kernel reads ahead; the pages are always "cached"
+            for (PageID page_id : page_ids) {
+                if (page_id < mapped_pages.load(std::memory_order_acquire)) {
+                    madvise(frame_memory.get() + static_cast<size_t>(page_id) * PAGE_SIZE,
+                            PAGE_SIZE, MADV_WILLNEED);
+                }
+            }
+            return 0;
+        }
+
+        std::vector<AsyncIO::Request> requests;
+        for (PageID page_id : page_ids) {
+            BufferShard& shard = shard_of(page_id);
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            if (shard.table().find(page_id) != INVALID_FRAME) {
+                continue;
+            }
+            // The reads are only submitted at the end, so waiting for a
+            // frame here could wait for them
+            FrameID frame_id = allocate_frame(shard, lock, false);
+            if (frame_id == INVALID_FRAME) {
+                continue;
+            }
+            // The frame is published once the read completes; the pin
+            // keeps resize() from taking it meanwhile
+            BufferFrame& frame = frames[frame_id];
+            frame.pin_count = 1;
+            shard.frames_prefetching++;
+            lock.unlock();
+
+            // Fail optimistic readers of the page the frame held before
+            frame.latch.lock();
+            frame.latch.unlock();
+            requests.push_back({false, static_cast<uint64_t>(page_id) * PAGE_SIZE,
+                                frame.page.page_data.get(), [this, frame_id, page_id](bool ok) {
+                finish_prefetch(frame_id, page_id, ok);
+            }});
+        }
+
+        if (!requests.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(prefetch_mutex);
+                prefetches_in_flight += requests.size();
+            }
+            storage_manager.submit(requests);
+        }
+        return requests.size();
+    }
+
+    /// Let references between pages be swizzled. In MMAP mode, where every
+    /// page has a fixed frame, nothing is swizzled.
+    /// @param[in] finder   Locates the references in a page; it is only
+    ///                     asked about pages that swizzle() was called on.
+    void enable_swizzling(ReferenceFinder finder) {
+        if (storage_mode != MMAP) {
+            reference_finder = finder;
+        }
+    }
+
+    /// Turn every swizzled reference back into a page id and stop
+    /// swizzling. No other thread may use the pool meanwhile.
+    void disable_swizzling() {
+        if (reference_finder == nullptr) {
+            return;
+        }
+        for (FrameID frame_id = 0; frame_id < frame_count; frame_id++) {
+            BufferFrame& frame = frames[frame_id];
+            if (frame.swizzled_children > 0) {
+                frame.latch.lock();
+                unswizzle_references(frame);
+                frame.latch.unlock();
+            }
+        }
+        reference_finder = nullptr;
+    }
+
+    /// Swizzle the reference at a position of a page to a resident page,
+    /// both read optimistically, so that read_optimistic can follow it
+    /// directly. Nothing is waited for: if the parent is latched or was
+    /// modified, the reference stays a page id. The swizzle does not dirty
+    /// the parent, and parent is moved on to the version after it.
+    /// @return     true if the reference was swizzled.
+    bool swizzle(OptimisticGuard& parent, uint32_t position, const OptimisticGuard& child) {
+        if (reference_finder == nullptr) {
+            return false;
+        }
+        bool swizzled = false;
+        {
+            PageGuard parent_guard = lock_read(parent, true, false);
+            if (!parent_guard.is_valid()) {
+                return false;
+            }
+            auto [references, count] = reference_finder(parent_guard.page().page_data.get());
+            BufferFrame* frame = child.get_frame();
+            if (position < count && references[position] == child.page_id()) {
+                // Eviction of the child takes its shard latch
+                std::lock_guard<std::mutex> lock(shard_of(child.page_id()).mutex);
+                if (frame->page_id == child.page_id() && frame->parent_frame == INVALID_FRAME) {
+                    references[position] = SWIZZLED_TAG | frame_id_of(frame);
+                    frame->parent_frame = frame_id_of(parent.get_frame());
+                    parent.get_frame()->swizzled_children++;
+                    swizzled = true;
+                }
+            }
+        }
+        // Latching and unlatching moved the version on by two
+        parent = OptimisticGuard(parent.get_frame(), parent.get_version() + 2, parent.page_id());
+        return swizzled;
+    }
+
+    /// Turn the swizzled references of a page held exclusively back into
+    /// page ids, before they are moved to another page or dropped.
+    void unswizzle_children(const PageGuard& guard) {
+        assert(guard.is_exclusive());
+        unswizzle_references(*guard.get_frame());
+    }
+
+    /// The page a reference leads to, which may be swizzled.
+    PageID page_id_of(PageID reference) const {
+        return is_swizzled(reference) ? frames[swizzled_frame(reference)].page_id.load() : reference;
+    }
+
+    // Wait until every prefetch read has completed
+    void drain_prefetches() {
+        std::unique_lock<std::mutex> lock(prefetch_mutex);
+        prefetch_cv.wait(lock, [this] { return prefetches_in_flight == 0; });
+    }
+
+    void unpin_page(BufferFrame& frame, bool exclusive) {
+        if (exclusive) {
+            frame.latch.unlock();
+        } else {
+            frame.latch.unlock_shared();
+        }
+        assert(frame.pin_count > 0);
+        frame.pin_count--;
+    }
+
+    void flushPage(PageID page_id) {
+        if (storage_mode == MMAP) {
+            if (static_cast<size_t>(page_id) < mapped_pages.load(std::memory_order_acquire) &&
+                frames[page_id].dirty.exchange(false)) {
+                storage_manager.num_writes++;
+                msync(frame_memory.get() + static_cast<size_t>(page_id) * PAGE_SIZE, PAGE_SIZE, MS_SYNC);
+            }
+            return;
+        }
+
+        BufferShard& shard = shard_of(page_id);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        FrameID frame_id = shard.table().find(page_id);
+        if (frame_id == INVALID_FRAME) {
+            return;
+        }
+        BufferFrame& frame = frames[frame_id];
+        frame.pin_count++;
+        lock.unlock();
+        write_back(frame);
+        frame.pin_count--;
+    }
+
+    // Write back the dirty ones among the pages as one batch, in the order
+    // given. Unlike flush_all, the writes are not forced to the device.
+    void flush_pages(const std::vector<PageID>& page_ids) {
+        if (storage_mode == MMAP) {
+            for (PageID page_id : page_ids) {
+                flushPage(page_id);
+            }
+            return;
+        }
+
+        std::vector<BufferFrame*> batch;
+        for (PageID page_id : page_ids) {
+            BufferShard& shard = shard_of(page_id);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            FrameID frame_id = shard.table().find(page_id);
+            if (frame_id != INVALID_FRAME && frames[frame_id].dirty) {
+                frames[frame_id].pin_count++;
+                batch.push_back(&frames[frame_id]);
+            }
+        }
+        write_back_batch(batch, true);
+        for (BufferFrame* frame : batch) {
+            frame->pin_count--;
+        }
+    }
+
+    /// Grow or shrink the pool while it is in use.
+    /// Shrinking writes back and drops the pages held by the released frames
+    /// and returns their memory to the OS. It fails, leaving the pool as it
+    /// was, if one of those frames is pinned.
+    /// @param[in] pool_size    The new budget in bytes.
+    bool resize(size_t pool_size) {
+        size_t num_frames = pool_size / PAGE_SIZE;
+        if (storage_mode == MMAP || num_frames < num_shards || num_frames > max_frames) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> resize_guard(resize_mutex);
+        size_t old_num_frames = frame_count;
+
+        if (num_frames < old_num_frames) {
+            // Clean the frames that go away before latching every shard,
+            // so no I/O happens under a shard latch
+            for (FrameID frame_id = num_frames; frame_id < old_num_frames; frame_id++) {
+                BufferShard& shard = shard_of_frame(frame_id);
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                BufferFrame& frame = frames[frame_id];
+                while (frame.in_writeback) {
+                    shard.writeback_done_cv.wait(lock);
+                }
+                if (frame.pin_count > 0) {
+                    return false;
+                }
+                if (frame.page_id != INVALID_PAGE && frame.dirty) {
+                    write_back_unlatched(shard, frame, lock);
+                }
+            }
+        }
+
+        auto locks = lock_all_shards();
+        if (num_frames > old_num_frames) {
+            add_frames(num_frames);
+            for (FrameID frame_id = old_num_frames; frame_id < num_frames; frame_id++) {
+                shard_of_frame(frame_id).free_frames.push_back(frame_id);
+            }
+        } else if (num_frames < old_num_frames) {
+            for (FrameID frame_id = num_frames; frame_id < old_num_frames; frame_id++) {
+                const BufferFrame& frame = frames[frame_id];
+                // Pinned or dirtied again since it was cleaned
+                if (frame.pin_count > 0 || frame.in_writeback ||
+                    (frame.page_id != INVALID_PAGE && frame.dirty)) {
+                    return false;
+                }
+                if (frame.page_id != INVALID_PAGE && !try_unswizzle(frame_id)) {
+                    return false;
+                }
+            }
+
+            for (FrameID frame_id = num_frames; frame_id < old_num_frames; frame_id++) {
+                BufferFrame& frame = frames[frame_id];
+                if (frame.page_id != INVALID_PAGE) {
+                    shard_of_frame(frame_id).policy->erase(frame.page_id);
+                    frame.page_id = INVALID_PAGE;
+                    // Fail optimistic readers before the memory is dropped
+                    frame.latch.lock();
+                    frame.latch.unlock();
+                }
+            }
+            for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+                auto& free_frames = shards[shard_id].free_frames;
+                free_frames.erase(
+                    std::remove_if(free_frames.begin(), free_frames.end(),
+                                   [&](FrameID frame_id) { return frame_id >= num_frames; }),
+                    free_frames.end());
+            }
+            // Descriptors stay, optimistic readers may still look at them
+            frame_count = num_frames;
+            madvise(frame_memory.get() + num_frames * PAGE_SIZE,
+                    (old_num_frames - num_frames) * PAGE_SIZE, MADV_DONTNEED);
+        }
+
+        for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+            rebuild_shard(shard_id);
+        }
+        return true;
+    }
+
+    // In MMAP mode, the mapped part of the file
+    size_t getPoolSize() {
+        if (storage_mode == MMAP) {
+            return mapped_pages * PAGE_SIZE;
+        }
+        std::lock_guard<std::mutex> resize_guard(resize_mutex);
+        return frame_count * PAGE_SIZE;
+    }
+
+    /// Tell the kernel how pages will be accessed: madvise on the mapping
+    /// in MMAP mode, posix_fadvise on the file otherwise.
+    void advise(AccessPattern access_pattern) {
+        if (storage_mode == MMAP) {
+            std::lock_guard<std::mutex> lock(mapping_mutex);
+            madvise(frame_memory.get(), frame_count * PAGE_SIZE,
+                    access_pattern == SEQUENTIAL_ACCESS ? MADV_SEQUENTIAL : MADV_RANDOM);
+        } else {
+            posix_fadvise(storage_manager.fd, 0, 0,
+                          access_pattern == SEQUENTIAL_ACCESS ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+        }
+    }
+
+    size_t getNumShards() {
+        return num_shards;
+    }
+
+    // Write back every dirty frame, as one batch, and push the writes out
+    // to the file
+    void flush_all() {
+        if (storage_mode == MMAP) {
+            std::lock_guard<std::mutex> lock(mapping_mutex);
+            for (FrameID frame_id = 0; frame_id < frame_count; frame_id++) {
+                if (frames[frame_id].dirty.exchange(false)) {
+                    storage_manager.num_writes++;
+                }
+            }
+            msync(frame_memory.get(), frame_count * PAGE_SIZE, MS_SYNC);
+            return;
+        }
+
+        std::vector<BufferFrame*> batch;
+        for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+            std::lock_guard<std::mutex> lock(shards[shard_id].mutex);
+            for (FrameID frame_id = shard_id; frame_id < frame_count; frame_id += num_shards) {
+                BufferFrame& frame = frames[frame_id];
+                if (frame.page_id != INVALID_PAGE && frame.dirty) {
+                    frame.pin_count++;
+                    batch.push_back(&frame);
+                }
+            }
+        }
+        write_back_batch(batch, true);
+        for (BufferFrame* frame : batch) {
+            frame->pin_count--;
+        }
+        // Frames the background writer or an eviction took before are
+        // being written too
+        for (size_t shard_id = 0; shard_id < num_shards; shard_id++) {
+            BufferShard& shard = shards[shard_id];
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            shard.writeback_done_cv.wait(lock, [&shard] { return shard.frames_in_writeback == 0; });
+        }
+        storage_manager.sync();
+    }
+
+    /// Write back every dirty frame and let recovery start from here on,
+    /// dropping the log before. Without a log, the same as flush_all().
+    void checkpoint() {
+        if (!wal) {
+            flush_all();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(checkpoint_mutex);
+        uint64_t lsn = wal->begin_checkpoint();
+        flush_all();
+        wal->end_checkpoint(lsn);
+    }
+
+    /// Log a change of a client-defined type to a page held exclusively,
+    /// as an operation of its own. A logged page keeps its LSN in its
+    /// first eight bytes. If the page was not logged since the last
+    /// checkpoint started, its image is logged instead.
+    /// @return     The LSN to pass to commit(), 0 if nothing is logged.
+    uint64_t log_change(const PageGuard& guard, uint8_t type, const void* payload, uint32_t size) {
+        if (!wal) {
+            return 0;
+        }
+        assert(guard.is_exclusive());
+        BufferFrame* frame = guard.get_frame();
+        PageBuffer copy = unswizzled_copy(*frame);
+        WriteAheadLog::Change change{frame->page_id, frame->page.page_data.get(), copy.get(), type, payload, size};
+        return append_log(&change, 1, &frame);
+    }
+
+    /// Log the images of pages held exclusively, as one operation, such as
+    /// a split. Empty guards are skipped.
+    /// @return     The LSN to pass to commit(), 0 if nothing is logged.
+    uint64_t log_images(std::initializer_list<const PageGuard*> guards) {
+        if (!wal) {
+            return 0;
+        }
+        std::vector<WriteAheadLog::Change> changes;
+        std::vector<BufferFrame*> logged_frames;
+        std::vector<PageBuffer> copies;
+        for (const PageGuard* guard : guards) {
+            if (!guard->is_valid()) {
+                continue;
+            }
+            assert(guard->is_exclusive());
+            BufferFrame* frame = guard->get_frame();
+            copies.push_back(unswizzled_copy(*frame));
+            changes.push_back({frame->page_id, frame->page.page_data.get(), copies.back().get(),
+                               WriteAheadLog::kImage, nullptr, 0});
+            logged_frames.push_back(frame);
+        }
+        return append_log(changes.data(), changes.size(), logged_frames.data());
+    }
+
+    /// With SYNC_COMMIT, wait until the operation that logged lsn is
+    /// durable. Called once its pages are released, so that other
+    /// operations go on and share the sync.
+    void commit(uint64_t lsn) {
+        if (commit_mode == SYNC_COMMIT && lsn != 0) {
+            wal->flush(lsn);
+        }
+    }
+
+    /// Replay what an earlier run logged since its last checkpoint, before
+    /// anything else uses the pages. Images are copied back; other changes
+    /// are passed to redo, for pages that do not have them yet. The caller
+    /// repairs whatever else it needs to and then takes a checkpoint.
+    /// @return     false if the last run ended with a checkpoint.
+    bool recover(RedoHandler redo) {
+        if (!wal) {
+            return false;
+        }
+        return wal->replay([&](uint64_t lsn, const std::vector<WriteAheadLog::LoggedChange>& changes) {
+            for (const auto& change : changes) {
+                PageGuard guard = pin_page(change.page_id, true);
+                char* page = guard.page().page_data.get();
+                if (change.type == WriteAheadLog::kImage) {
+                    std::memcpy(page, change.payload, PAGE_SIZE);
+                } else {
+                    uint64_t page_lsn;
+                    std::memcpy(&page_lsn, page, sizeof(page_lsn));
+                    if (page_lsn >= lsn) {
+                        continue;
+                    }
+                    redo(page, change.type, change.payload, change.size);
+                    std::memcpy(page, &lsn, sizeof(lsn));
+                }
+                guard.get_frame()->page_lsn = lsn;
+                guard.mark_dirty();
+            }
+        });
+    }
+
+    void extend(){
+        storage_manager.extend();
+    }
+    
+    size_t getNumPages(){
+        return storage_manager.num_pages;
+    }
+
+    // False if direct I/O was asked for but the file system lacks it
+    bool usesDirectIO(){
+        return storage_manager.direct_io;
+    }
+
+    uint64_t getNumPageReads(){
+        return storage_manager.num_reads;
+    }
+
+    uint64_t getNumPageWrites(){
+        return storage_manager.num_writes;
+    }
+
+    uint64_t getNumLogSyncs(){
+        return wal ? wal->num_syncs.load() : 0;
+    }
+
+};
+
+inline void PageGuard::release() {
+    if (frame != nullptr) {
+        buffer_manager->unpin_page(*frame, exclusive);
+        frame = nullptr;
+    }
+}
+
+// Pages given back for reuse. The list is chained through the free pages
+// themselves, so it takes no space of its own; its owner persists head()
+// and size() and resumes the list with load().
+class FreeList {
+private:
+    struct FreePage {
+        static constexpr uint64_t kMagic = 0x4547415045455246; // "FREEPAGE" on disk
+        uint64_t lsn;
+        uint64_t magic;
+        PageID next;
+    };
+
+    BufferManager& buffer_manager;
+    mutable std::mutex mutex;
+    PageID head_ = INVALID_PAGE;
+    uint64_t size_ = 0;
+
+public:
+    explicit FreeList(BufferManager& buffer_manager) : buffer_manager(buffer_manager) {}
+
+    void load(PageID head, uint64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        head_ = head;
+        size_ = size;
+    }
+
+    PageID head() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return head_;
+    }
+
+    uint64_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return size_;
+    }
+
+    /// Take a page off the list. Its contents are left for the caller
+    /// to overwrite.
+    /// @return     The page, or INVALID_PAGE if the list is empty.
+    PageID allocate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (head_ == INVALID_PAGE) {
+            return INVALID_PAGE;
+        }
+        PageID page_id = head_;
+        PageGuard guard = buffer_manager.pin_page(page_id);
+        const FreePage* free_page = guard.as<FreePage>();
+        if (free_page->magic != FreePage::kMagic) {
+            std::cerr << "Error: Page " << page_id << " on the free list is in use. \n";
+            exit(-1);
+        }
+        head_ = free_page->next;
+        size_--;
+        return page_id;
+    }
+
+    /// Put a page on the list. The caller holds it exclusively, and must
+    /// have unlinked it so no one reaches it anymore.
+    void free(const PageGuard& guard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        FreePage* free_page = guard.as<FreePage>();
+        free_page->magic = FreePage::kMagic;
+        free_page->next = head_;
+        guard.mark_dirty();
+        head_ = guard.page_id();
+        size_++;
+    }
+};
+
+// Searching the sorted keys of a node. Both node searches count how many
+// keys sort before a key (or, for inner nodes, not after it). 64-bit
+// integral keys ordered by std::less use vector kernels for the last few
+// keys; which one is picked at run time from what the CPU supports.
+enum SearchKernel { SEARCH_SCALAR, SEARCH_SSE42, SEARCH_AVX2 };
+
+inline SearchKernel best_search_kernel() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        return SEARCH_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return SEARCH_SSE42;
+    }
+#endif
+    return SEARCH_SCALAR;
+}
+
+// The kernel the nodes use; tests and benchmarks switch it
+inline std::atomic<SearchKernel> search_kernel{best_search_kernel()};
+
+// Binary search stops once this many keys are left for a vector kernel
+constexpr uint32_t SEARCH_VECTOR_WINDOW = 16;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Count the keys before key among n keys, compared as signed integers after
+// xor-ing with flip (the sign bit for unsigned keys)
+template<bool kOrEqual>
+__attribute__((target("avx2")))
+uint32_t count_before_avx2(const int64_t* keys, uint32_t n, int64_t key, int64_t flip) {
+    const __m256i flips = _mm256_set1_epi64x(flip);
+    const __m256i needle = _mm256_set1_epi64x(key ^ flip);
+    // Matching lanes compare to -1, so subtracting the masks counts them
+    __m256i counts = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i block = _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), flips);
+        // Either key > keys[i], or keys[i] > key to be subtracted
+        __m256i mask = kOrEqual ? _mm256_cmpgt_epi64(block, needle) : _mm256_cmpgt_epi64(needle, block);
+        counts = _mm256_sub_epi64(counts, mask);
+    }
+    __m128i pairs = _mm_add_epi64(_mm256_castsi256_si128(counts), _mm256_extracti128_si256(counts, 1));
+    uint32_t hits = static_cast<uint32_t>(_mm_cvtsi128_si64(pairs) + _mm_extract_epi64(pairs, 1));
+    uint32_t count = kOrEqual ? i - hits : hits;
+    for (; i < n; i++) {
+        count += kOrEqual ? (keys[i] ^ flip) <= (key ^ flip) : (keys[i] ^ flip) < (key ^ flip);
+    }
+    return count;
+}
+
+template<bool kOrEqual>
+__attribute__((target("sse4.2")))
+uint32_t count_before_sse42(const int64_t* keys, uint32_t n, int64_t key, int64_t flip) {
+    const __m128i flips = _mm_set1_epi64x(flip);
+    const __m128i needle = _mm_set1_epi64x(key ^ flip);
+    __m128i counts = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i block = _mm_xor_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), flips);
+        __m128i mask = kOrEqual ? _mm_cmpgt_epi64(block, needle) : _mm_cmpgt_epi64(needle, block);
+        counts = _mm_sub_epi64(counts, mask);
+    }
+    uint32_t hits = static_cast<uint32_t>(_mm_cvtsi128_si64(counts) + _mm_extract_epi64(counts, 1));
+    uint32_t count = kOrEqual ? i - hits : hits;
+    for (; i < n; i++) {
+        count += kOrEqual ? (keys[i] ^ flip) <= (key ^ flip) : (keys[i] ^ flip) < (key ^ flip);
+    }
+    return count;
+}
+#endif
+
+/// Count the keys before a key in a sorted array: those less than it,
+/// or with kOrEqual those not greater than it.
+template<bool kOrEqual, typename KeyT, typename ComparatorT>
+uint32_t count_keys_before(const KeyT* keys, uint32_t n, const KeyT& key,
+                           SearchKernel kernel = search_kernel.load(std::memory_order_relaxed)) {
+    ComparatorT less;
+    auto before = [&](const KeyT& other) {
+        return kOrEqual ? !less(key, other) : less(other, key);
+    };
+    constexpr bool vectorizable = std::is_integral_v<KeyT> && sizeof(KeyT) == 8 &&
+                                  std::is_same_v<ComparatorT, std::less<KeyT>>;
+    if (!vectorizable) {
+        kernel = SEARCH_SCALAR;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    // Branchless binary search: the answer stays within [base, base + n]
+    const KeyT* base = keys;
+    uint32_t window = kernel == SEARCH_SCALAR ? 1 : SEARCH_VECTOR_WINDOW;
+    while (n > window) {
+        uint32_t half = n / 2;
+        base = before(base[half]) ? base + half : base;
+        n -= half;
+    }
+    uint32_t offset = static_cast<uint32_t>(base - keys);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if constexpr (vectorizable) {
+        if (kernel != SEARCH_SCALAR) {
+            const int64_t* signed_keys = reinterpret_cast<const int64_t*>(base);
+            int64_t flip = std::is_signed_v<KeyT> ? 0 : std::numeric_limits<int64_t>::min();
+            return offset + (kernel == SEARCH_AVX2
+                ? count_before_avx2<kOrEqual>(signed_keys, n, static_cast<int64_t>(key), flip)
+                : count_before_sse42<kOrEqual>(signed_keys, n, static_cast<int64_t>(key), flip));
+        }
+    }
+#endif
+    return offset + before(*base);
+}
+
+// Inner node layouts, picked by BTree's InnerLayout parameter. Both keep the
+// separators of a node sorted in its keys array, which the tree modifies in
+// place. What a layout needs to search them sits between the node header
+// and the keys, as the node's Directory base, and is rebuilt after every
+// change to the keys.
+
+// Binary search straight over the keys. Over a large node, nearly every step
+// touches another cache line.
+struct FlatInnerLayout {
+    // Recorded in the superblock; files from before it was recorded read 0
+    static constexpr uint32_t kId = 0;
+
+    // The KeyT slots the directory takes for up to max_keys keys, when it
+    // starts header_size bytes into the page
+    template<typename KeyT>
+    static constexpr uint32_t directory_slots(uint32_t /*max_keys*/, size_t /*header_size*/) { return 0; }
+
+    template<typename KeyT, typename ComparatorT, uint32_t kMaxKeys, size_t kHeaderSize>
+    struct Directory {
+        void build(const KeyT* /*keys*/, uint32_t /*n*/) {}
+
+        // The number of keys among the first n that are not greater than key
+        uint32_t count_not_after(const KeyT* keys, uint32_t n, const KeyT& key) const {
+            return count_keys_before<true, KeyT, ComparatorT>(keys, n, key);
+        }
+    };
+};
+
+// A search tree over the keys in cache-line blocks, after CSS- and CSB+-trees.
+// Each directory level holds the last key of every block of the level below
+// it but the last one, up to a level that fits in a single block. A search
+// reads one block per level, top-down, and then one block of keys, so it
+// touches a cache line per level (three for 64-bit keys in a 4 KB node)
+// rather than one per binary search step. The top level shares the header's
+// cache line if it fits; the other levels and the keys start on one. The
+// directory takes about one slot per block of keys.
+struct BlockedInnerLayout {
+    static constexpr uint32_t kId = 1;
+    static constexpr size_t kLineSize = 64;
+    static constexpr uint32_t kMaxLevels = 8;
+
+    template<typename KeyT>
+    static constexpr uint32_t kBlock = kLineSize / sizeof(KeyT);
+
+    // The size of the level over one of size entries
+    template<typename KeyT>
+    static constexpr uint32_t level_above(uint32_t size) {
+        return (size + kBlock<KeyT> - 1) / kBlock<KeyT> - 1;
+    }
+
+    // Where the directory levels for up to max_keys keys go, in KeyT slots
+    // from the start of the directory; level 1 is the one over the keys
+    struct Geometry {
+        uint32_t levels = 0;
+        uint32_t offsets[kMaxLevels + 1] = {};
+        uint32_t slots = 0;
+    };
+
+    template<typename KeyT>
+    static constexpr Geometry geometry(uint32_t max_keys, size_t header_size) {
+        Geometry geometry;
+        uint32_t sizes[kMaxLevels + 1] = {};
+        for (uint32_t size = max_keys; size > kBlock<KeyT>; ) {
+            size = level_above<KeyT>(size);
+            sizes[++geometry.levels] = size;
+        }
+        // Round up to the next cache line
+        auto align = [header_size](uint32_t slots) {
+            size_t end = header_size + slots * sizeof(KeyT);
+            size_t padding = (kLineSize - end % kLineSize) % kLineSize;
+            return slots + static_cast<uint32_t>((padding + sizeof(KeyT) - 1) / sizeof(KeyT));
+        };
+        uint32_t slots = 0;
+        for (uint32_t level = geometry.levels; level >= 1; level--) {
+            if (level < geometry.levels) {
+                slots = align(slots);
+            }
+            geometry.offsets[level] = slots;
+            slots += sizes[level];
+        }
+        geometry.slots = geometry.levels > 0 ? align(slots) : 0;
+        return geometry;
+    }
+
+    template<typename KeyT>
+    static constexpr uint32_t directory_slots(uint32_t max_keys, size_t header_size) {
+        return std::max<uint32_t>(1, geometry<KeyT>(max_keys, header_size).slots);
+    }
+
+    template<typename KeyT, typename ComparatorT, uint32_t kMaxKeys, size_t kHeaderSize>
+    struct Directory {
+        static_assert(kBlock<KeyT> >= 2, "keys are too wide to block by cache line");
+        static constexpr uint32_t B = kBlock<KeyT>;
+        static constexpr Geometry kGeometry = geometry<KeyT>(kMaxKeys, kHeaderSize);
+
+        KeyT entries[directory_slots<KeyT>(kMaxKeys, kHeaderSize)];
+
+        void build(const KeyT* keys, uint32_t n) {
+            const KeyT* below = keys;
+            for (uint32_t level = 1; n > B; level++) {
+                KeyT* level_entries = entries + kGeometry.offsets[level];
+                n = level_above<KeyT>(n);
+                for (uint32_t i = 0; i < n; i++) {
+                    level_entries[i] = below[(i + 1) * B - 1];
+                }
+                below = level_entries;
+            }
+        }
+
+        // The number of keys among the first n that are not greater than
+        // key. Every index stays in range even if the node is torn.
+        uint32_t count_not_after(const KeyT* keys, uint32_t n, const KeyT& key) const {
+            uint32_t sizes[kMaxLevels + 1];
+            uint32_t levels = 0;
+            sizes[0] = n;
+            while (sizes[levels] > B) {
+                sizes[levels + 1] = level_above<KeyT>(sizes[levels]);
+                levels++;
+            }
+            // The block of the level below that holds the answer
+            uint32_t block = 0;
+            for (uint32_t level = levels; level >= 1; level--) {
+                uint32_t begin = block * B;
+                block = begin + count_in_block(entries + kGeometry.offsets[level] + begin,
+                                               std::min(B, sizes[level] - begin), key);
+            }
+            uint32_t begin = block * B;
+            return begin + count_in_block(keys + begin, std::min(B, n - begin), key);
+        }
+
+        // A block is a cache line, for which a plain count beats any search
+        static uint32_t count_in_block(const KeyT* block, uint32_t len, const KeyT& key) {
+            ComparatorT less;
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < len; i++) {
+                count += !less(key, block[i]);
+            }
+            return count;
+        }
+    };
+};
+
+// The capacity of an inner node: as many children, and one separator fewer,
+// as fit in page_size along with the header and the layout's directory. One
+// alignment unit is held back for padding between the arrays.
+template<typename InnerLayout, typename KeyT>
+constexpr uint32_t inner_node_capacity(size_t page_size, size_t header_size) {
+    uint32_t capacity = (page_size - header_size - alignof(PageID) + sizeof(KeyT)) / (sizeof(KeyT) + sizeof(PageID));
+    while (header_size + (InnerLayout::template directory_slots<KeyT>(capacity - 1, header_size) + capacity - 1) * sizeof(KeyT) +
+           alignof(PageID) + capacity * sizeof(PageID) > page_size) {
+        capacity--;
+    }
+    return capacity;
+}
+
+template<typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize,
+         typename InnerLayout = FlatInnerLayout>
+class BTree {
+    public:
+        struct Node {
+            /// The LSN of the last logged change, first on the page as the
+            /// buffer manager expects.
+            uint64_t lsn;
+
+            /// The level in the tree.
+            uint16_t level;
+
+            /// The number of children.
+            uint16_t count;
+
+            /// TODO: Add additional members as needed
+            PageID page_id;
+            PageID parent;
+            bool dirty;
+
+            // Constructor
+            Node(uint16_t level, uint16_t count)
+                : lsn(0), level(level), count(count), page_id(0),
+                parent(0), dirty(false) {}
+
+            /// Is the node a leaf node?
+            bool is_leaf() const { return level == 0; }
+            bool is_full(uint32_t capacity) const { return count >= capacity; }
+            bool splits_needed(uint32_t capacity) const { return count > capacity; }
+            void is_dirty() { dirty = true; }
+        };
+
+        /// The search structure InnerLayout keeps over the keys of an
+        /// inner node, between its header and its keys.
+        using InnerDirectory = typename InnerLayout::template Directory<KeyT, ComparatorT,
+            inner_node_capacity<InnerLayout, KeyT>(PageSize, sizeof(Node)) - 1, sizeof(Node)>;
+
+        struct InnerNode: public Node, public InnerDirectory {
+            /// The capacity of a node: as many children, and one separator
+            /// fewer, as fit in PageSize next to the directory.
+            static constexpr uint32_t kCapacity = inner_node_capacity<InnerLayout, KeyT>(PageSize, sizeof(Node));
+
+            /// The keys.
+            KeyT keys[kCapacity - 1];
+
+            /// The children.
+            PageID children[kCapacity];
+
+            /// Constructor.
+            InnerNode() : Node(0, 0) {}
+
+            /// Get the index of the first key that is not less than than a provided key.
+            /// @param[in] key          The key that should be searched.
+            std::pair<uint32_t, bool> lower_bound(const KeyT &key) const {
+            // TODO: remove the below lines of code 
+                // and add your implementation here
+                // UNUSED(key);
+                // The child to follow is the number of separators <= key
+                if (this->count == 0) {
+                    return {0, false};
+                }
+                return {this->count_not_after(keys, this->count - 1, key), false};
+            }
+
+            /// Rebuild the directory after the keys were changed in place.
+            void rebuild_directory() {
+                this->build(keys, this->count > 0 ? this->count - 1 : 0);
+            }
+
+            /// Insert a key.
+            /// @param[in] key          The separator that should be inserted.
+            /// @param[in] split_page   The id of the split page that should be inserted.
+            void insert(const KeyT &key, PageID split_page) {
+            // TODO: remove the below lines of code 
+                // and add your implementation here
+            // UNUSED(key);
+            // UNUSED(split_page);
+            // count children are separated by count - 1 keys
+            uint32_t position = lower_bound(key).first;
+            for (uint32_t i = this -> count - 1; i > position; i--) {
+                keys[i] = keys[i-1];
+            }
+            for (uint32_t i = this -> count; i > position + 1; i--) {
+                children[i] = children[i-1];
+            }
+            keys[position] = key;
+            children[position + 1] = split_page;
+            this -> count++;
+            this -> dirty = true;
+            rebuild_directory();
+            }
+
+            /// Remove a child along with the separator on its left, or on
+            /// its right for the first child, so that its key range goes
+            /// to a neighbour.
+            /// @param[in] position     The index of the child.
+            void erase_child(uint32_t position) {
+                uint32_t key_position = position > 0 ? position - 1 : 0;
+                for (uint32_t i = key_position; i + 2 < this->count; i++) {
+                    keys[i] = keys[i + 1];
+                }
+                for (uint32_t i = position; i + 1 < this->count; i++) {
+                    children[i] = children[i + 1];
+                }
+                this->count--;
+                this->dirty = true;
+                rebuild_directory();
+            }
+
+            /// Split the inner node. If it is on the right edge of the tree
+            /// and the key about to be inserted goes to its last child,
+            /// only that child moves to the new node.
+            /// @param[in] inner_node       The inner node being split.
+            /// @param[in] key              The key whose insert splits the node.
+            /// @param[in] right_edge       Whether the node is on the rightmost path.
+            /// @return                 The separator key.
+            KeyT split(InnerNode* inner_node, const KeyT &key, bool right_edge) {
+                // TODO: remove the below lines of code 
+                // and add your implementation here
+                // UNUSED(inner_node);
+                // The left node keeps children [0, mid), the right one gets
+                // [mid, count); the key between them moves up as separator
+                bool append = right_edge && lower_bound(key).first == this->count - 1u;
+                uint32_t mid = append ? this->count - 1 : this->count / 2;
+                KeyT separator = keys[mid - 1];
+                uint32_t j = 0;
+                for (uint32_t i = mid; i < this->count; i++) {
+                    inner_node->children[j] = children[i];
+                    if (i + 1 < this->count) {
+                        inner_node->keys[j] = keys[i];
+                    }
+                    j++;
+                }
+
+                inner_node->count = this->count - mid;
+                inner_node->level = this->level;
+                this->count = mid;
+
+                this->dirty = true;
+                inner_node->dirty = true;
+                rebuild_directory();
+                inner_node->rebuild_directory();
+                return separator;
+            }
+
+        };
+
+        struct LeafNode: public Node {
+            /// The capacity of a node: as many key/value pairs as fit in
+            /// PageSize. One alignment unit is held back for padding between
+            /// the arrays.
+            static constexpr uint32_t kCapacity =
+                (PageSize - sizeof(Node) - 2 * sizeof(PageID) - alignof(ValueT)) / (sizeof(KeyT) + sizeof(ValueT));
+
+            /// The neighbouring leaves, INVALID_PAGE at either end.
+            PageID prev = INVALID_PAGE;
+            PageID next = INVALID_PAGE;
+
+            /// The keys.
+            KeyT keys[kCapacity];
+
+            /// The values.
+            ValueT values[kCapacity];
+
+            /// Constructor.
+            LeafNode() : Node(0, 0) {}
+
+            uint32_t find_position(const KeyT &key) const {
+                return count_keys_before<false, KeyT, ComparatorT>(keys, this->count, key);
+            }
+
+            /// Insert a key.
+            /// @param[in] key          The key that should be inserted.
+            /// @param[in] value        The value that should be inserted.
+            void insert(const KeyT &key, const ValueT &value) {
+                // HINT
+                // UNUSED(key);
+                // UNUSED(value);
+                // uint32_t position = find_position(key);
+                // if (position < this -> count && keys[position] == key) {
+                //     values[position] = value;
+                //     this -> dirty = true;
+                //     return;
+                // }
+
+                // for (uint32_t i = this -> count; i > position; i--) {
+                //     keys[i] = keys[i - 1];
+                //     values[i] = values[i - 1];
+                // }
+                // keys[position] = key;
+                // values[position] = value;
+                // this -> count++;
+                // this -> dirty = true;
+                upsert(key, [&](const std::optional<ValueT>&) { return std::optional<ValueT>(value); });
+            }
+
+            /// Replace the value of a key, or insert one if it is missing,
+            /// with whatever update returns. The leaf must have room.
+            /// @param[in] key          The key that should be updated.
+            /// @param[in] update       Called once with the current value, nullopt
+            ///                         if the key is missing. Returns the new value,
+            ///                         or nullopt to leave the leaf unchanged.
+            /// @return     The value stored, nullopt if the leaf is unchanged.
+            template <typename UpdateFn>
+            std::optional<ValueT> upsert(const KeyT &key, UpdateFn &&update) {
+                uint32_t position = find_position(key);
+                bool found = position < this->count && keys[position] == key;
+                std::optional<ValueT> value = update(found ? std::optional<ValueT>(values[position]) : std::nullopt);
+                if (!value.has_value()) {
+                    return value;
+                }
+                if (!found) {
+                    for (uint32_t i = this->count; i > position; i--) {
+                        keys[i] = keys[i - 1];
+                        values[i] = values[i - 1];
+                    }
+                    keys[position] = key;
+                    this->count++;
+                }
+                values[position] = *value;
+                this->dirty = true;
+                return value;
+            }
+
+            /// Erase a key.
+            void erase(const KeyT &key) {
+                // HINT
+                // UNUSED(key);
+                uint32_t position = find_position(key);
+                if (position >= this -> count || keys[position] != key) {
+                    return;
+                }
+                for (uint32_t i = position; i < static_cast<uint32_t>(this -> count - 1); i++) {
+                    keys[i] = keys[i + 1];
+                    values[i] = values[i + 1];
+                }
+                this -> count--;
+                this -> dirty = true;
+            }
+
+            /// Split the leaf node.
+            /// The new leaf is linked in as the right sibling; the caller
+            /// points the old right sibling's prev at it. If this is the
+            /// rightmost leaf and the key about to be inserted sorts after
+            /// every entry, as with ascending keys, this leaf stays full and
+            /// the new one starts empty.
+            /// @param[in] leaf_node       The leaf node being split
+            /// @param[in] page_id         The page of this leaf.
+            /// @param[in] leaf_page_id    The page of the new leaf.
+            /// @param[in] key             The key whose insert splits the leaf.
+            /// @return                 The separator key.
+            KeyT split(LeafNode* leaf_node, PageID page_id, PageID leaf_page_id, const KeyT &key) {
+                // HINT
+                // UNUSED(leaf_node);
+                // uint32_t mid = this -> count / 2;
+                // uint32_t tmp = 0;
+                // for (uint32_t i = mid; i < this -> count; i++) {
+                //     leaf_node -> keys[tmp] = keys[i];
+                //     leaf_node -> values[tmp] = values[i];
+                //     tmp++;
+                // }
+                // leaf_node -> count = this -> count - mid;
+                // leaf_node -> level = 0;
+                // this -> count = mid;
+                // this -> dirty = true;
+                // leaf_node -> dirty = true;
+                // return leaf_node -> keys[0];
+                ComparatorT less;
+                bool append = next == INVALID_PAGE && less(keys[this->count - 1], key);
+                uint32_t mid = append ? this->count : this->count / 2;
+                uint32_t j = 0;
+                for (uint32_t i = mid; i < this->count; i++) {
+                    leaf_node->keys[j] = keys[i];
+                    leaf_node->values[j] = values[i];
+                    j++;
+                }
+                leaf_node->count = j;
+                this->count = mid;
+                leaf_node->prev = page_id;
+                leaf_node->next = next;
+                next = leaf_page_id;
+                this->dirty = true;
+                leaf_node->dirty = true;
+                return append ? key : leaf_node->keys[0];
+            }
+
+        };
+
+        static_assert(PageSize <= PAGE_SIZE, "a node must fit in a buffer frame");
+        static_assert(sizeof(InnerNode) <= PageSize && sizeof(LeafNode) <= PageSize,
+                      "a node does not fit in PageSize");
+        static_assert(InnerNode::kCapacity >= 3 && LeafNode::kCapacity >= 2,
+                      "PageSize is too small for the key and value types");
+
+        /// Page 0 describes the tree, so reopening it takes a single read.
+        struct Superblock {
+            static constexpr uint64_t kMagic = 0x454552545a5a5542; // "BUZZTREE" on disk
+            static constexpr uint32_t kFormatVersion = 5;
+
+            uint64_t lsn;
+            uint64_t magic;
+            uint32_t format_version;
+            /// The number of levels, 0 for an empty tree.
+            uint32_t height;
+            /// The root page, INVALID_PAGE for an empty tree.
+            PageID root;
+            /// Pages from here on are unused.
+            PageID next_page_id;
+            /// The free list below next_page_id.
+            PageID free_list_head;
+            uint64_t free_list_size;
+            /// The kId of the inner node layout. Files written before it was
+            /// recorded read 0, the flat layout they were built with.
+            uint32_t inner_layout;
+            /// The node size and the key and value sizes, which the node
+            /// capacities are derived from.
+            uint32_t page_size;
+            uint32_t key_size;
+            uint32_t value_size;
+        };
+        static constexpr PageID kSuperblockPage = 0;
+
+        /// The root.
+        std::optional<PageID> root;
+
+        /// The number of levels.
+        uint32_t height = 0;
+
+        /// Held exclusively while root or height change; read optimistically otherwise.
+        HybridLatch root_latch;
+
+        /// The buffer manager
+        BufferManager& buffer_manager;
+
+        /// Next page id.
+        /// New pages come from the free list first and from here only
+        /// when it is empty.
+        std::atomic<PageID> next_page_id;
+
+        /// Pages of removed nodes, for reuse.
+        FreeList free_list;
+
+        /// The leaf last seen without a right sibling, for try_append. A
+        /// hint only: it is checked before use.
+        std::atomic<PageID> rightmost_leaf{INVALID_PAGE};
+
+        /// Log record types besides page images: an insert into a leaf or
+        /// an erase from it, followed by the key and, for an insert, the value.
+        static constexpr uint8_t kInsertRecord = 1;
+        static constexpr uint8_t kEraseRecord = 2;
+
+        /// Constructor. Opens the tree described by the superblock, or
+        /// starts an empty one if the file has none. If the last run did
+        /// not end with a checkpoint, its log is replayed first.
+        BTree(BufferManager &buffer_manager): buffer_manager(buffer_manager), free_list(buffer_manager) {
+            buffer_manager.enable_swizzling(&BTree::find_children);
+            next_page_id = kSuperblockPage + 1;
+            root = std::nullopt;
+
+            bool recovered = buffer_manager.recover(&BTree::redo);
+            open_superblock();
+            if (recovered) {
+                rebuild_free_list();
+                std::lock_guard<HybridLatch> root_lock(root_latch);
+                store_superblock();
+                buffer_manager.checkpoint();
+            }
+        }
+
+        /// Read root, height and page allocation from the superblock.
+        void open_superblock() {
+            PageGuard guard = buffer_manager.pin_page(kSuperblockPage);
+            const Superblock* superblock = guard.as<Superblock>();
+            if (superblock->magic != Superblock::kMagic) {
+                return;
+            }
+            if (superblock->format_version != Superblock::kFormatVersion) {
+                std::cerr << "Error: Unsupported index format version "
+                          << superblock->format_version << ". \n";
+                exit(-1);
+            }
+            if (superblock->inner_layout != InnerLayout::kId) {
+                std::cerr << "Error: Index was built with inner node layout "
+                          << superblock->inner_layout << ", not " << InnerLayout::kId << ". \n";
+                exit(-1);
+            }
+            if (superblock->page_size != PageSize || superblock->key_size != sizeof(KeyT) ||
+                superblock->value_size != sizeof(ValueT)) {
+                std::cerr << "Error: Index was built with " << superblock->page_size << "-byte nodes, "
+                          << superblock->key_size << "-byte keys and " << superblock->value_size
+                          << "-byte values, not " << PageSize << ", " << sizeof(KeyT) << " and "
+                          << sizeof(ValueT) << ". \n";
+                exit(-1);
+            }
+            if (superblock->root != INVALID_PAGE) {
+                root = superblock->root;
+            }
+            height = superblock->height;
+            next_page_id = superblock->next_page_id;
+            free_list.load(superblock->free_list_head, superblock->free_list_size);
+        }
+
+        /// Redo a logged insert or erase on a leaf.
+        static void redo(char* page, uint8_t type, const char* payload, uint32_t size) {
+            LeafNode* leaf = reinterpret_cast<LeafNode*>(page);
+            KeyT key;
+            std::memcpy(&key, payload, sizeof(KeyT));
+            if (type == kInsertRecord) {
+                assert(size == sizeof(KeyT) + sizeof(ValueT));
+                ValueT value;
+                std::memcpy(&value, payload + sizeof(KeyT), sizeof(ValueT));
+                leaf->insert(key, value);
+            } else {
+                assert(type == kEraseRecord && size == sizeof(KeyT));
+                leaf->erase(key);
+            }
+            UNUSED(size);
+            leaf->dirty = false;
+        }
+
+        /// Log an insert into a leaf held exclusively.
+        /// @return     The LSN to commit.
+        uint64_t log_insert(const PageGuard& guard, const KeyT& key, const ValueT& value) {
+            char entry[sizeof(KeyT) + sizeof(ValueT)];
+            std::memcpy(entry, &key, sizeof(KeyT));
+            std::memcpy(entry + sizeof(KeyT), &value, sizeof(ValueT));
+            return buffer_manager.log_change(guard, kInsertRecord, entry, sizeof(entry));
+        }
+
+        /// After a crash, the free list and high-water mark in the
+        /// superblock may lag behind the pages the log brought back. Every
+        /// page below the high-water mark that the tree does not reach is
+        /// free; only inner nodes are read to find them.
+        void rebuild_free_list() {
+            std::vector<bool> used;
+            auto use = [&](PageID page_id) {
+                if (page_id >= used.size()) {
+                    used.resize(page_id + 1);
+                }
+                used[page_id] = true;
+            };
+            use(kSuperblockPage);
+            std::vector<PageID> level_nodes;
+            if (root.has_value()) {
+                level_nodes.push_back(*root);
+                use(*root);
+            }
+            for (uint32_t level = height; level > 1; level--) {
+                std::vector<PageID> children;
+                for (PageID page_id : level_nodes) {
+                    PageGuard guard = buffer_manager.pin_page(page_id);
+                    const InnerNode* inner = guard.as<InnerNode>();
+                    children.insert(children.end(), inner->children, inner->children + inner->count);
+                }
+                for (PageID page_id : children) {
+                    use(page_id);
+                }
+                level_nodes = std::move(children);
+            }
+
+            next_page_id = std::max<PageID>(next_page_id, used.size());
+            free_list.load(INVALID_PAGE, 0);
+            for (PageID page_id = next_page_id; page_id-- > kSuperblockPage + 1; ) {
+                if (page_id >= used.size() || !used[page_id]) {
+                    free_list.free(buffer_manager.pin_new_page(page_id));
+                }
+            }
+        }
+
+        /// Destructor. Leaves the superblock current for the next open.
+        ~BTree() {
+            std::lock_guard<HybridLatch> root_lock(root_latch);
+            store_superblock();
+            buffer_manager.disable_swizzling();
+        }
+
+        /// Where an inner node keeps its children, which the buffer manager
+        /// swizzles while they are resident. Only inner nodes are asked about.
+        static std::pair<PageID*, uint32_t> find_children(char* page) {
+            InnerNode* inner = reinterpret_cast<InnerNode*>(page);
+            assert(!inner->is_leaf());
+            return {inner->children, inner->count};
+        }
+
+        /// Write the superblock and every dirty page to disk, so that the
+        /// log written so far is no longer needed.
+        void checkpoint() {
+            {
+                std::lock_guard<HybridLatch> root_lock(root_latch);
+                store_superblock();
+            }
+            buffer_manager.checkpoint();
+        }
+
+        /// Record root, height and the allocation high-water mark in the
+        /// superblock, which is rewritten whole. The caller holds root_latch
+        /// exclusively.
+        /// @return     The superblock, held until the change is logged.
+        PageGuard store_superblock() {
+            PageGuard guard = buffer_manager.pin_new_page(kSuperblockPage);
+            Superblock* superblock = guard.as<Superblock>();
+            superblock->magic = Superblock::kMagic;
+            superblock->format_version = Superblock::kFormatVersion;
+            superblock->height = height;
+            superblock->root = root.value_or(INVALID_PAGE);
+            superblock->next_page_id = next_page_id;
+            superblock->free_list_head = free_list.head();
+            superblock->free_list_size = free_list.size();
+            superblock->inner_layout = InnerLayout::kId;
+            superblock->page_size = PageSize;
+            superblock->key_size = sizeof(KeyT);
+            superblock->value_size = sizeof(ValueT);
+            guard.mark_dirty();
+            return guard;
+        }
+
+        /// A page for a new node, reused if possible.
+        PageID allocate_page() {
+            PageID page_id = free_list.allocate();
+            return page_id != INVALID_PAGE ? page_id : next_page_id++;
+        }
+
+        /// Hand the dirty flag set by the node mutators over to the frame.
+        /// @param[in] guard    Exclusive guard on the node.
+        static void sync_dirty(const PageGuard& guard) {
+            Node* node = guard.as<Node>();
+            if (node->dirty) {
+                node->dirty = false;
+                guard.mark_dirty();
+            }
+        }
+
+        /// A node read optimistically may be torn; only look at its entries
+        /// if its count is in range.
+        static bool is_consistent(const Node* node) {
+            return node->count <= (node->is_leaf() ? LeafNode::kCapacity : InnerNode::kCapacity);
+        }
+
+        /// Start an optimistic read of a node. If the node is not resident
+        /// or is being modified, it is loaded (or its writer waited for)
+        /// through a pin instead, and the invalid guard tells the caller
+        /// to restart.
+        /// @param[in] reference    The page id, or a swizzled child reference.
+        OptimisticGuard read_node(PageID reference) {
+            OptimisticGuard guard = buffer_manager.read_optimistic(reference);
+            if (!guard.is_valid()) {
+                // A reference read from a node that changed may be stale
+                PageID page_id = buffer_manager.page_id_of(reference);
+                if (page_id != INVALID_PAGE) {
+                    buffer_manager.pin_page(page_id);
+                }
+            }
+            return guard;
+        }
+
+        /// Start an optimistic read of the child at a position of an inner
+        /// node, like read_node. An inner child reached by page id is
+        /// swizzled into the node on the way, so later descents skip the
+        /// page table. Leaves are left alone: they are most of what gets
+        /// evicted, and evicting a swizzled page needs its parent's latch.
+        /// @param[in,out] parent   The inner node; swizzling moves its version on.
+        /// @param[in] level        The level of the inner node.
+        OptimisticGuard read_child(OptimisticGuard& parent, uint16_t level, uint32_t position,
+                                   PageID reference) {
+            OptimisticGuard child = read_node(reference);
+            if (child.is_valid() && level > 1 && !is_swizzled(reference)) {
+                buffer_manager.swizzle(parent, position, child);
+            }
+            return child;
+        }
+
+        /// Descend to the leaf for a key with optimistic lock coupling: a
+        /// child is only used once its parent is known to be unchanged.
+        /// @param[out] parent  If given, receives the leaf's parent, or an
+        ///                     invalid guard if the leaf is the root.
+        /// @return     The unvalidated leaf, an invalid guard if the descent
+        ///             has to be restarted, or nullopt if the tree is empty.
+        std::optional<OptimisticGuard> find_leaf(const KeyT &key, OptimisticGuard* parent = nullptr) {
+            return find_node(key, 0, parent);
+        }
+
+        /// Descend like find_leaf, but stop at a level. The node returned is
+        /// the root if the tree is not that high.
+        std::optional<OptimisticGuard> find_node(const KeyT &key, uint16_t level, OptimisticGuard* parent = nullptr) {
+            uint64_t root_version = root_latch.optimistic_version();
+            if (HybridLatch::is_locked(root_version)) {
+                return OptimisticGuard();
+            }
+            std::optional<PageID> root_id = root;
+            if (!root_id.has_value()) {
+                if (!root_latch.validate(root_version)) {
+                    return OptimisticGuard();
+                }
+                return std::nullopt;
+            }
+
+            OptimisticGuard node = read_node(*root_id);
+            if (!node.is_valid() || !root_latch.validate(root_version)) {
+                return OptimisticGuard();
+            }
+            while (node.as<Node>()->level > level) {
+                const InnerNode* inner = node.as<InnerNode>();
+                if (!is_consistent(inner)) {
+                    return OptimisticGuard();
+                }
+                uint16_t node_level = inner->level;
+                uint32_t position = inner->lower_bound(key).first;
+                PageID child_id = inner->children[position];
+                if (!node.validate()) {
+                    return OptimisticGuard();
+                }
+                OptimisticGuard child = read_child(node, node_level, position, child_id);
+                if (!child.is_valid() || !node.validate()) {
+                    return OptimisticGuard();
+                }
+                if (parent != nullptr) {
+                    *parent = node;
+                }
+                node = child;
+            }
+            return node;
+        }
+
+        /// Lookup an entry in the tree.
+        /// @param[in] key      The key that should be searched.
+        std::optional<ValueT> lookup(const KeyT &key) {
+            // TODO
+            // UNUSED(key);
+            // return std::optional<ValueT>();
+            // Readers latch nothing; a concurrent change to the leaf makes
+            // them start over
+            while (1) {
+                std::optional<OptimisticGuard> leaf_guard = find_leaf(key);
+                if (!leaf_guard.has_value()) {
+                    return std::nullopt;
+                }
+                if (!leaf_guard->is_valid()) {
+                    continue;
+                }
+
+                const LeafNode* leaf = leaf_guard->as<LeafNode>();
+                std::optional<ValueT> value;
+                if (is_consistent(leaf)) {
+                    uint32_t position = leaf->find_position(key);
+                    if (position < leaf->count && leaf->keys[position] == key) {
+                        value = leaf->values[position];
+                    }
+                }
+                if (leaf_guard->validate()) {
+                    return value;
+                }
+            }
+        }
+
+        /// Look up many keys at once. The keys are sorted and the tree is
+        /// descended one level at a time, so each node on the way is read
+        /// once per batch rather than once per key. Before a level is
+        /// searched, its nodes are prefetched into the CPU cache, and those
+        /// not cached at all are read from disk together.
+        /// @param[in] keys     The keys, in any order.
+        /// @return     The value of each key, in the order of keys.
+        std::vector<std::optional<ValueT>> lookup_batch(const std::vector<KeyT> &keys) {
+            ComparatorT less;
+            std::vector<std::optional<ValueT>> values(keys.size());
+            std::vector<uint32_t> order(keys.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return less(keys[a], keys[b]);
+            });
+
+            // A node still to be searched for the sorted keys [begin, end),
+            // with the parent it was found through. The page id is the
+            // reference in the parent, which may be swizzled.
+            struct Visit {
+                PageID page_id;
+                OptimisticGuard parent;
+                uint32_t begin;
+                uint32_t end;
+            };
+            // Keys whose nodes changed under the batch are looked up one by one
+            auto look_up_each = [&](const Visit& visit) {
+                for (uint32_t i = visit.begin; i < visit.end; i++) {
+                    values[order[i]] = lookup(keys[order[i]]);
+                }
+            };
+
+            std::vector<Visit> level;
+            uint64_t root_version = root_latch.optimistic_version();
+            std::optional<PageID> root_id = root;
+            if (keys.empty() || HybridLatch::is_locked(root_version) || !root_id.has_value() ||
+                !root_latch.validate(root_version)) {
+                look_up_each({INVALID_PAGE, OptimisticGuard(), 0, static_cast<uint32_t>(keys.size())});
+                return values;
+            }
+            level.push_back({*root_id, OptimisticGuard(), 0, static_cast<uint32_t>(keys.size())});
+
+            // Search one node for the keys of a visit. The keys of an inner
+            // node are passed on to its children as visits of the next
+            // level, consecutive keys that go to the same child as one.
+            auto search = [&](const Visit& visit, OptimisticGuard& guard, std::vector<Visit>& next_level) {
+                if (!guard.is_valid()) {
+                    guard = read_node(visit.page_id);
+                    if (!guard.is_valid()) {
+                        guard = buffer_manager.read_optimistic(visit.page_id);
+                    }
+                }
+                // The node must still be the parent's child, and the root
+                // must still be the root
+                bool valid = guard.is_valid() && (visit.parent.is_valid()
+                    ? visit.parent.validate() : root_latch.validate(root_version));
+                if (!valid || !is_consistent(guard.as<Node>())) {
+                    look_up_each(visit);
+                    return;
+                }
+
+                if (guard.as<Node>()->is_leaf()) {
+                    const LeafNode* leaf = guard.as<LeafNode>();
+                    for (uint32_t k = visit.begin; k < visit.end; k++) {
+                        const KeyT& key = keys[order[k]];
+                        uint32_t position = leaf->find_position(key);
+                        if (position < leaf->count && leaf->keys[position] == key) {
+                            values[order[k]] = leaf->values[position];
+                        } else {
+                            values[order[k]].reset();
+                        }
+                    }
+                    if (!guard.validate()) {
+                        look_up_each(visit);
+                    }
+                    return;
+                }
+
+                const InnerNode* inner = guard.as<InnerNode>();
+                size_t first_child = next_level.size();
+                for (uint32_t k = visit.begin; k < visit.end; k++) {
+                    PageID child_id = inner->children[inner->lower_bound(keys[order[k]]).first];
+                    if (next_level.size() > first_child && next_level.back().page_id == child_id) {
+                        next_level.back().end = k + 1;
+                    } else {
+                        next_level.push_back({child_id, guard, k, k + 1});
+                    }
+                }
+                if (!guard.validate()) {
+                    next_level.resize(first_child);
+                    look_up_each(visit);
+                }
+            };
+
+            std::vector<OptimisticGuard> nodes;
+            std::vector<PageID> missing;
+            while (!level.empty()) {
+                std::vector<Visit> next_level;
+                // A level is read a window at a time, so that nodes read
+                // ahead are not evicted again before they are searched
+                for (size_t window = 0; window < level.size(); window += ASYNC_IO_QUEUE_DEPTH) {
+                    size_t window_end = std::min<size_t>(level.size(), window + ASYNC_IO_QUEUE_DEPTH);
+                    nodes.clear();
+                    missing.clear();
+                    for (size_t i = window; i < window_end; i++) {
+                        nodes.push_back(buffer_manager.read_optimistic(level[i].page_id));
+                        if (nodes.back().is_valid()) {
+                            const char* node = nodes.back().as<char>();
+                            __builtin_prefetch(node);
+                            __builtin_prefetch(node + PageSize / 2);
+                        } else {
+                            missing.push_back(buffer_manager.page_id_of(level[i].page_id));
+                        }
+                    }
+                    if (!missing.empty() && buffer_manager.prefetch(missing) > 0) {
+                        buffer_manager.drain_prefetches();
+                    }
+                    for (size_t i = window; i < window_end; i++) {
+                        search(level[i], nodes[i - window], next_level);
+                    }
+                }
+                level = std::move(next_level);
+            }
+            return values;
+        }
+
+        /// A position in the chain of leaves. It keeps a shared latch on
+        /// its leaf (on two while stepping right), so the tree must not be
+        /// modified from the thread that holds it.
+        class Iterator {
+        public:
+            Iterator() = default;
+
+            bool is_valid() const { return leaf.is_valid(); }
+            const KeyT& key() const { return node()->keys[position]; }
+            const ValueT& value() const { return node()->values[position]; }
+
+            /// Move to the next entry; past the last one the iterator
+            /// becomes invalid.
+            void next() {
+                position++;
+                skip_forward();
+            }
+
+            /// Move to the previous entry; before the first one the
+            /// iterator becomes invalid.
+            void prev() {
+                if (position > 0) {
+                    position--;
+                    return;
+                }
+                KeyT bound = key();
+                step_back(bound);
+            }
+
+        private:
+            friend class BTree;
+
+            BTree* tree = nullptr;
+            PageGuard leaf;
+            uint32_t position = 0;
+
+            Iterator(BTree* tree, PageGuard leaf, uint32_t position)
+                : tree(tree), leaf(std::move(leaf)), position(position) {}
+
+            const LeafNode* node() const { return leaf.as<LeafNode>(); }
+
+            /// Move right until position is on an entry. The next leaf is
+            /// latched before the current one is let go.
+            void skip_forward() {
+                while (position >= node()->count) {
+                    PageID next_id = node()->next;
+                    if (next_id == INVALID_PAGE) {
+                        leaf.release();
+                        return;
+                    }
+                    leaf = tree->buffer_manager.pin_page(next_id);
+                    position = 0;
+                    tree->prefetch_leaf(node()->next);
+                }
+            }
+
+            /// Move to the last entry of an earlier leaf. Writers latch
+            /// leaves left to right, so the current leaf is let go before
+            /// its left sibling is latched; if the link changed meanwhile,
+            /// the entry before bound is searched from the root instead.
+            void step_back(const KeyT& bound) {
+                ComparatorT less;
+                while (1) {
+                    PageID page_id = leaf.page_id();
+                    PageID prev_id = node()->prev;
+                    leaf.release();
+                    if (prev_id == INVALID_PAGE) {
+                        return;
+                    }
+                    PageGuard prev_leaf = tree->buffer_manager.pin_page(prev_id);
+                    const LeafNode* prev_node = prev_leaf.as<LeafNode>();
+                    if (!prev_node->is_leaf() || prev_node->next != page_id ||
+                        (prev_node->count > 0 && !less(prev_node->keys[prev_node->count - 1], bound))) {
+                        prev_leaf.release();
+                        *this = tree->seek_back(bound, false);
+                        return;
+                    }
+                    leaf = std::move(prev_leaf);
+                    tree->prefetch_leaf(node()->prev);
+                    if (node()->count > 0) {
+                        position = node()->count - 1;
+                        return;
+                    }
+                }
+            }
+        };
+
+        /// The first entry whose key is not less than key.
+        Iterator seek(const KeyT &key) {
+            PageGuard leaf = latch_leaf(key);
+            if (!leaf.is_valid()) {
+                return Iterator();
+            }
+            uint32_t position = leaf.as<LeafNode>()->find_position(key);
+            Iterator iterator(this, std::move(leaf), position);
+            prefetch_leaf(iterator.node()->next);
+            iterator.skip_forward();
+            return iterator;
+        }
+
+        /// The last entry whose key is less than key, or not greater than
+        /// key if inclusive.
+        Iterator seek_back(const KeyT &key, bool inclusive = true) {
+            PageGuard leaf = latch_leaf(key);
+            if (!leaf.is_valid()) {
+                return Iterator();
+            }
+            const LeafNode* node = leaf.as<LeafNode>();
+            uint32_t position = inclusive
+                ? count_keys_before<true, KeyT, ComparatorT>(node->keys, node->count, key)
+                : node->find_position(key);
+            Iterator iterator(this, std::move(leaf), position);
+            if (position > 0) {
+                iterator.position--;
+            } else {
+                iterator.step_back(key);
+            }
+            return iterator;
+        }
+
+        /// All entries with lo <= key <= hi, in key order.
+        std::vector<std::pair<KeyT, ValueT>> scan(const KeyT &lo, const KeyT &hi) {
+            ComparatorT less;
+            std::vector<std::pair<KeyT, ValueT>> entries;
+            for (Iterator iterator = seek(lo); iterator.is_valid() && !less(hi, iterator.key()); iterator.next()) {
+                entries.emplace_back(iterator.key(), iterator.value());
+            }
+            return entries;
+        }
+
+        /// Shared guard on the leaf for a key, invalid if the tree is empty.
+        PageGuard latch_leaf(const KeyT &key) {
+            while (1) {
+                std::optional<OptimisticGuard> leaf_guard = find_leaf(key);
+                if (!leaf_guard.has_value()) {
+                    return PageGuard();
+                }
+                if (!leaf_guard->is_valid()) {
+                    continue;
+                }
+                PageGuard guard = buffer_manager.lock_shared(*leaf_guard);
+                if (guard.is_valid()) {
+                    return guard;
+                }
+            }
+        }
+
+        /// Start reading a leaf a scan is about to reach.
+        void prefetch_leaf(PageID page_id) {
+            if (page_id != INVALID_PAGE) {
+                buffer_manager.prefetch({page_id});
+            }
+        }
+
+        /// Erase an entry in the tree.
+        /// @param[in] key      The key that should be searched.
+        void erase(const KeyT &key) {
+            // TODO
+            // UNUSED(key);
+            // Only the leaf is latched
+            while (1) {
+                std::optional<OptimisticGuard> leaf_guard = find_leaf(key);
+                if (!leaf_guard.has_value()) {
+                    return;
+                }
+                if (!leaf_guard->is_valid()) {
+                    continue;
+                }
+                PageGuard guard = buffer_manager.lock_exclusive(*leaf_guard);
+                if (!guard.is_valid()) {
+                    continue;
+                }
+                LeafNode* leaf = guard.as<LeafNode>();
+                uint32_t count = leaf->count;
+                leaf->erase(key);
+                sync_dirty(guard);
+                uint64_t lsn = leaf->count == count
+                    ? 0 : buffer_manager.log_change(guard, kEraseRecord, &key, sizeof(KeyT));
+                bool underfull = is_underfull(leaf);
+                guard.release();
+                if (underfull) {
+                    rebalance(key, 0);
+                }
+                buffer_manager.commit(lsn);
+                return;
+            }
+        }
+
+        /// A node less than a quarter full is merged with or refilled from
+        /// a sibling. Inner nodes also need two children to be worth keeping.
+        static bool is_underfull(const Node* node) {
+            return node->is_leaf()
+                ? node->count < LeafNode::kCapacity / 4
+                : node->count < std::max<uint32_t>(2, InnerNode::kCapacity / 4);
+        }
+
+        /// Rebalance the underfull node at a level on the path to a key.
+        /// If it fits into one node with its sibling under the same parent,
+        /// the two are merged and the right one's page is freed; otherwise
+        /// entries move over from the sibling until both are even. A merge
+        /// takes a child from the parent, so the parent is rebalanced next,
+        /// and a root left with one child is replaced by that child.
+        /// Like split(), this is best effort: if a concurrent change gets
+        /// in the way too often, the node stays underfull.
+        /// @param[in] key      A key in the node's range.
+        /// @param[in] level    The level of the node.
+        void rebalance(const KeyT &key, uint16_t level) {
+            for (int attempt = 0; attempt < 8; attempt++) {
+                OptimisticGuard parent;
+                std::optional<OptimisticGuard> node = find_node(key, level, &parent);
+                if (!node.has_value()) {
+                    return;
+                }
+                if (!node->is_valid()) {
+                    continue;
+                }
+                const Node* current = node->as<Node>();
+                bool underfull = current->level == level && is_underfull(current);
+                bool single_child = !current->is_leaf() && current->count < 2;
+                if (!node->validate()) {
+                    continue;
+                }
+                if (!underfull) {
+                    return;
+                }
+                if (!parent.is_valid()) {
+                    if (single_child) {
+                        collapse_root();
+                    }
+                    return;
+                }
+
+                // Parent before children, and children left to right, the
+                // same order as split()
+                PageGuard parent_guard = buffer_manager.lock_exclusive(parent);
+                if (!parent_guard.is_valid()) {
+                    continue;
+                }
+                InnerNode* inner = parent_guard.as<InnerNode>();
+                // Children are about to be pinned by page id, and moved
+                // between nodes
+                buffer_manager.unswizzle_children(parent_guard);
+                if (inner->count < 2) {
+                    // No sibling to merge with; the parent has to go first
+                    parent_guard.release();
+                    level++;
+                    attempt = -1;
+                    continue;
+                }
+                uint32_t position = inner->lower_bound(key).first;
+                uint32_t left_position = position > 0 ? position - 1 : 0;
+                PageGuard left_guard = buffer_manager.pin_page(inner->children[left_position], true);
+                PageGuard right_guard = buffer_manager.pin_page(inner->children[left_position + 1], true);
+                // An insert may have refilled the node meanwhile
+                if (!is_underfull((position == left_position ? left_guard : right_guard).as<Node>())) {
+                    return;
+                }
+                buffer_manager.unswizzle_children(left_guard);
+                buffer_manager.unswizzle_children(right_guard);
+                PageGuard next_guard;
+                bool merged = level == 0
+                    ? rebalance_leaves(*inner, left_position, left_guard, right_guard, next_guard)
+                    : rebalance_inner(*inner, left_position, left_guard, right_guard);
+                sync_dirty(left_guard);
+                sync_dirty(parent_guard);
+                if (merged) {
+                    free_list.free(right_guard);
+                } else {
+                    sync_dirty(right_guard);
+                }
+                buffer_manager.log_images({&parent_guard, &left_guard, &right_guard, &next_guard});
+                if (!merged || !is_underfull(inner)) {
+                    return;
+                }
+                left_guard.release();
+                parent_guard.release();
+                level++;
+                attempt = -1;
+            }
+        }
+
+        /// Merge two neighbouring leaves, or even them out if they do not
+        /// fit into one.
+        /// @param[out] next_guard  On a merge, the latched leaf after the right
+        ///                         one, whose prev link changed, if there is one.
+        /// @return     true if the right leaf was merged into the left one
+        ///             and taken from the parent; it is then unlinked.
+        bool rebalance_leaves(InnerNode& parent, uint32_t left_position,
+                              PageGuard& left_guard, PageGuard& right_guard, PageGuard& next_guard) {
+            LeafNode* left = left_guard.as<LeafNode>();
+            LeafNode* right = right_guard.as<LeafNode>();
+            uint32_t total = left->count + right->count;
+            if (total <= LeafNode::kCapacity) {
+                std::copy(right->keys, right->keys + right->count, left->keys + left->count);
+                std::copy(right->values, right->values + right->count, left->values + left->count);
+                left->count = total;
+                left->next = right->next;
+                left->dirty = true;
+                // Leaves are latched left to right
+                if (right->next != INVALID_PAGE) {
+                    next_guard = buffer_manager.pin_page(right->next, true);
+                    next_guard.as<LeafNode>()->prev = left_guard.page_id();
+                    next_guard.mark_dirty();
+                }
+                parent.erase_child(left_position + 1);
+                return true;
+            }
+
+            uint32_t left_count = total / 2;
+            if (left->count > left_count) {
+                uint32_t moved = left->count - left_count;
+                std::copy_backward(right->keys, right->keys + right->count, right->keys + right->count + moved);
+                std::copy_backward(right->values, right->values + right->count, right->values + right->count + moved);
+                std::copy(left->keys + left_count, left->keys + left->count, right->keys);
+                std::copy(left->values + left_count, left->values + left->count, right->values);
+            } else {
+                uint32_t moved = left_count - left->count;
+                std::copy(right->keys, right->keys + moved, left->keys + left->count);
+                std::copy(right->values, right->values + moved, left->values + left->count);
+                std::copy(right->keys + moved, right->keys + right->count, right->keys);
+                std::copy(right->values + moved, right->values + right->count, right->values);
+            }
+            left->count = left_count;
+            right->count = total - left_count;
+            left->dirty = true;
+            right->dirty = true;
+            parent.keys[left_position] = right->keys[0];
+            parent.dirty = true;
+            parent.rebuild_directory();
+            return false;
+        }
+
+        /// Merge two neighbouring inner nodes, pulling their separator
+        /// down, or even them out through the parent if they do not fit
+        /// into one.
+        /// @return     true if the right node was merged into the left one
+        ///             and taken from the parent.
+        bool rebalance_inner(InnerNode& parent, uint32_t left_position,
+                             PageGuard& left_guard, PageGuard& right_guard) {
+            InnerNode* left = left_guard.as<InnerNode>();
+            InnerNode* right = right_guard.as<InnerNode>();
+            uint32_t total = left->count + right->count;
+
+            // All children of both, and the keys between them
+            std::vector<KeyT> keys(left->keys, left->keys + left->count - 1);
+            keys.push_back(parent.keys[left_position]);
+            keys.insert(keys.end(), right->keys, right->keys + right->count - 1);
+            std::vector<PageID> children(left->children, left->children + left->count);
+            children.insert(children.end(), right->children, right->children + right->count);
+
+            uint32_t left_count = total <= InnerNode::kCapacity ? total : total / 2;
+            std::copy(keys.begin(), keys.begin() + left_count - 1, left->keys);
+            std::copy(children.begin(), children.begin() + left_count, left->children);
+            left->count = left_count;
+            left->dirty = true;
+            left->rebuild_directory();
+            if (left_count == total) {
+                parent.erase_child(left_position + 1);
+                return true;
+            }
+            std::copy(keys.begin() + left_count, keys.end(), right->keys);
+            std::copy(children.begin() + left_count, children.end(), right->children);
+            right->count = total - left_count;
+            right->dirty = true;
+            right->rebuild_directory();
+            parent.keys[left_position] = keys[left_count - 1];
+            parent.dirty = true;
+            parent.rebuild_directory();
+            return false;
+        }
+
+        /// Replace an inner root that has a single child by that child.
+        void collapse_root() {
+            std::lock_guard<HybridLatch> root_lock(root_latch);
+            while (root.has_value() && height > 1) {
+                PageGuard guard = buffer_manager.pin_page(*root, true);
+                const InnerNode* inner = guard.as<InnerNode>();
+                if (inner->count > 1) {
+                    break;
+                }
+                buffer_manager.unswizzle_children(guard);
+                root = inner->children[0];
+                height--;
+                free_list.free(guard);
+                PageGuard superblock_guard = store_superblock();
+                buffer_manager.log_images({&guard, &superblock_guard});
+            }
+        }
+
+        /// Inserts a new entry into the tree.
+        /// @param[in] key      The key that should be inserted.
+        /// @param[in] value    The value that should be inserted.
+        void insert(const KeyT &key, const ValueT &value) {
+            // TODO
+            // UNUSED(key);
+            // UNUSED(value);
+            write(key, [&](const std::optional<ValueT>&) { return std::optional<ValueT>(value); });
+        }
+
+        /// Insert an entry unless its key is already in the tree.
+        /// @param[in] key      The key that should be inserted.
+        /// @param[in] value    The value that should be inserted.
+        /// @return     true if the entry was inserted, false if the key was present.
+        bool insert_if_absent(const KeyT &key, const ValueT &value) {
+            bool inserted = false;
+            write(key, [&](const std::optional<ValueT>& current) {
+                inserted = !current.has_value();
+                return inserted ? std::optional<ValueT>(value) : std::nullopt;
+            });
+            return inserted;
+        }
+
+        /// Read, modify and write the value of a key in one descent, instead
+        /// of a lookup followed by an insert. fn runs once, while the leaf is
+        /// latched exclusively, so it must not use the tree.
+        /// @param[in] key      The key that should be updated.
+        /// @param[in] fn       Maps the current value, nullopt if the key is
+        ///                     missing, to the value to store.
+        /// @return     The value stored.
+        template <typename Fn>
+        ValueT upsert(const KeyT &key, Fn fn) {
+            std::optional<ValueT> stored;
+            write(key, [&](const std::optional<ValueT>& current) {
+                stored = fn(current);
+                return stored;
+            });
+            return *stored;
+        }
+
+        /// Combine an operand into the value of a key, as a merge operator
+        /// does: a missing key gets the operand itself, a present one
+        /// merge_op(current, operand). merge_op runs as fn does in upsert.
+        /// @param[in] key          The key that should be updated.
+        /// @param[in] operand      The operand that should be merged in.
+        /// @param[in] merge_op     Combines the current value with the operand.
+        /// @return     The value stored.
+        template <typename MergeFn>
+        ValueT merge(const KeyT &key, const ValueT &operand, MergeFn merge_op) {
+            return upsert(key, [&](const std::optional<ValueT>& current) {
+                return current.has_value() ? merge_op(*current, operand) : operand;
+            });
+        }
+
+        /// Apply an update to the leaf of a key, the way LeafNode::upsert
+        /// does, and log the value it stores. Shared by insert and the
+        /// read-modify-write calls; update runs exactly once.
+        /// @param[in] key      The key that should be updated.
+        /// @param[in] update   As for LeafNode::upsert; it must return a value
+        ///                     for a missing key when the tree is empty.
+        template <typename UpdateFn>
+        void write(const KeyT &key, UpdateFn &&update) {
+            if (try_append(key, update)) {
+                return;
+            }
+            while (!try_insert(key, update)) {
+            }
+        }
+
+        /// Update the latched leaf and log the change, if any.
+        /// @return     The LSN to commit, 0 if nothing changed.
+        template <typename UpdateFn>
+        uint64_t update_leaf(const PageGuard& guard, const KeyT &key, UpdateFn &update) {
+            std::optional<ValueT> value = guard.as<LeafNode>()->upsert(key, update);
+            sync_dirty(guard);
+            return value.has_value() ? log_insert(guard, key, *value) : 0;
+        }
+
+        /// Insert into the rightmost leaf without descending, if the key
+        /// belongs there and the leaf has room. The rightmost leaf holds
+        /// every key from its first one on, so with ascending keys nearly
+        /// every insert takes this path.
+        /// @return     false if the insert has to go through try_insert.
+        template <typename UpdateFn>
+        bool try_append(const KeyT &key, UpdateFn &update) {
+            ComparatorT less;
+            PageID page_id = rightmost_leaf.load(std::memory_order_relaxed);
+            if (page_id == INVALID_PAGE) {
+                return false;
+            }
+            OptimisticGuard node = buffer_manager.read_optimistic(page_id);
+            if (!node.is_valid()) {
+                return false;
+            }
+            // The page may have been freed or reused since it was rightmost
+            const LeafNode* leaf = node.as<LeafNode>();
+            bool fits = leaf->is_leaf() && leaf->next == INVALID_PAGE && leaf->count > 0 &&
+                        leaf->count < LeafNode::kCapacity && !less(key, leaf->keys[0]);
+            if (!node.validate() || !fits) {
+                return false;
+            }
+            PageGuard guard = buffer_manager.lock_exclusive(node);
+            if (!guard.is_valid()) {
+                return false;
+            }
+            uint64_t lsn = update_leaf(guard, key, update);
+            guard.release();
+            buffer_manager.commit(lsn);
+            return true;
+        }
+
+        /// One optimistic attempt of insert(). A full node met on the way
+        /// down is split right away and the attempt restarted, so every
+        /// parent has room for a separator and a split never propagates.
+        /// @return     false if the insert has to be restarted.
+        template <typename UpdateFn>
+        bool try_insert(const KeyT &key, UpdateFn &update) {
+            uint64_t root_version = root_latch.optimistic_version();
+            if (HybridLatch::is_locked(root_version)) {
+                return false;
+            }
+            std::optional<PageID> root_id = root;
+            if (!root_id.has_value()) {
+                if (!root_latch.try_upgrade(root_version)) {
+                    return false;
+                }
+                std::unique_lock<HybridLatch> root_lock(root_latch, std::adopt_lock);
+                PageID page_id = allocate_page();
+                PageGuard guard = buffer_manager.pin_new_page(page_id);
+                auto leaf = guard.as<LeafNode>();
+                *leaf = LeafNode();
+                leaf->upsert(key, update);
+                assert(leaf->count == 1);
+                sync_dirty(guard);
+                root = page_id;
+                height = 1;
+                PageGuard superblock_guard = store_superblock();
+                uint64_t lsn = buffer_manager.log_images({&guard, &superblock_guard});
+                rightmost_leaf = page_id;
+                superblock_guard.release();
+                guard.release();
+                root_lock.unlock();
+                buffer_manager.commit(lsn);
+                return true;
+            }
+
+            OptimisticGuard node = read_node(*root_id);
+            if (!node.is_valid() || !root_latch.validate(root_version)) {
+                return false;
+            }
+            // Invalid while node is the root
+            OptimisticGuard parent;
+            // Whether node is the last child of every node above it
+            bool right_edge = true;
+            while (1) {
+                const Node* current = node.as<Node>();
+                if (!is_consistent(current)) {
+                    return false;
+                }
+                if (current->is_full(current->is_leaf() ? LeafNode::kCapacity : InnerNode::kCapacity)) {
+                    split(parent, root_version, node, key, right_edge);
+                    return false;
+                }
+                if (current->is_leaf()) {
+                    break;
+                }
+
+                const InnerNode* inner = node.as<InnerNode>();
+                uint16_t node_level = inner->level;
+                uint32_t position = inner->lower_bound(key).first;
+                PageID child_id = inner->children[position];
+                right_edge = right_edge && position == inner->count - 1u;
+                if (!node.validate()) {
+                    return false;
+                }
+                OptimisticGuard child = read_child(node, node_level, position, child_id);
+                if (!child.is_valid() || !node.validate()) {
+                    return false;
+                }
+                parent = node;
+                node = child;
+            }
+
+            // Latching fails if the leaf changed since it was read
+            PageGuard guard = buffer_manager.lock_exclusive(node);
+            if (!guard.is_valid()) {
+                return false;
+            }
+            uint64_t lsn = update_leaf(guard, key, update);
+            if (guard.as<LeafNode>()->next == INVALID_PAGE) {
+                rightmost_leaf = node.page_id();
+            }
+            guard.release();
+            buffer_manager.commit(lsn);
+            return true;
+        }
+
+        /// Split a full node and hook the new right sibling into its parent.
+        /// Only the node and its parent, or the root latch if the node is
+        /// the root, are latched. Gives up if either changed since it was read.
+        /// @param[in] parent           The parent read on the way down, invalid for the root.
+        /// @param[in] root_version     The root latch version read on the way down.
+        /// @param[in] node             The full node.
+        /// @param[in] key              The key being inserted, which biases the split.
+        /// @param[in] right_edge       Whether the node was on the rightmost path.
+        void split(const OptimisticGuard& parent, uint64_t root_version, const OptimisticGuard& node,
+                   const KeyT &key, bool right_edge) {
+            PageGuard parent_guard;
+            std::unique_lock<HybridLatch> root_lock;
+            if (parent.is_valid()) {
+                parent_guard = buffer_manager.lock_exclusive(parent);
+                if (!parent_guard.is_valid()) {
+                    return;
+                }
+            } else {
+                if (!root_latch.try_upgrade(root_version)) {
+                    return;
+                }
+                root_lock = std::unique_lock<HybridLatch>(root_latch, std::adopt_lock);
+            }
+            PageGuard node_guard = buffer_manager.lock_exclusive(node);
+            if (!node_guard.is_valid()) {
+                return;
+            }
+            // Children swizzled into a node held exclusively cannot be
+            // evicted, and pages are about to be allocated. Half the
+            // children of an inner node also move to the new node.
+            if (parent_guard.is_valid()) {
+                buffer_manager.unswizzle_children(parent_guard);
+            }
+            buffer_manager.unswizzle_children(node_guard);
+
+            PageID new_page_id = allocate_page();
+            PageGuard new_guard = buffer_manager.pin_new_page(new_page_id);
+            uint16_t level = node_guard.as<Node>()->level;
+            KeyT separator;
+            PageGuard next_guard;
+            if (level == 0) {
+                auto new_leaf = new_guard.as<LeafNode>();
+                *new_leaf = LeafNode();
+                separator = node_guard.as<LeafNode>()->split(new_leaf, node.page_id(), new_page_id, key);
+                // Leaves are latched left to right
+                if (new_leaf->next != INVALID_PAGE) {
+                    next_guard = buffer_manager.pin_page(new_leaf->next, true);
+                    next_guard.as<LeafNode>()->prev = new_page_id;
+                    next_guard.mark_dirty();
+                } else {
+                    rightmost_leaf = new_page_id;
+                }
+            } else {
+                auto new_inner = new_guard.as<InnerNode>();
+                *new_inner = InnerNode();
+                separator = node_guard.as<InnerNode>()->split(new_inner, key, right_edge);
+            }
+            sync_dirty(node_guard);
+            sync_dirty(new_guard);
+
+            if (parent_guard.is_valid()) {
+                parent_guard.as<InnerNode>()->insert(separator, new_page_id);
+                sync_dirty(parent_guard);
+                buffer_manager.log_images({&parent_guard, &node_guard, &new_guard, &next_guard});
+                return;
+            }
+
+            // The root itself split, so the tree grows by one level
+            PageID new_root_id = allocate_page();
+            PageGuard new_root_guard = buffer_manager.pin_new_page(new_root_id);
+            auto new_root = new_root_guard.as<InnerNode>();
+            *new_root = InnerNode();
+            new_root->level = level + 1;
+            new_root->children[0] = node.page_id();
+            new_root->keys[0] = separator;
+            new_root->children[1] = new_page_id;
+            new_root->count = 2;
+            new_root->dirty = true;
+            new_root->rebuild_directory();
+            sync_dirty(new_root_guard);
+            root = new_root_id;
+            height = level + 2;
+            PageGuard superblock_guard = store_superblock();
+            buffer_manager.log_images({&new_root_guard, &node_guard, &new_guard, &next_guard, &superblock_guard});
+        }
+
+        /// Build the tree bottom-up from entries sorted by key, instead of
+        /// inserting them one by one. Leaves are packed left to right, then
+        /// each inner level is built over the one below. Pages are taken in
+        /// ascending order past the high-water mark and written back in
+        /// batches as they are completed, so the load writes the file
+        /// sequentially and never reads it. The pages are not logged; the
+        /// load ends with a checkpoint instead. The tree must have no root
+        /// yet and must not be used by other threads meanwhile.
+        /// @param[in] first, last     The entries, as pairs of key and value.
+        ///                            A repeated key keeps its last value.
+        /// @param[in] fill_factor     The share of each node to fill, in (0, 1].
+        template <typename InputIt>
+        void bulk_load(InputIt first, InputIt last, double fill_factor = 1.0) {
+            assert(!root.has_value());
+            assert(fill_factor > 0 && fill_factor <= 1);
+            ComparatorT less;
+            uint32_t leaf_fill = std::clamp<uint32_t>(
+                static_cast<uint32_t>(LeafNode::kCapacity * fill_factor), 1, LeafNode::kCapacity);
+            uint32_t inner_fill = std::clamp<uint32_t>(
+                static_cast<uint32_t>(InnerNode::kCapacity * fill_factor), 2, InnerNode::kCapacity);
+
+            std::lock_guard<HybridLatch> root_lock(root_latch);
+            std::vector<PageID> written;
+            auto finish_page = [&](PageGuard& guard) {
+                sync_dirty(guard);
+                written.push_back(guard.page_id());
+                guard.release();
+                if (written.size() == ASYNC_IO_QUEUE_DEPTH) {
+                    buffer_manager.flush_pages(written);
+                    written.clear();
+                }
+            };
+
+            // The lowest key and the page of each node on the level built last
+            std::vector<std::pair<KeyT, PageID>> level_nodes;
+            PageGuard guard;
+            for (; first != last; ++first) {
+                const auto& [key, value] = *first;
+                LeafNode* leaf = guard.is_valid() ? guard.as<LeafNode>() : nullptr;
+                if (leaf != nullptr && leaf->count > 0) {
+                    const KeyT& last_key = leaf->keys[leaf->count - 1];
+                    assert(!less(key, last_key));
+                    if (!less(last_key, key)) {
+                        leaf->values[leaf->count - 1] = value;
+                        continue;
+                    }
+                }
+                if (leaf == nullptr || leaf->count == leaf_fill) {
+                    PageID page_id = next_page_id++;
+                    PageID prev_id = INVALID_PAGE;
+                    if (leaf != nullptr) {
+                        leaf->next = page_id;
+                        prev_id = guard.page_id();
+                        finish_page(guard);
+                    }
+                    guard = buffer_manager.pin_new_page(page_id);
+                    leaf = guard.as<LeafNode>();
+                    *leaf = LeafNode();
+                    leaf->prev = prev_id;
+                    level_nodes.emplace_back(key, page_id);
+                }
+                leaf->keys[leaf->count] = key;
+                leaf->values[leaf->count] = value;
+                leaf->count++;
+                leaf->dirty = true;
+            }
+            if (!guard.is_valid()) {
+                return;
+            }
+            rightmost_leaf = guard.page_id();
+            finish_page(guard);
+
+            // Spread each level evenly over its nodes, so that the last
+            // one is not left with a single child
+            uint16_t level = 0;
+            while (level_nodes.size() > 1) {
+                level++;
+                size_t num_children = level_nodes.size();
+                size_t num_nodes = std::max<size_t>(1, std::min(
+                    (num_children + inner_fill - 1) / inner_fill, num_children / 2));
+                std::vector<std::pair<KeyT, PageID>> parents;
+                size_t child = 0;
+                for (size_t node = 0; node < num_nodes; node++) {
+                    size_t end = num_children * (node + 1) / num_nodes;
+                    PageID page_id = next_page_id++;
+                    guard = buffer_manager.pin_new_page(page_id);
+                    InnerNode* inner = guard.as<InnerNode>();
+                    *inner = InnerNode();
+                    inner->level = level;
+                    parents.emplace_back(level_nodes[child].first, page_id);
+                    for (; child < end; child++) {
+                        if (inner->count > 0) {
+                            inner->keys[inner->count - 1] = level_nodes[child].first;
+                        }
+                        inner->children[inner->count] = level_nodes[child].second;
+                        inner->count++;
+                    }
+                    inner->dirty = true;
+                    inner->rebuild_directory();
+                    finish_page(guard);
+                }
+                level_nodes = std::move(parents);
+            }
+            buffer_manager.flush_pages(written);
+
+            // The pages are not logged, so the superblock may only point
+            // to them once they are on disk
+            root = level_nodes[0].second;
+            height = level + 1;
+            store_superblock();
+            buffer_manager.checkpoint();
+        }
+};
+
+// Replay a page trace against a policy the way the buffer manager drives it.
+// Returns the number of hits.
+size_t simulate_policy(Policy& policy, size_t capacity, const std::vector<PageID>& trace) {
+    std::vector<char> resident(*std::max_element(trace.begin(), trace.end()) + 1, 0);
+    size_t num_resident = 0;
+    size_t hits = 0;
+    for (PageID page_id : trace) {
+        if (resident[page_id]) {
+            hits++;
+        } else {
+            if (num_resident == capacity) {
+                resident[policy.evict()] = 0;
+                num_resident--;
+            }
+            resident[page_id] = 1;
+            num_resident++;
+        }
+        policy.touch(page_id);
+    }
+    return hits;
+}
+
+// Hit ratio and throughput of each replacement policy on a skewed trace:
+// a hot set that fits in the pool, interrupted by scans over cold pages.
+void benchmark_policies() {
+    constexpr size_t capacity = 1000;
+    constexpr PageID hot_pages = 600;
+    constexpr PageID num_pages = 60000;
+    constexpr PageID scan_length = 4000;
+
+    std::mt19937_64 engine(0);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_int_distribution<PageID> scan_start(hot_pages, num_pages - scan_length);
+    std::vector<PageID> trace;
+    for (auto round = 0; round < 200; ++round) {
+        for (auto i = 0; i < 20000; ++i) {
+            // Squaring a uniform variate skews the accesses towards low ids
+            double u = unit(engine);
+            trace.push_back(static_cast<PageID>(hot_pages * u * u));
+        }
+        PageID start = scan_start(engine);
+        for (PageID page_id = start; page_id < start + scan_length; ++page_id) {
+            trace.push_back(page_id);
+        }
+    }
+
+    std::cout << "Policy   Hit ratio   Mops/s  (" << trace.size() << " accesses, "
+              << capacity << " frames, " << hot_pages << " hot pages, scans of "
+              << scan_length << ")\n";
+    const std::pair<PolicyType, const char*> policies[] = {
+        {LRU, "LRU"}, {CLOCK, "CLOCK"}, {TWO_Q, "2Q"}, {ARC, "ARC"}};
+    for (const auto& [policy_type, name] : policies) {
+        auto policy = make_policy(policy_type, capacity);
+        auto start = std::chrono::steady_clock::now();
+        size_t hits = simulate_policy(*policy, capacity, trace);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << std::left << std::setw(9) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(8) << 100.0 * hits / trace.size() << "%"
+                  << std::setw(10) << trace.size() / elapsed.count() / 1e6 << "\n";
+    }
+}
+
+// Cached pin/unpin throughput of the buffer manager as threads are added
+void benchmark_buffer_threads() {
+    constexpr PageID num_pages = 900;
+    constexpr size_t ops_per_thread = 2000000;
+    BufferManager buffer_manager(true, 64 * 1024 * 1024);
+
+    for (PageID page_id = 1; page_id <= num_pages; ++page_id) {
+        buffer_manager.pin_page(page_id);
+    }
+
+    std::cout << "Threads   Mops/s  (" << buffer_manager.getNumShards() << " shards, "
+              << num_pages << " cached pages)\n";
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t thread_id = 0; thread_id < num_threads; ++thread_id) {
+            threads.emplace_back([&, thread_id] {
+                std::mt19937_64 engine(thread_id);
+                std::uniform_int_distribution<PageID> page_distr(1, num_pages);
+                for (size_t i = 0; i < ops_per_thread; ++i) {
+                    buffer_manager.pin_page(page_distr(engine));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << std::setw(7) << num_threads << std::fixed << std::setprecision(2)
+                  << std::setw(9) << num_threads * ops_per_thread / elapsed.count() / 1e6 << "\n";
+    }
+}
+
+// Compare the buffer pool with the mmap mode on an index that fits in RAM:
+// hot and cold random lookups, and updates with a checkpoint every
+// 1000 of them. Run with a file system that keeps buzzdb.dat on disk.
+void benchmark_storage_modes() {
+    using Tree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE>;
+    constexpr uint64_t num_keys = 100000;
+    constexpr size_t num_lookups = 1000000;
+    constexpr size_t num_updates = 50000;
+    constexpr size_t checkpoint_interval = 1000;
+
+    // Build the index once; later opens find it through the superblock
+    PageID next_page_id;
+    {
+        BufferManager buffer_manager(true, MAX_PAGES * PAGE_SIZE);
+        Tree tree(buffer_manager);
+        std::mt19937_64 engine(0);
+        std::vector<uint64_t> keys(num_keys);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::shuffle(keys.begin(), keys.end(), engine);
+        for (uint64_t key : keys) {
+            tree.insert(key, key);
+        }
+        next_page_id = tree.next_page_id;
+        std::cout << "Index: " << num_keys << " keys on " << next_page_id << " pages\n";
+    }
+
+    auto per_second = [](size_t ops, std::chrono::steady_clock::time_point start) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return ops / elapsed.count();
+    };
+
+    struct Setup {
+        const char* name;
+        size_t pool_size;
+        StorageMode storage_mode;
+    };
+    std::vector<Setup> setups = {
+        {"buffered, pool holds the index", MAX_PAGES * PAGE_SIZE, BUFFERED},
+        {"buffered, pool holds 1/4", next_page_id / 4 * PAGE_SIZE, BUFFERED},
+        {"mmap", DEFAULT_POOL_SIZE, MMAP},
+    };
+
+    std::cout << std::left << std::setw(32) << "Mode" << std::right
+              << std::setw(14) << "cold lookup/s" << std::setw(14) << "hot lookup/s"
+              << std::setw(14) << "update/s" << "\n";
+    for (const Setup& setup : setups) {
+        // Start from an uncached file
+        {
+            int fd = open(database_filename.c_str(), O_RDONLY);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        BufferManager buffer_manager(false, setup.pool_size, LRU, 0, false, setup.storage_mode);
+        buffer_manager.advise(RANDOM_ACCESS);
+        Tree tree(buffer_manager);
+        std::mt19937_64 engine(1);
+        std::uniform_int_distribution<uint64_t> key_distr(0, num_keys - 1);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t key = 0; key < num_keys; ++key) {
+            tree.lookup(key);
+        }
+        double cold = per_second(num_keys, start);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_lookups; ++i) {
+            tree.lookup(key_distr(engine));
+        }
+        double hot = per_second(num_lookups, start);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 1; i <= num_updates; ++i) {
+            uint64_t key = key_distr(engine);
+            tree.insert(key, key + i);
+            if (i % checkpoint_interval == 0) {
+                buffer_manager.flush_all();
+            }
+        }
+        double updates = per_second(num_updates, start);
+
+        std::cout << std::left << std::setw(32) << setup.name << std::right << std::fixed
+                  << std::setprecision(0) << std::setw(14) << cold << std::setw(14) << hot
+                  << std::setw(14) << updates << "\n";
+    }
+}
+
+// Node search speed of each kernel at a few fanouts, on keys in the cache,
+// against the linear scan the nodes used before
+void benchmark_search() {
+    constexpr size_t num_nodes = 256;
+    constexpr size_t num_searches = 4000000;
+    std::mt19937_64 engine(0);
+
+    std::cout << "Keys   ns/search: linear    scalar    sse4.2      avx2\n";
+    for (uint32_t n : {16u, 42u, 128u, 255u, 510u}) {
+        std::vector<std::vector<uint64_t>> nodes(num_nodes, std::vector<uint64_t>(n));
+        for (auto& keys : nodes) {
+            for (uint64_t& key : keys) {
+                key = engine();
+            }
+            std::sort(keys.begin(), keys.end());
+        }
+        std::vector<uint64_t> probes(num_searches);
+        for (uint64_t& probe : probes) {
+            probe = engine();
+        }
+
+        auto measure = [&](auto search) {
+            volatile uint64_t checksum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < num_searches; ++i) {
+                checksum = checksum + search(nodes[i % num_nodes].data(), probes[i]);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << std::fixed << std::setprecision(2) << std::setw(10)
+                      << elapsed.count() * 1e9 / num_searches;
+        };
+
+        std::cout << std::setw(4) << n << std::setw(12) << " ";
+        measure([n](const uint64_t* keys, uint64_t key) {
+            uint32_t pos = 0;
+            while (pos < n && keys[pos] < key) {
+                pos++;
+            }
+            return pos;
+        });
+        for (SearchKernel kernel : {SEARCH_SCALAR, SEARCH_SSE42, SEARCH_AVX2}) {
+            if (kernel > best_search_kernel()) {
+                std::cout << std::setw(10) << "-";
+                continue;
+            }
+            measure([n, kernel](const uint64_t* keys, uint64_t key) {
+                return count_keys_before<false, uint64_t, std::less<uint64_t>>(keys, n, key, kernel);
+            });
+        }
+        std::cout << "\n";
+    }
+}
+
+// Lookups one at a time against lookup_batch, on a tree that fits in the
+// pool and on one that does not
+void benchmark_batch_lookup() {
+    using BTree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE>;
+    constexpr uint64_t num_keys = 2000000;
+    constexpr size_t num_lookups = 2000000;
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t key = 0; key < num_keys; ++key) {
+        entries.emplace_back(2 * key, key);
+    }
+    std::mt19937_64 engine(0);
+    std::vector<uint64_t> probes(num_lookups);
+    for (uint64_t& probe : probes) {
+        probe = engine() % (2 * num_keys);
+    }
+
+    std::cout << "Pool     Batch   ns/key: lookup  lookup_batch   reads: lookup  lookup_batch\n";
+    for (size_t pool_pages : {size_t{100000}, size_t{1000}}) {
+        {
+            BufferManager buffer_manager(true, 100000 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            tree.bulk_load(entries.begin(), entries.end());
+            tree.checkpoint();
+        }
+        for (size_t batch_size : {size_t{16}, size_t{256}, size_t{4096}}) {
+            double elapsed[2];
+            uint64_t reads[2];
+            for (int batched = 0; batched < 2; ++batched) {
+                BufferManager buffer_manager(false, pool_pages * PAGE_SIZE);
+                BTree tree(buffer_manager);
+                volatile uint64_t found = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < num_lookups; i += batch_size) {
+                    std::vector<uint64_t> batch(probes.begin() + i, probes.begin() + std::min(i + batch_size, num_lookups));
+                    if (batched) {
+                        for (const auto& value : tree.lookup_batch(batch)) {
+                            found = found + value.has_value();
+                        }
+                    } else {
+                        for (uint64_t key : batch) {
+                            found = found + tree.lookup(key).has_value();
+                        }
+                    }
+                }
+                elapsed[batched] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                reads[batched] = buffer_manager.getNumPageReads();
+            }
+            std::cout << std::setw(6) << pool_pages << std::setw(8) << batch_size << std::fixed
+                      << std::setprecision(1) << std::setw(16) << elapsed[0] * 1e9 / num_lookups
+                      << std::setw(14) << elapsed[1] * 1e9 / num_lookups
+                      << std::setw(15) << reads[0] << std::setw(14) << reads[1] << "\n";
+        }
+    }
+}
+
+void benchmark_swizzling() {
+    using BTree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE>;
+    constexpr uint64_t num_keys = 4000000;
+    constexpr size_t num_lookups = 2000000;
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t key = 0; key < num_keys; ++key) {
+        entries.emplace_back(key, key);
+    }
+    std::mt19937_64 engine(0);
+    std::vector<uint64_t> probes(num_lookups);
+    for (uint64_t& probe : probes) {
+        probe = engine() % num_keys;
+    }
+
+    BufferManager buffer_manager(true, 100000 * PAGE_SIZE);
+    BTree tree(buffer_manager);
+    tree.bulk_load(entries.begin(), entries.end());
+    std::cout << "Height " << tree.height << ", all nodes cached\n";
+    std::cout << "References    ns/lookup\n";
+    for (bool swizzled : {true, false}) {
+        if (!swizzled) {
+            buffer_manager.disable_swizzling();
+        }
+        volatile uint64_t found = 0;
+        // The first pass swizzles, the second one is timed
+        for (int pass = 0; pass < 2; ++pass) {
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t key : probes) {
+                found = found + tree.lookup(key).has_value();
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (pass == 1) {
+                std::cout << std::setw(10) << (swizzled ? "swizzled" : "page ids") << std::fixed
+                          << std::setprecision(1) << std::setw(13) << elapsed * 1e9 / num_lookups << "\n";
+            }
+        }
+    }
+}
+
+// Inner node searches and cached lookups with the flat and the blocked
+// inner layout. Searches run over a few full nodes, which stay in the CPU
+// cache, and over many, which do not.
+void benchmark_inner_layout() {
+    using FlatTree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE, FlatInnerLayout>;
+    using BlockedTree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE, BlockedInnerLayout>;
+    constexpr size_t num_searches = 4000000;
+    constexpr uint64_t num_keys = 4000000;
+    constexpr size_t num_lookups = 2000000;
+    std::mt19937_64 engine(0);
+    std::vector<uint64_t> probes(num_searches);
+    for (uint64_t& probe : probes) {
+        probe = engine();
+    }
+
+    auto search = [&](auto* tree_type, size_t num_nodes) {
+        using Tree = std::remove_pointer_t<decltype(tree_type)>;
+        using InnerNode = typename Tree::InnerNode;
+        std::unique_ptr<char, decltype(&free)> pages(
+            static_cast<char*>(aligned_alloc(PAGE_SIZE, num_nodes * PAGE_SIZE)), &free);
+        std::mt19937_64 node_engine(1);
+        for (size_t i = 0; i < num_nodes; i++) {
+            InnerNode* inner = new (pages.get() + i * PAGE_SIZE) InnerNode();
+            inner->count = InnerNode::kCapacity;
+            for (uint64_t& key : inner->keys) {
+                key = node_engine();
+            }
+            std::sort(inner->keys, inner->keys + InnerNode::kCapacity - 1);
+            inner->rebuild_directory();
+        }
+        volatile uint64_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_searches; ++i) {
+            // Scatter the nodes so that consecutive searches do not share one
+            size_t node = (i * 7919) % num_nodes;
+            auto inner = reinterpret_cast<const InnerNode*>(pages.get() + node * PAGE_SIZE);
+            checksum = checksum + inner->lower_bound(probes[i]).first;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() * 1e9 / num_searches;
+    };
+
+    std::cout << "Fanout: flat " << FlatTree::InnerNode::kCapacity << ", blocked "
+              << BlockedTree::InnerNode::kCapacity << "\n";
+    std::cout << "Nodes   ns/search: flat   blocked\n";
+    for (size_t num_nodes : {size_t{16}, size_t{512}, size_t{16384}}) {
+        std::cout << std::setw(5) << num_nodes << std::fixed << std::setprecision(2)
+                  << std::setw(18) << search(static_cast<FlatTree*>(nullptr), num_nodes)
+                  << std::setw(10) << search(static_cast<BlockedTree*>(nullptr), num_nodes) << "\n";
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t key = 0; key < num_keys; ++key) {
+        entries.emplace_back(key, key);
+    }
+    auto lookups = [&](auto* tree_type) {
+        using Tree = std::remove_pointer_t<decltype(tree_type)>;
+        BufferManager buffer_manager(true, 100000 * PAGE_SIZE);
+        Tree tree(buffer_manager);
+        tree.bulk_load(entries.begin(), entries.end());
+        volatile uint64_t found = 0;
+        // The first pass swizzles, the second one is timed
+        double elapsed = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < num_lookups; ++i) {
+                found = found + tree.lookup(probes[i] % num_keys).has_value();
+            }
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        return elapsed * 1e9 / num_lookups;
+    };
+    std::cout << "Lookups, " << num_keys << " keys cached   ns/lookup: flat   blocked\n";
+    std::cout << std::setw(40) << std::fixed << std::setprecision(1)
+              << lookups(static_cast<FlatTree*>(nullptr))
+              << std::setw(10) << lookups(static_cast<BlockedTree*>(nullptr)) << "\n";
+}
+
+void benchmark_wal() {
+    using Tree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE>;
+    constexpr uint64_t inserts_per_thread = 4000;
+    const std::pair<CommitMode, const char*> modes[] = {
+        {NO_LOGGING, "no logging"}, {ASYNC_COMMIT, "async commit"}, {SYNC_COMMIT, "sync commit"},
+    };
+
+    std::cout << "Mode           Threads   inserts/s   syncs/commit\n";
+    for (const auto& [mode, name] : modes) {
+        for (int num_threads : {1, 4, 16}) {
+            BufferManager buffer_manager(true, 4096 * PAGE_SIZE, LRU, 0, false, BUFFERED, mode);
+            Tree tree(buffer_manager);
+            uint64_t syncs_before = buffer_manager.getNumLogSyncs();
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (int thread = 0; thread < num_threads; ++thread) {
+                threads.emplace_back([&, thread] {
+                    std::mt19937_64 engine(thread);
+                    for (uint64_t i = 0; i < inserts_per_thread; ++i) {
+                        tree.insert(engine(), i);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            uint64_t num_inserts = inserts_per_thread * num_threads;
+            std::cout << std::left << std::setw(15) << name << std::right << std::setw(7) << num_threads
+                      << std::fixed << std::setprecision(0) << std::setw(12) << num_inserts / elapsed
+                      << std::setprecision(3) << std::setw(15)
+                      << static_cast<double>(buffer_manager.getNumLogSyncs() - syncs_before) / num_inserts << "\n";
+        }
+    }
+}
+
+// Counter increments on a skewed key set, as a lookup followed by an insert
+// and as one upsert, with the tree cached and with a pool a seventh its size.
+// Logging is off, so only the index work is compared.
+void benchmark_upsert() {
+    using Tree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE>;
+    constexpr uint64_t num_keys = 1000000;
+    constexpr size_t num_updates = 2000000;
+    std::mt19937_64 engine(0);
+    std::vector<uint64_t> probes(num_updates);
+    for (uint64_t& probe : probes) {
+        // Squaring a uniform draw skews it towards small keys
+        double draw = std::uniform_real_distribution<double>(0, 1)(engine);
+        probe = static_cast<uint64_t>(draw * draw * num_keys);
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t key = 0; key < num_keys; key += 2) {
+        entries.emplace_back(key, 0);
+    }
+
+    std::cout << "Pool      ns/update: lookup+insert  upsert   reads: lookup+insert  upsert\n";
+    for (size_t pool_pages : {size_t{100000}, size_t{300}}) {
+        double elapsed[2];
+        uint64_t reads[2];
+        for (int upsert = 0; upsert < 2; ++upsert) {
+            BufferManager buffer_manager(true, pool_pages * PAGE_SIZE, LRU, 0, false, BUFFERED, NO_LOGGING);
+            Tree tree(buffer_manager);
+            tree.bulk_load(entries.begin(), entries.end());
+            uint64_t reads_before = buffer_manager.getNumPageReads();
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t key : probes) {
+                if (upsert) {
+                    tree.upsert(key, [](const std::optional<uint64_t>& count) { return count.value_or(0) + 1; });
+                } else {
+                    tree.insert(key, tree.lookup(key).value_or(0) + 1);
+                }
+            }
+            elapsed[upsert] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            reads[upsert] = buffer_manager.getNumPageReads() - reads_before;
+        }
+        std::cout << std::setw(6) << pool_pages << std::fixed << std::setprecision(1)
+                  << std::setw(28) << elapsed[0] * 1e9 / num_updates << std::setw(8) << elapsed[1] * 1e9 / num_updates
+                  << std::setw(23) << reads[0] << std::setw(8) << reads[1] << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool execute_all = false;
+    std::string selected_test = "-1";
+
+    if(argc < 2) {
+        execute_all = true;
+    } else {
+        selected_test = argv[1];
+    }
+
+    using BTree = BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE>;
+
+    // Benchmarks only run when asked for by name
+    if (selected_test == "bench_policies") {
+        benchmark_policies();
+        return 0;
+    }
+    if (selected_test == "bench_buffer_threads") {
+        benchmark_buffer_threads();
+        return 0;
+    }
+    if (selected_test == "bench_storage_modes") {
+        benchmark_storage_modes();
+        return 0;
+    }
+    if (selected_test == "bench_search") {
+        benchmark_search();
+        return 0;
+    }
+    if (selected_test == "bench_batch_lookup") {
+        benchmark_batch_lookup();
+        return 0;
+    }
+    if (selected_test == "bench_swizzling") {
+        benchmark_swizzling();
+        return 0;
+    }
+    if (selected_test == "bench_inner_layout") {
+        benchmark_inner_layout();
+        return 0;
+    }
+    if (selected_test == "bench_wal") {
+        benchmark_wal();
+        return 0;
+    }
+    if (selected_test == "bench_upsert") {
+        benchmark_upsert();
+        return 0;
+    }
+
+    // Test 1: InsertEmptyTree
+    if(execute_all || selected_test == "1") {
+        std::cout<<"...Starting Test 1"<<std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+
+        ASSERT_WITH_MESSAGE(tree.root.has_value() == false, 
+            "tree.root is not nullptr");
+
+        tree.insert(42, 21);
+
+        ASSERT_WITH_MESSAGE(tree.root.has_value(), 
+            "tree.root is still nullptr after insertion");
+        
+        std::string test = "inserting an element into an empty B-Tree";
+
+        // Fix root page and obtain root node pointer
+        SlottedPage* root_page = &buffer_manager.fix_page(*tree.root);
+        auto root_node = reinterpret_cast<BTree::Node*>(root_page->page_data.get());
+
+        ASSERT_WITH_MESSAGE(root_node->is_leaf() == true, 
+            test + " does not create a leaf node.");
+        ASSERT_WITH_MESSAGE(root_node->count == 1,
+            test + " does not create a leaf node with count = 1.");
+
+        std::cout << "\033[1m\033[32mPassed: Test 1\033[0m" << std::endl;
+    }
+
+    // Test 2: InsertLeafNode
+    if(execute_all || selected_test == "2") {
+        std::cout<<"...Starting Test 2"<<std::endl;
+        BufferManager buffer_manager;
+        BTree tree( buffer_manager);
+        
+        ASSERT_WITH_MESSAGE(tree.root.has_value() == false, 
+            "tree.root is not nullptr");
+
+        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
+            tree.insert(i, 2 * i);
+        }
+        ASSERT_WITH_MESSAGE(tree.root.has_value(), 
+            "tree.root is still nullptr after insertion");
+
+        std::string test = "inserting BTree::LeafNode::kCapacity elements into an empty B-Tree";
+
+        SlottedPage* root_page = &buffer_manager.fix_page(*tree.root);
+        auto root_node = reinterpret_cast<BTree::Node*>(root_page->page_data.get());
+        auto root_inner_node = static_cast<BTree::InnerNode*>(root_node);
+
+        ASSERT_WITH_MESSAGE(root_node->is_leaf() == true, 
+            test + " creates an inner node as root.");
+        ASSERT_WITH_MESSAGE(root_inner_node->count == BTree::LeafNode::kCapacity,
+            test + " does not store all elements.");
+
+        std::cout << "\033[1m\033[32mPassed: Test 2\033[0m" << std::endl;
+    }
+
+    // Test 3: InsertLeafNodeSplit
+    if (execute_all || selected_test == "3") {
+        std::cout << "...Starting Test 3" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+
+        ASSERT_WITH_MESSAGE(tree.root.has_value() == false, 
+            "tree.root is not nullptr");
+
+        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
+            tree.insert(i, 2 * i);
+        }
+        ASSERT_WITH_MESSAGE(tree.root.has_value(), 
+            "tree.root is still nullptr after insertion");
+        
+        SlottedPage* root_page = &buffer_manager.fix_page(*tree.root);
+        auto root_node = reinterpret_cast<BTree::Node*>(root_page->page_data.get());
+        auto root_inner_node = static_cast<BTree::InnerNode*>(root_node);
+        
+        assert(root_inner_node->is_leaf());
+        assert(root_inner_node->count == BTree::LeafNode::kCapacity);
+
+        // Let there be a split...
+        tree.insert(424242, 42);
+
+        std::string test =
+            "inserting BTree::LeafNode::kCapacity + 1 elements into an empty B-Tree";
+        
+        ASSERT_WITH_MESSAGE(tree.root.has_value() != false, test + " removes the root :-O");
+
+        SlottedPage* root_page1 = &buffer_manager.fix_page(*tree.root);
+        root_node = reinterpret_cast<BTree::Node*>(root_page1->page_data.get());
+        root_inner_node = static_cast<BTree::InnerNode*>(root_node);
+
+        ASSERT_WITH_MESSAGE(root_inner_node->is_leaf() == false, 
+            test + " does not create a root inner node");
+        ASSERT_WITH_MESSAGE(root_inner_node->count == 2, 
+            test + " creates a new root with count != 2");
+
+        std::cout << "\033[1m\033[32mPassed: Test 3\033[0m" << std::endl;
+    }
+
+    // Test 4: LookupEmptyTree
+    if (execute_all || selected_test == "4") {
+        std::cout << "...Starting Test 4" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+
+        std::string test = "searching for a non-existing element in an empty B-Tree";
+
+        ASSERT_WITH_MESSAGE(tree.lookup(42).has_value() == false, 
+            test + " seems to return something :-O");
+
+        std::cout << "\033[1m\033[32mPassed: Test 4\033[0m" << std::endl;
+    }
+
+    // Test 5: LookupSingleLeaf
+    if (execute_all || selected_test == "5") {
+        std::cout << "...Starting Test 5" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+
+        // Fill one page
+        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
+            tree.insert(i, 2 * i);
+            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(), 
+                "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
+        }
+
+        // Lookup all values
+        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
+            auto v = tree.lookup(i);
+            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+            ASSERT_WITH_MESSAGE(*v == 2 * i, "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 5\033[0m" << std::endl;
+    }
+
+    // Test 6: LookupSingleSplit
+    if (execute_all || selected_test == "6") {
+        std::cout << "...Starting Test 6" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+
+        // Insert values
+        for (auto i = 0ul; i < BTree::LeafNode::kCapacity; ++i) {
+            tree.insert(i, 2 * i);
+        }
+
+        tree.insert(BTree::LeafNode::kCapacity, 2 * BTree::LeafNode::kCapacity);
+        ASSERT_WITH_MESSAGE(tree.lookup(BTree::LeafNode::kCapacity).has_value(),
+            "searching for the just inserted key k=" + std::to_string(BTree::LeafNode::kCapacity + 1) + " yields nothing");
+
+        // Lookup all values
+        for (auto i = 0ul; i < BTree::LeafNode::kCapacity + 1; ++i) {
+            auto v = tree.lookup(i);
+            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+            ASSERT_WITH_MESSAGE(*v == 2 * i, 
+                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 6\033[0m" << std::endl;
+    }
+
+    // Test 7: LookupMultipleSplitsIncreasing
+    if (execute_all || selected_test == "7") {
+        std::cout << "...Starting Test 7" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+        auto n = 40 * BTree::LeafNode::kCapacity;
+
+        // Insert values
+        for (auto i = 0ul; i < n; ++i) {
+            tree.insert(i, 2 * i);
+            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(),
+                "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
+        }
+
+        // Lookup all values
+        for (auto i = 0ul; i < n; ++i) {
+            auto v = tree.lookup(i);
+            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+            ASSERT_WITH_MESSAGE(*v == 2 * i,
+                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+        }
+        std::cout << "\033[1m\033[32mPassed: Test 7\033[0m" << std::endl;
+    }
+
+    // Test 8: LookupMultipleSplitsDecreasing
+    if (execute_all || selected_test == "8") {
+        std::cout << "...Starting Test 8" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+        auto n = 10 * BTree::LeafNode::kCapacity;
+
+        // Insert values
+        for (auto i = n; i > 0; --i) {
+            tree.insert(i, 2 * i);
+            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(),
                 "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
         }
 
-        // Lookup all values
-        for (auto i = n; i > 0; --i) {
-            auto v = tree.lookup(i);
-            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-            ASSERT_WITH_MESSAGE(*v == 2 * i,
-                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+        // Lookup all values
+        for (auto i = n; i > 0; --i) {
+            auto v = tree.lookup(i);
+            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+            ASSERT_WITH_MESSAGE(*v == 2 * i,
+                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 8\033[0m" << std::endl;
+    }
+
+    // Test 9: LookupRandomNonRepeating
+    if (execute_all || selected_test == "9") {
+        std::cout << "...Starting Test 9" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+        auto n = 10 * BTree::LeafNode::kCapacity;
+
+        // Generate random non-repeating key sequence
+        std::vector<uint64_t> keys(n);
+        std::iota(keys.begin(), keys.end(), n);
+        std::mt19937_64 engine(0);
+        std::shuffle(keys.begin(), keys.end(), engine);
+
+        // Insert values
+        for (auto i = 0ul; i < n; ++i) {
+            tree.insert(keys[i], 2 * keys[i]);
+            ASSERT_WITH_MESSAGE(tree.lookup(keys[i]).has_value(),
+                "searching for the just inserted key k=" + std::to_string(keys[i]) +
+                " after i=" + std::to_string(i) + " inserts yields nothing");
+        }
+
+        // Lookup all values
+        for (auto i = 0ul; i < n; ++i) {
+            auto v = tree.lookup(keys[i]);
+            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(keys[i]) + " is missing");
+            ASSERT_WITH_MESSAGE(*v == 2 * keys[i],
+                "key=" + std::to_string(keys[i]) + " should have the value v=" + std::to_string(2 * keys[i]));
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 9\033[0m" << std::endl;
+    }
+
+    // Test 10: LookupRandomRepeating
+    if (execute_all || selected_test == "10") {
+        std::cout << "...Starting Test 10" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+        auto n = 10 * BTree::LeafNode::kCapacity;
+
+        // Insert & updated 100 keys at random
+        std::mt19937_64 engine{0};
+        std::uniform_int_distribution<uint64_t> key_distr(0, 99);
+        std::vector<uint64_t> values(100);
+
+        for (auto i = 1ul; i < n; ++i) {
+            uint64_t rand_key = key_distr(engine);
+            values[rand_key] = i;
+            tree.insert(rand_key, i);
+
+            auto v = tree.lookup(rand_key);
+            ASSERT_WITH_MESSAGE(v.has_value(),
+                "searching for the just inserted key k=" + std::to_string(rand_key) +
+                " after i=" + std::to_string(i - 1) + " inserts yields nothing");
+            ASSERT_WITH_MESSAGE(*v == i,
+                "overwriting k=" + std::to_string(rand_key) + " with value v=" + std::to_string(i) +
+                " failed");
+        }
+
+        // Lookup all values
+        for (auto i = 0ul; i < 100; ++i) {
+            if (values[i] == 0) {
+                continue;
+            }
+            auto v = tree.lookup(i);
+            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+            ASSERT_WITH_MESSAGE(*v == values[i],
+                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(values[i]));
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 10\033[0m" << std::endl;
+    }
+
+    // Test 11: Erase
+    if (execute_all || selected_test == "11") {
+        std::cout << "...Starting Test 11" << std::endl;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+
+        // Insert values
+        for (auto i = 0ul; i < 2 * BTree::LeafNode::kCapacity; ++i) {
+            tree.insert(i, 2 * i);
+        }
+
+        // Iteratively erase all values
+        for (auto i = 0ul; i < 2 * BTree::LeafNode::kCapacity; ++i) {
+            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(), "k=" + std::to_string(i) + " was not in the tree");
+            tree.erase(i);
+            ASSERT_WITH_MESSAGE(!tree.lookup(i), "k=" + std::to_string(i) + " was not removed from the tree");
+        }
+        std::cout << "\033[1m\033[32mPassed: Test 11\033[0m" << std::endl;
+    }
+
+    // Test 12: Persistant Btree
+    if (execute_all || selected_test == "12") {
+        std::cout << "...Starting Test 12" << std::endl;
+        unsigned long n =  10 * BTree::LeafNode::kCapacity;
+
+        // Build a tree
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            
+            // Insert values
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(i, 2 * i);
+                ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(),
+                    "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
+            }
+
+            // Lookup all values
+            for (auto i = 0ul; i < n; ++i) {
+                auto v = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+                ASSERT_WITH_MESSAGE(*v == 2 * i,
+                    "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+            }
+        }
+
+        // recreate the buffer manager and check for existence of the tree
+        {
+            BufferManager buffer_manager(false);
+            BTree tree(buffer_manager);
+
+            // Lookup all values
+            for (auto i = 0ul; i < n; ++i) {
+                auto v = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
+                ASSERT_WITH_MESSAGE(*v == 2 * i,
+                    "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 12\033[0m" << std::endl;
+    }
+
+    // Test 13: BufferPoolFrameReuse
+    if (execute_all || selected_test == "13") {
+        std::cout << "...Starting Test 13" << std::endl;
+        BufferManager buffer_manager;
+
+        SlottedPage* first = &buffer_manager.fix_page(1);
+        std::memcpy(first->page_data.get(), "frame-1", 8);
+        ASSERT_WITH_MESSAGE(&buffer_manager.fix_page(1) == first,
+            "a resident page is not served from the same frame");
+
+        // Cycle enough pages through the pool to evict page 1
+        for (auto page_id = 2ul; page_id < 2 + 4 * MAX_PAGES_IN_MEMORY; ++page_id) {
+            buffer_manager.fix_page(page_id);
+        }
+
+        SlottedPage& reloaded = buffer_manager.fix_page(1);
+        ASSERT_WITH_MESSAGE(std::memcmp(reloaded.page_data.get(), "frame-1", 8) == 0,
+            "page 1 lost its contents across eviction");
+        ASSERT_WITH_MESSAGE(reinterpret_cast<uintptr_t>(reloaded.page_data.get()) % PAGE_SIZE == 0,
+            "frames are not page-aligned");
+
+        std::cout << "\033[1m\033[32mPassed: Test 13\033[0m" << std::endl;
+    }
+
+    // Test 14: PinnedPagesAreNotEvicted
+    if (execute_all || selected_test == "14") {
+        std::cout << "...Starting Test 14" << std::endl;
+        BufferManager buffer_manager;
+
+        std::vector<PageGuard> guards;
+        for (auto page_id = 1ul; page_id < MAX_PAGES_IN_MEMORY; ++page_id) {
+            guards.push_back(buffer_manager.pin_page(page_id, page_id % 2 == 0));
+            *guards.back().as<uint64_t>() = page_id;
+        }
+
+        // Only one frame is left for everything else
+        for (auto page_id = 100ul; page_id < 200; ++page_id) {
+            buffer_manager.fix_page(page_id);
+        }
+        for (auto& guard : guards) {
+            ASSERT_WITH_MESSAGE(*guard.as<uint64_t>() == guard.page_id(),
+                "pinned page " + std::to_string(guard.page_id()) + " was evicted");
+        }
+
+        // With every frame pinned, a miss has nowhere to go
+        guards.push_back(buffer_manager.pin_page(500));
+        bool full = false;
+        try {
+            buffer_manager.pin_page(501);
+        } catch (const buffer_full_error&) {
+            full = true;
+        }
+        ASSERT_WITH_MESSAGE(full, "pinning more pages than frames did not fail");
+
+        guards.clear();
+        buffer_manager.pin_page(501);
+
+        std::cout << "\033[1m\033[32mPassed: Test 14\033[0m" << std::endl;
+    }
+
+    // Test 15: CleanEvictionsAndBackgroundWriter
+    if (execute_all || selected_test == "15") {
+        std::cout << "...Starting Test 15" << std::endl;
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            auto n = 10 * BTree::LeafNode::kCapacity;
+
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(i, 2 * i);
+            }
+            buffer_manager.flush_all();
+
+            // Lookups cycle every page through the pool without writing any back
+            uint64_t writes = buffer_manager.getNumPageWrites();
+            uint64_t reads = buffer_manager.getNumPageReads();
+            for (auto round = 0; round < 3; ++round) {
+                for (auto i = 0ul; i < n; ++i) {
+                    ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(), "key=" + std::to_string(i) + " is missing");
+                }
+            }
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() > reads,
+                "lookups did not cause any page misses");
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageWrites() == writes,
+                "evicting clean pages wrote them back");
+        }
+
+        // A cold dirty page is cleaned without being evicted
+        BufferManager small_pool;
+        uint64_t writes = small_pool.getNumPageWrites();
+        {
+            PageGuard guard = small_pool.pin_page(1, true);
+            *guard.as<uint64_t>() = 4242;
+            guard.mark_dirty();
+        }
+        for (auto page_id = 2ul; page_id < MAX_PAGES_IN_MEMORY; ++page_id) {
+            small_pool.pin_page(page_id);
+        }
+        for (auto waited = 0; waited < 200 && small_pool.getNumPageWrites() == writes; ++waited) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_WITH_MESSAGE(small_pool.getNumPageWrites() == writes + 1,
+            "the background writer did not clean the cold dirty page");
+
+        // Evicting the cleaned page does not write it again
+        for (auto page_id = 100ul; page_id < 100 + MAX_PAGES_IN_MEMORY; ++page_id) {
+            small_pool.pin_page(page_id);
+        }
+        ASSERT_WITH_MESSAGE(small_pool.getNumPageWrites() == writes + 1,
+            "a page cleaned by the background writer was written on eviction");
+        ASSERT_WITH_MESSAGE(*small_pool.pin_page(1).as<uint64_t>() == 4242,
+            "the cleaned page lost its contents");
+
+        std::cout << "\033[1m\033[32mPassed: Test 15\033[0m" << std::endl;
+    }
+
+    // Test 16: ResizeBufferPool
+    if (execute_all || selected_test == "16") {
+        std::cout << "...Starting Test 16" << std::endl;
+        BufferManager buffer_manager(true, 16 * PAGE_SIZE);
+        ASSERT_WITH_MESSAGE(buffer_manager.getPoolSize() == 16 * PAGE_SIZE,
+            "the pool is not sized from the byte budget");
+
+        for (auto page_id = 1ul; page_id <= 16; ++page_id) {
+            PageGuard guard = buffer_manager.pin_page(page_id, true);
+            *guard.as<uint64_t>() = page_id;
+            guard.mark_dirty();
+        }
+
+        // Shrinking fails while a frame that would go away is pinned
+        {
+            PageGuard guard = buffer_manager.pin_page(16);
+            ASSERT_WITH_MESSAGE(!buffer_manager.resize(4 * PAGE_SIZE),
+                "shrinking released a pinned frame");
+            ASSERT_WITH_MESSAGE(buffer_manager.getPoolSize() == 16 * PAGE_SIZE,
+                "a failed shrink changed the pool size");
+        }
+
+        ASSERT_WITH_MESSAGE(buffer_manager.resize(4 * PAGE_SIZE), "shrinking the pool failed");
+        ASSERT_WITH_MESSAGE(buffer_manager.getPoolSize() == 4 * PAGE_SIZE,
+            "the pool did not shrink");
+        std::vector<PageGuard> guards;
+        for (auto page_id = 1ul; page_id <= 4; ++page_id) {
+            guards.push_back(buffer_manager.pin_page(page_id));
+        }
+        bool full = false;
+        try {
+            buffer_manager.pin_page(5);
+        } catch (const buffer_full_error&) {
+            full = true;
+        }
+        ASSERT_WITH_MESSAGE(full, "the shrunk pool still holds more than 4 pages");
+        guards.clear();
+
+        ASSERT_WITH_MESSAGE(buffer_manager.resize(64 * PAGE_SIZE), "growing the pool failed");
+        for (auto page_id = 1ul; page_id <= 40; ++page_id) {
+            guards.push_back(buffer_manager.pin_page(page_id));
+        }
+        for (auto page_id = 1ul; page_id <= 16; ++page_id) {
+            ASSERT_WITH_MESSAGE(*guards[page_id - 1].as<uint64_t>() == page_id,
+                "page " + std::to_string(page_id) + " lost its contents across resizing");
+        }
+        guards.clear();
+
+        // The tree keeps working on top of a resized pool
+        BTree tree(buffer_manager);
+        auto n = 40 * BTree::LeafNode::kCapacity;
+        for (auto i = 0ul; i < n; ++i) {
+            tree.insert(i, 2 * i);
+        }
+        ASSERT_WITH_MESSAGE(buffer_manager.resize(8 * PAGE_SIZE), "shrinking a used pool failed");
+        for (auto i = 0ul; i < n; ++i) {
+            auto v = tree.lookup(i);
+            ASSERT_WITH_MESSAGE(v.has_value() && *v == 2 * i, "key=" + std::to_string(i) + " is missing");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 16\033[0m" << std::endl;
+    }
+
+    // Test 17: ReplacementPolicies
+    if (execute_all || selected_test == "17") {
+        std::cout << "...Starting Test 17" << std::endl;
+        const std::pair<PolicyType, std::string> policies[] = {
+            {LRU, "LRU"}, {CLOCK, "CLOCK"}, {TWO_Q, "2Q"}, {ARC, "ARC"}};
+
+        for (const auto& [policy_type, name] : policies) {
+            BufferManager buffer_manager(true, DEFAULT_POOL_SIZE, policy_type);
+            BTree tree(buffer_manager);
+            auto n = 40 * BTree::LeafNode::kCapacity;
+
+            std::vector<uint64_t> keys(n);
+            std::iota(keys.begin(), keys.end(), 0);
+            std::mt19937_64 engine(0);
+            std::shuffle(keys.begin(), keys.end(), engine);
+            for (auto key : keys) {
+                tree.insert(key, 2 * key);
+            }
+            for (auto i = 0ul; i < n; ++i) {
+                auto v = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(v.has_value() && *v == 2 * i,
+                    name + ": key=" + std::to_string(i) + " is missing");
+            }
+        }
+
+        // A hot set survives a scan under 2Q and ARC. ARC promotes pages hit
+        // while resident, 2Q those that come back after leaving A1in.
+        for (PolicyType policy_type : {TWO_Q, ARC}) {
+            std::vector<PageID> trace;
+            for (auto round = 0; round < 2; ++round) {
+                for (PageID page_id = 1; page_id <= 5; ++page_id) {
+                    trace.push_back(page_id);
+                }
+            }
+            for (PageID page_id = 50; page_id < 70; ++page_id) {
+                trace.push_back(page_id);
+            }
+            for (PageID page_id = 1; page_id <= 5; ++page_id) {
+                trace.push_back(page_id);
+            }
+            for (PageID page_id = 100; page_id < 200; ++page_id) {
+                trace.push_back(page_id);
+            }
+            auto policy = make_policy(policy_type, 20);
+            simulate_policy(*policy, 20, trace);
+
+            // touch() reports whether the page was still resident
+            for (PageID page_id = 1; page_id <= 5; ++page_id) {
+                ASSERT_WITH_MESSAGE(policy->touch(page_id),
+                    std::string(policy_type == TWO_Q ? "2Q" : "ARC") + " let a scan flush hot page " +
+                    std::to_string(page_id));
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 17\033[0m" << std::endl;
+    }
+
+    // Test 18: ConcurrentBufferManager
+    if (execute_all || selected_test == "18") {
+        std::cout << "...Starting Test 18" << std::endl;
+        constexpr PageID num_pages = 900;
+        constexpr size_t num_threads = 8;
+        BufferManager buffer_manager(true, 512 * PAGE_SIZE);
+        ASSERT_WITH_MESSAGE(buffer_manager.getNumShards() > 1, "the pool is not sharded");
+
+        // Threads bump per-page counters under exclusive guards and read
+        // them under shared ones; more pages than frames forces evictions
+        std::vector<std::vector<uint64_t>> increments(num_threads, std::vector<uint64_t>(num_pages + 1));
+        std::atomic<bool> done{false};
+        std::vector<std::thread> threads;
+        for (size_t thread_id = 0; thread_id < num_threads; ++thread_id) {
+            threads.emplace_back([&, thread_id] {
+                std::mt19937_64 engine(thread_id);
+                std::uniform_int_distribution<PageID> page_distr(1, num_pages);
+                for (auto i = 0; i < 20000; ++i) {
+                    PageID page_id = page_distr(engine);
+                    if (i % 2 == 0) {
+                        PageGuard guard = buffer_manager.pin_page(page_id, true);
+                        ++*guard.as<uint64_t>();
+                        guard.mark_dirty();
+                        increments[thread_id][page_id]++;
+                    } else {
+                        PageGuard guard = buffer_manager.pin_page(page_id);
+                        UNUSED(*guard.as<volatile uint64_t>());
+                    }
+                }
+            });
+        }
+        std::thread resizer([&] {
+            for (auto round = 0; !done; ++round) {
+                buffer_manager.resize((round % 2 == 0 ? 384 : 512) * PAGE_SIZE);
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        done = true;
+        resizer.join();
+
+        for (PageID page_id = 1; page_id <= num_pages; ++page_id) {
+            uint64_t expected = 0;
+            for (size_t thread_id = 0; thread_id < num_threads; ++thread_id) {
+                expected += increments[thread_id][page_id];
+            }
+            ASSERT_WITH_MESSAGE(*buffer_manager.pin_page(page_id).as<uint64_t>() == expected,
+                "page " + std::to_string(page_id) + " lost updates");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 18\033[0m" << std::endl;
+    }
+
+    // Test 19: ConcurrentBTree
+    if (execute_all || selected_test == "19") {
+        std::cout << "...Starting Test 19" << std::endl;
+        constexpr uint64_t keys_per_writer = 3000;
+        constexpr size_t num_writers = 4;
+        constexpr size_t num_readers = 2;
+        // Smaller than the tree, so descents also meet evicted nodes
+        BufferManager buffer_manager(true, 256 * PAGE_SIZE);
+        BTree tree(buffer_manager);
+
+        // Writers interleave their keys so they split the same nodes;
+        // readers check that every key a writer has finished is visible
+        std::vector<std::atomic<uint64_t>> inserted(num_writers);
+        std::atomic<bool> done{false};
+        std::atomic<bool> lookups_ok{true};
+        std::vector<std::thread> threads;
+        for (size_t thread_id = 0; thread_id < num_writers; ++thread_id) {
+            threads.emplace_back([&, thread_id] {
+                for (uint64_t i = 0; i < keys_per_writer; ++i) {
+                    uint64_t key = i * num_writers + thread_id;
+                    tree.insert(key, 2 * key);
+                    inserted[thread_id] = i + 1;
+                }
+            });
+        }
+        for (size_t thread_id = 0; thread_id < num_readers; ++thread_id) {
+            threads.emplace_back([&, thread_id] {
+                std::mt19937_64 engine(thread_id);
+                while (!done) {
+                    size_t writer = engine() % num_writers;
+                    uint64_t finished = inserted[writer];
+                    if (finished == 0) {
+                        continue;
+                    }
+                    uint64_t key = (engine() % finished) * num_writers + writer;
+                    auto value = tree.lookup(key);
+                    if (!value || *value != 2 * key) {
+                        lookups_ok = false;
+                    }
+                }
+            });
+        }
+        for (size_t thread_id = 0; thread_id < num_writers; ++thread_id) {
+            threads[thread_id].join();
+        }
+        done = true;
+        for (size_t thread_id = num_writers; thread_id < threads.size(); ++thread_id) {
+            threads[thread_id].join();
+        }
+        ASSERT_WITH_MESSAGE(lookups_ok, "a concurrent lookup missed a finished insert");
+
+        // Erase the odd keys while the even ones are inserted again
+        threads.clear();
+        for (size_t thread_id = 0; thread_id < num_writers; ++thread_id) {
+            threads.emplace_back([&, thread_id] {
+                for (uint64_t key = thread_id; key < keys_per_writer * num_writers; key += num_writers) {
+                    if (key % 2 == 1) {
+                        tree.erase(key);
+                    } else {
+                        tree.insert(key, 3 * key);
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (uint64_t key = 0; key < keys_per_writer * num_writers; ++key) {
+            auto value = tree.lookup(key);
+            if (key % 2 == 1) {
+                ASSERT_WITH_MESSAGE(!value, "key=" + std::to_string(key) + " was not erased");
+            } else {
+                ASSERT_WITH_MESSAGE(value && *value == 3 * key,
+                    "key=" + std::to_string(key) + " has the wrong value");
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 19\033[0m" << std::endl;
+    }
+
+    // Test 20: AsyncIOAndPrefetch
+    if (execute_all || selected_test == "20") {
+        std::cout << "...Starting Test 20" << std::endl;
+        constexpr size_t num_pages = 200;
+
+        // Both backends round-trip a batch larger than the queue depth
+        for (AsyncIOType async_io_type : {IO_URING, THREAD_POOL}) {
+            std::string filename = "buzzdb_async_test.dat";
+            int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            ASSERT_WITH_MESSAGE(fd >= 0, "cannot create the test file");
+            std::vector<char> pages(num_pages * PAGE_SIZE);
+            std::vector<char> read_back(num_pages * PAGE_SIZE);
+            for (size_t i = 0; i < pages.size(); ++i) {
+                pages[i] = static_cast<char>(i / PAGE_SIZE + i % 7);
+            }
+
+            std::atomic<size_t> completed{0};
+            std::atomic<bool> all_ok{true};
+            auto run = [&](bool write, std::vector<char>& buffer) {
+                completed = 0;
+                std::vector<AsyncIO::Request> requests;
+                for (size_t page = 0; page < num_pages; ++page) {
+                    requests.push_back({write, page * PAGE_SIZE, buffer.data() + page * PAGE_SIZE,
+                                        [&](bool ok) { all_ok = all_ok && ok; completed++; }});
+                }
+                {
+                    auto async_io = make_async_io(fd, async_io_type);
+                    async_io->submit(requests);
+                    // The destructor waits for everything in flight
+                }
+                ASSERT_WITH_MESSAGE(completed == num_pages, "not every request completed");
+            };
+            run(true, pages);
+            run(false, read_back);
+            close(fd);
+            std::remove(filename.c_str());
+            ASSERT_WITH_MESSAGE(all_ok, "an asynchronous request failed");
+            ASSERT_WITH_MESSAGE(pages == read_back, "pages read back differ from the ones written");
+        }
+
+        // flush_all writes each dirty page once, as one batch
+        {
+            BufferManager buffer_manager(true, 256 * PAGE_SIZE);
+            for (PageID page_id = 100; page_id < 100 + num_pages; ++page_id) {
+                PageGuard guard = buffer_manager.pin_page(page_id, true);
+                *guard.as<uint64_t>() = page_id * 3;
+                guard.mark_dirty();
+            }
+            buffer_manager.flush_all();
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageWrites() == num_pages,
+                "expected " + std::to_string(num_pages) + " writes, got " +
+                std::to_string(buffer_manager.getNumPageWrites()));
+        }
+
+        // Prefetched pages are cached with their contents once the reads complete
+        {
+            BufferManager buffer_manager(false, 256 * PAGE_SIZE);
+            std::vector<PageID> page_ids;
+            for (PageID page_id = 100; page_id < 100 + num_pages; ++page_id) {
+                page_ids.push_back(page_id);
+            }
+            ASSERT_WITH_MESSAGE(buffer_manager.prefetch(page_ids) == num_pages,
+                "not every page was prefetched");
+            buffer_manager.drain_prefetches();
+            ASSERT_WITH_MESSAGE(buffer_manager.prefetch(page_ids) == 0,
+                "cached pages were prefetched again");
+            for (PageID page_id : page_ids) {
+                ASSERT_WITH_MESSAGE(*buffer_manager.pin_page(page_id).as<uint64_t>() == page_id * 3u,
+                    "page " + std::to_string(page_id) + " has the wrong contents");
+            }
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() == num_pages,
+                "pins of prefetched pages went to disk");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 20\033[0m" << std::endl;
+    }
+
+    // Test 21: PositionalAndDirectIO
+    if (execute_all || selected_test == "21") {
+        std::cout << "...Starting Test 21" << std::endl;
+        constexpr uint16_t pages_per_thread = 50;
+        constexpr uint16_t num_threads = 4;
+
+        // Threads share the file without a global latch; the heap pages
+        // are not aligned, so direct I/O goes through bounce buffers
+        {
+            StorageManager storage_manager(true, true);
+            std::atomic<bool> all_match{true};
+            std::vector<std::thread> threads;
+            for (uint16_t thread_id = 0; thread_id < num_threads; ++thread_id) {
+                threads.emplace_back([&, thread_id] {
+                    for (uint16_t page_id = thread_id * pages_per_thread;
+                         page_id < (thread_id + 1) * pages_per_thread; ++page_id) {
+                        SlottedPage page;
+                        std::memset(page.page_data.get(), page_id % 251, PAGE_SIZE);
+                        storage_manager.flush(page_id, page);
+                        auto loaded = storage_manager.load(page_id);
+                        if (std::memcmp(loaded->page_data.get(), page.page_data.get(), PAGE_SIZE) != 0) {
+                            all_match = false;
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            ASSERT_WITH_MESSAGE(all_match, "a page read back differs from the one written");
+        }
+
+        // Pages written through a small pool survive a reopen with direct I/O
+        constexpr PageID num_pages = 200;
+        {
+            BufferManager buffer_manager(true, 64 * PAGE_SIZE, LRU, 0, true);
+            if (!buffer_manager.usesDirectIO()) {
+                std::cout << "O_DIRECT is not supported here, checking buffered I/O" << std::endl;
+            }
+            for (PageID page_id = 1; page_id <= num_pages; ++page_id) {
+                PageGuard guard = buffer_manager.pin_page(page_id, true);
+                *guard.as<uint64_t>() = page_id * 7;
+                guard.mark_dirty();
+            }
+        }
+        {
+            BufferManager buffer_manager(false, 64 * PAGE_SIZE, LRU, 0, true);
+            for (PageID page_id = 1; page_id <= num_pages; ++page_id) {
+                ASSERT_WITH_MESSAGE(*buffer_manager.pin_page(page_id).as<uint64_t>() == page_id * 7u,
+                    "page " + std::to_string(page_id) + " was not persisted");
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 21\033[0m" << std::endl;
+    }
+
+    // Test 22: MmapStorageMode
+    if (execute_all || selected_test == "22") {
+        std::cout << "...Starting Test 22" << std::endl;
+        constexpr PageID grown_page = MAX_PAGES + 500;
+        {
+            BufferManager buffer_manager(true, DEFAULT_POOL_SIZE, LRU, 0, false, MMAP);
+            buffer_manager.advise(RANDOM_ACCESS);
+            BTree tree(buffer_manager);
+            auto n = 40 * BTree::LeafNode::kCapacity;
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(i, 2 * i);
+            }
+            for (auto i = 0ul; i < n; ++i) {
+                auto value = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(value && *value == 2 * i,
+                    "key=" + std::to_string(i) + " is missing");
+            }
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() == 0,
+                "the mapped tree read pages explicitly");
+
+            // Pages past the end of the file grow it
+            auto& page = buffer_manager.fix_page(grown_page);
+            std::memcpy(page.page_data.get(), "mapped", 7);
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPages() > grown_page,
+                "the file did not grow");
+            buffer_manager.flushPage(grown_page);
+        }
+        {
+            BufferManager buffer_manager(false);
+            PageGuard guard = buffer_manager.pin_page(grown_page);
+            ASSERT_WITH_MESSAGE(std::strcmp(guard.page().page_data.get(), "mapped") == 0,
+                "a page written through the mapping was lost");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 22\033[0m" << std::endl;
+    }
+
+    // Test 23: WidePageIds
+    if (execute_all || selected_test == "23") {
+        std::cout<<"...Starting Test 23"<<std::endl;
+        // Both ids aliased to the same page while PageID was 16 bits wide
+        constexpr PageID low_page = 4464;
+        constexpr PageID high_page = low_page + 65536;
+        constexpr PageID far_page = 1000000;
+        {
+            BufferManager buffer_manager;
+            for (PageID page_id : {low_page, high_page, far_page}) {
+                auto& page = buffer_manager.fix_page(page_id);
+                std::string text = "page " + std::to_string(page_id);
+                std::memcpy(page.page_data.get(), text.c_str(), text.size() + 1);
+            }
+            buffer_manager.flush_all();
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPages() > far_page,
+                "the file did not grow");
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPages() % FILE_EXTENT_PAGES == 0,
+                "the file did not grow in whole extents");
+        }
+        {
+            BufferManager buffer_manager(false);
+            for (PageID page_id : {low_page, high_page, far_page}) {
+                PageGuard guard = buffer_manager.pin_page(page_id);
+                std::string text = "page " + std::to_string(page_id);
+                ASSERT_WITH_MESSAGE(text == guard.page().page_data.get(),
+                    "page " + std::to_string(page_id) + " was lost");
+            }
+            // The gap before the last extent is a hole and reads as zeroes
+            PageGuard guard = buffer_manager.pin_page(far_page - FILE_EXTENT_PAGES);
+            ASSERT_WITH_MESSAGE(guard.page().page_data[0] == 0, "a skipped page is not empty");
+        }
+
+        // A tree keeps working once its page ids pass 65535
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            tree.next_page_id = high_page;
+            auto n = 20 * BTree::LeafNode::kCapacity;
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(i, 2 * i);
+            }
+            ASSERT_WITH_MESSAGE(*tree.root >= high_page, "the tree did not use wide page ids");
+            for (auto i = 0ul; i < n; ++i) {
+                auto value = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(value && *value == 2 * i,
+                    "key=" + std::to_string(i) + " is missing");
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 23\033[0m" << std::endl;
+    }
+
+    // Test 24: LazyFileOpen
+    if (execute_all || selected_test == "24") {
+        std::cout<<"...Starting Test 24"<<std::endl;
+        auto file_size = [] {
+            struct stat file_stat;
+            stat(database_filename.c_str(), &file_stat);
+            return file_stat.st_size;
+        };
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(file_size() == 0, "opening the database wrote to it");
+
+            // Pages that were never written come back zeroed without a read
+            auto& page = buffer_manager.fix_page(7);
+            ASSERT_WITH_MESSAGE(page.page_data[0] == 0 && page.page_data[PAGE_SIZE - 1] == 0,
+                "a new page is not empty");
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() == 0,
+                "a page past the end of the file was read");
+            std::memcpy(page.page_data.get(), "written", 8);
+            buffer_manager.flush_all();
+            ASSERT_WITH_MESSAGE(file_size() == FILE_EXTENT_PAGES * PAGE_SIZE,
+                "the file did not grow by one extent");
+
+            // Far out pages extend the file sparsely on write-back
+            buffer_manager.fix_page(1000000);
+            buffer_manager.flush_all();
+        }
+        {
+            BufferManager buffer_manager(false);
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() <= 1 &&
+                                buffer_manager.getNumPageWrites() == 0,
+                "reopening the database did more I/O than reading the superblock");
+            PageGuard guard = buffer_manager.pin_page(7);
+            ASSERT_WITH_MESSAGE(std::strcmp(guard.page().page_data.get(), "written") == 0,
+                "a written page was lost");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 24\033[0m" << std::endl;
+    }
+
+    // Test 25: Superblock
+    if (execute_all || selected_test == "25") {
+        std::cout<<"...Starting Test 25"<<std::endl;
+        unsigned long n = 40 * BTree::LeafNode::kCapacity;
+        std::optional<PageID> root;
+        uint32_t height;
+        PageID next_page_id;
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(!tree.root.has_value() && tree.height == 0,
+                "a new database opened a tree");
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(i, 2 * i);
+            }
+            ASSERT_WITH_MESSAGE(tree.height >= 2, "the root never split");
+            tree.checkpoint();
+            root = tree.root;
+            height = tree.height;
+            next_page_id = tree.next_page_id;
+        }
+        {
+            BufferManager buffer_manager(false);
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() == 1,
+                "opening the tree read more than the superblock");
+            ASSERT_WITH_MESSAGE(tree.root == root && tree.height == height &&
+                                tree.next_page_id == next_page_id,
+                "the superblock does not match the tree");
+
+            // New pages must not overwrite the reopened tree
+            for (auto i = n; i < 2 * n; ++i) {
+                tree.insert(i, 2 * i);
+            }
+            ASSERT_WITH_MESSAGE(tree.next_page_id > next_page_id, "no pages were allocated");
+        }
+        {
+            BufferManager buffer_manager(false);
+            BTree tree(buffer_manager);
+            for (auto i = 0ul; i < 2 * n; ++i) {
+                auto value = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(value && *value == 2 * i,
+                    "key=" + std::to_string(i) + " is missing");
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 25\033[0m" << std::endl;
+    }
+
+    // Test 26: FreeListReuse
+    if (execute_all || selected_test == "26") {
+        std::cout<<"...Starting Test 26"<<std::endl;
+        unsigned long n = 40 * BTree::LeafNode::kCapacity;
+        std::mt19937_64 engine(0);
+        std::vector<uint64_t> keys(n);
+        std::iota(keys.begin(), keys.end(), 0);
+        PageID high_water = 0;
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            for (int cycle = 0; cycle < 5; cycle++) {
+                std::shuffle(keys.begin(), keys.end(), engine);
+                for (uint64_t key : keys) {
+                    tree.insert(key, key + cycle);
+                }
+                std::shuffle(keys.begin(), keys.end(), engine);
+                for (auto i = 0ul; i < n / 2; ++i) {
+                    tree.erase(keys[i]);
+                }
+                for (auto i = 0ul; i < n; ++i) {
+                    auto value = tree.lookup(keys[i]);
+                    ASSERT_WITH_MESSAGE(i < n / 2 ? !value : value && *value == keys[i] + cycle,
+                        "key=" + std::to_string(keys[i]) + " is wrong after erasing half");
+                }
+                for (auto i = n / 2; i < n; ++i) {
+                    tree.erase(keys[i]);
+                }
+                if (cycle == 1) {
+                    high_water = tree.next_page_id;
+                }
+            }
+            ASSERT_WITH_MESSAGE(tree.free_list.size() > 0, "no page was freed");
+            // Inner nodes are not freed, so the tree's shape drifts a little
+            ASSERT_WITH_MESSAGE(tree.next_page_id <= high_water + high_water / 10,
+                "the tree kept growing: " + std::to_string(high_water) + " pages after two cycles, " +
+                std::to_string(tree.next_page_id) + " after five");
+        }
+        {
+            // The free list survives a reopen
+            BufferManager buffer_manager(false);
+            BTree tree(buffer_manager);
+            uint64_t free_pages = tree.free_list.size();
+            PageID num_pages = tree.next_page_id;
+            ASSERT_WITH_MESSAGE(free_pages > 0, "the free list was lost");
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(i, i);
+            }
+            ASSERT_WITH_MESSAGE(tree.free_list.size() < free_pages, "freed pages were not reused");
+            ASSERT_WITH_MESSAGE(tree.free_list.size() == 0 || tree.next_page_id == num_pages,
+                "new pages were allocated while freed ones were left");
+            for (auto i = 0ul; i < n; ++i) {
+                auto value = tree.lookup(i);
+                ASSERT_WITH_MESSAGE(value && *value == i, "key=" + std::to_string(i) + " is missing");
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 26\033[0m" << std::endl;
+    }
+
+    // Test 27: SearchKernels
+    if (execute_all || selected_test == "27") {
+        std::cout<<"...Starting Test 27"<<std::endl;
+        std::vector<SearchKernel> kernels = {SEARCH_SCALAR};
+        for (SearchKernel kernel : {SEARCH_SSE42, SEARCH_AVX2}) {
+            if (kernel <= best_search_kernel()) {
+                kernels.push_back(kernel);
+            }
+        }
+        auto check = [&](auto sample) {
+            using KeyT = decltype(sample);
+            std::mt19937_64 engine(0);
+            for (uint32_t n = 0; n <= 100; n++) {
+                std::vector<KeyT> keys(n);
+                for (KeyT& key : keys) {
+                    // Few distinct values, so that duplicates and both signs show up
+                    key = static_cast<KeyT>(engine() % 64 * static_cast<uint64_t>(std::numeric_limits<KeyT>::max() / 32));
+                }
+                std::sort(keys.begin(), keys.end());
+                for (int probe = 0; probe < 200; probe++) {
+                    KeyT key = probe % 2 == 0 && n > 0 ? keys[engine() % n] : static_cast<KeyT>(engine());
+                    uint32_t less = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+                    uint32_t not_greater = std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+                    for (SearchKernel kernel : kernels) {
+                        ASSERT_WITH_MESSAGE(
+                            (count_keys_before<false, KeyT, std::less<KeyT>>(keys.data(), n, key, kernel) == less) &&
+                            (count_keys_before<true, KeyT, std::less<KeyT>>(keys.data(), n, key, kernel) == not_greater),
+                            "kernel " + std::to_string(kernel) + " is wrong on " + std::to_string(n) + " keys");
+                    }
+                }
+            }
+        };
+        check(uint64_t());
+        check(int64_t());
+        check(uint32_t());
+
+        // The tree works the same with every kernel
+        for (SearchKernel kernel : kernels) {
+            search_kernel = kernel;
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            auto n = 40 * BTree::LeafNode::kCapacity;
+            for (auto i = 0ul; i < n; ++i) {
+                tree.insert(std::numeric_limits<uint64_t>::max() - 2 * i, i);
+            }
+            for (auto i = 0ul; i < n; ++i) {
+                auto value = tree.lookup(std::numeric_limits<uint64_t>::max() - 2 * i);
+                ASSERT_WITH_MESSAGE(value && *value == i, "key=" + std::to_string(i) + " is missing");
+                ASSERT_WITH_MESSAGE(!tree.lookup(std::numeric_limits<uint64_t>::max() - 2 * i - 1),
+                    "found a key that was never inserted");
+            }
+        }
+        search_kernel = best_search_kernel();
+
+        std::cout << "\033[1m\033[32mPassed: Test 27\033[0m" << std::endl;
+    }
+
+    // Test 28: NodeCapacity
+    if (execute_all || selected_test == "28") {
+        std::cout<<"...Starting Test 28"<<std::endl;
+        using SmallTree = ::BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024>;
+        using NarrowTree = ::BTree<uint32_t, uint32_t, std::less<uint32_t>, PAGE_SIZE>;
+        ASSERT_WITH_MESSAGE(BTree::LeafNode::kCapacity >= 250 && BTree::InnerNode::kCapacity >= 250,
+            "a 4 KB node holds only " + std::to_string(BTree::LeafNode::kCapacity) + " entries");
+        ASSERT_WITH_MESSAGE(SmallTree::LeafNode::kCapacity < BTree::LeafNode::kCapacity / 3,
+            "the capacity does not follow PageSize");
+        ASSERT_WITH_MESSAGE(NarrowTree::LeafNode::kCapacity > BTree::LeafNode::kCapacity * 3 / 2,
+            "the capacity does not follow the key and value sizes");
+        // Nodes use their page well: one more entry would not fit
+        ASSERT_WITH_MESSAGE(
+            sizeof(BTree::LeafNode) + 2 * sizeof(uint64_t) > PAGE_SIZE - alignof(uint64_t) &&
+            sizeof(SmallTree::InnerNode) + sizeof(uint64_t) + sizeof(PageID) > 1024 - alignof(PageID),
+            "nodes leave a whole entry unused");
+
+        // A million keys take three levels
+        {
+            BufferManager buffer_manager(true, 64 * 1024 * 1024);
+            BTree tree(buffer_manager);
+            std::mt19937_64 engine(0);
+            std::vector<uint64_t> keys(1000000);
+            std::iota(keys.begin(), keys.end(), 0);
+            std::shuffle(keys.begin(), keys.end(), engine);
+            for (uint64_t key : keys) {
+                tree.insert(key, key);
+            }
+            ASSERT_WITH_MESSAGE(tree.height == 3, "the tree has " + std::to_string(tree.height) + " levels");
+            for (auto i = 0ul; i < keys.size(); i += 997) {
+                auto value = tree.lookup(keys[i]);
+                ASSERT_WITH_MESSAGE(value && *value == keys[i], "key=" + std::to_string(keys[i]) + " is missing");
+            }
+        }
+
+        // The node format is recorded, and a tree built with another one
+        // refuses to open the file
+        auto opens_as = [](auto* tree_type) {
+            using Tree = std::remove_pointer_t<decltype(tree_type)>;
+            pid_t child = fork();
+            if (child == 0) {
+                BufferManager buffer_manager(false, 64 * PAGE_SIZE);
+                Tree tree(buffer_manager);
+                _exit(0);
+            }
+            int status = 0;
+            waitpid(child, &status, 0);
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        };
+        ASSERT_WITH_MESSAGE(opens_as(static_cast<BTree*>(nullptr)), "the index does not reopen");
+        ASSERT_WITH_MESSAGE(!opens_as(static_cast<SmallTree*>(nullptr)), "a tree with smaller nodes opened the index");
+        ASSERT_WITH_MESSAGE(!opens_as(static_cast<NarrowTree*>(nullptr)), "a tree with narrower keys opened the index");
+
+        std::cout << "\033[1m\033[32mPassed: Test 28\033[0m" << std::endl;
+    }
+
+    // Test 29: RangeScans
+    if (execute_all || selected_test == "29") {
+        std::cout<<"...Starting Test 29"<<std::endl;
+        uint64_t n = 20 * BTree::LeafNode::kCapacity;
+        BufferManager buffer_manager;
+        BTree tree(buffer_manager);
+        ASSERT_WITH_MESSAGE(!tree.seek(0).is_valid() && tree.scan(0, 100).empty(),
+            "an empty tree has entries");
+
+        // Even keys only, inserted out of order
+        std::vector<uint64_t> keys(n);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::mt19937_64 engine(0);
+        std::shuffle(keys.begin(), keys.end(), engine);
+        for (uint64_t key : keys) {
+            tree.insert(2 * key, key);
+        }
+
+        auto check_range = [&](uint64_t lo, uint64_t hi) {
+            auto entries = tree.scan(lo, hi);
+            uint64_t expected = (lo + 1) / 2;
+            for (const auto& [key, value] : entries) {
+                ASSERT_WITH_MESSAGE(key == 2 * expected && value == expected,
+                    "scan(" + std::to_string(lo) + ", " + std::to_string(hi) + ") returned key " +
+                    std::to_string(key) + " instead of " + std::to_string(2 * expected));
+                expected++;
+            }
+            uint64_t end = std::min(hi / 2 + 1, n);
+            ASSERT_WITH_MESSAGE(expected == std::max(end, (lo + 1) / 2),
+                "scan(" + std::to_string(lo) + ", " + std::to_string(hi) + ") stopped early");
+        };
+        check_range(0, 2 * n);
+        check_range(1, 1);
+        check_range(2 * n, 3 * n);
+        for (int i = 0; i < 100; i++) {
+            uint64_t lo = engine() % (2 * n);
+            check_range(lo, lo + engine() % (6 * BTree::LeafNode::kCapacity));
+        }
+
+        // Backwards from the end, across every leaf
+        uint64_t expected = n;
+        for (auto iterator = tree.seek_back(2 * n); iterator.is_valid(); iterator.prev()) {
+            expected--;
+            ASSERT_WITH_MESSAGE(iterator.key() == 2 * expected, "a backward scan skipped a key");
+        }
+        ASSERT_WITH_MESSAGE(expected == 0, "a backward scan stopped early");
+        ASSERT_WITH_MESSAGE(tree.seek_back(7).key() == 6 && tree.seek_back(6, false).key() == 4,
+            "seek_back found the wrong entry");
+
+        // Links stay intact when emptied leaves are removed
+        for (uint64_t key = 0; key < n; key++) {
+            if (key % (3 * BTree::LeafNode::kCapacity) >= BTree::LeafNode::kCapacity) {
+                tree.erase(2 * key);
+            }
+        }
+        std::vector<uint64_t> remaining;
+        for (auto iterator = tree.seek(0); iterator.is_valid(); iterator.next()) {
+            remaining.push_back(iterator.key() / 2);
+        }
+        std::vector<uint64_t> backward;
+        for (auto iterator = tree.seek_back(2 * n); iterator.is_valid(); iterator.prev()) {
+            backward.push_back(iterator.key() / 2);
+        }
+        std::reverse(backward.begin(), backward.end());
+        ASSERT_WITH_MESSAGE(remaining == backward, "forward and backward scans disagree");
+        expected = 0;
+        for (uint64_t key : remaining) {
+            while (expected % (3 * BTree::LeafNode::kCapacity) >= BTree::LeafNode::kCapacity) {
+                expected++;
+            }
+            ASSERT_WITH_MESSAGE(key == expected, "a scan after erasing returned key " + std::to_string(key));
+            expected++;
+        }
+        ASSERT_WITH_MESSAGE(tree.free_list.size() > 0, "no emptied leaf was unlinked");
+
+        std::cout << "\033[1m\033[32mPassed: Test 29\033[0m" << std::endl;
+    }
+
+    // Test 30: BulkLoad
+    if (execute_all || selected_test == "30") {
+        std::cout<<"...Starting Test 30"<<std::endl;
+        constexpr uint64_t n = 300000;
+        constexpr double fill_factor = 0.75;
+        const uint32_t leaf_fill = static_cast<uint32_t>(BTree::LeafNode::kCapacity * fill_factor);
+        std::vector<std::pair<uint64_t, uint64_t>> entries;
+        for (uint64_t i = 0; i < n; i++) {
+            entries.emplace_back(3 * i, i);
+        }
+
+        {
+            // Far fewer frames than pages
+            BufferManager buffer_manager(true, 64 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            uint64_t reads = buffer_manager.getNumPageReads();
+            uint64_t writes = buffer_manager.getNumPageWrites();
+            tree.bulk_load(entries.begin(), entries.end(), fill_factor);
+
+            // Every node was written once, and nothing was read back
+            uint64_t num_nodes = tree.next_page_id - 1;
+            uint64_t num_writes = buffer_manager.getNumPageWrites() - writes;
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() == reads,
+                "the bulk load read " + std::to_string(buffer_manager.getNumPageReads() - reads) + " pages");
+            ASSERT_WITH_MESSAGE(num_writes >= num_nodes && num_writes <= num_nodes + 1,
+                std::to_string(num_writes) + " writes for " + std::to_string(num_nodes) + " nodes");
+
+            // The leaves are filled as asked, and chained in key order
+            PageID page_id = *tree.root;
+            for (uint32_t level = 1; level < tree.height; level++) {
+                page_id = buffer_manager.pin_page(page_id).as<BTree::InnerNode>()->children[0];
+            }
+            uint64_t num_leaves = 0;
+            uint64_t num_entries = 0;
+            PageID prev_id = INVALID_PAGE;
+            while (page_id != INVALID_PAGE) {
+                PageGuard guard = buffer_manager.pin_page(page_id);
+                auto leaf = guard.as<BTree::LeafNode>();
+                ASSERT_WITH_MESSAGE(leaf->prev == prev_id, "a leaf does not link back");
+                ASSERT_WITH_MESSAGE(leaf->count == leaf_fill || leaf->next == INVALID_PAGE,
+                    "a leaf holds " + std::to_string(leaf->count) + " entries instead of " + std::to_string(leaf_fill));
+                num_leaves++;
+                num_entries += leaf->count;
+                prev_id = page_id;
+                page_id = leaf->next;
+            }
+            ASSERT_WITH_MESSAGE(num_entries == n && num_leaves == (n + leaf_fill - 1) / leaf_fill,
+                std::to_string(num_entries) + " entries in " + std::to_string(num_leaves) + " leaves");
+
+            for (uint64_t i = 0; i < n; i += 97) {
+                auto value = tree.lookup(3 * i);
+                ASSERT_WITH_MESSAGE(value && *value == i, "key=" + std::to_string(3 * i) + " is missing");
+                ASSERT_WITH_MESSAGE(!tree.lookup(3 * i + 1), "key=" + std::to_string(3 * i + 1) + " was found");
+            }
+            auto range = tree.scan(3 * 1000, 3 * 3000);
+            ASSERT_WITH_MESSAGE(range.size() == 2001 && range.front().second == 1000 && range.back().second == 3000,
+                "a scan over the loaded tree returned " + std::to_string(range.size()) + " entries");
+
+            // The tree takes inserts afterwards, and survives a reopen
+            for (uint64_t i = 0; i < n; i += 101) {
+                tree.insert(3 * i + 1, i);
+            }
+            tree.checkpoint();
+        }
+        {
+            BufferManager buffer_manager(false, 64 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            for (uint64_t i = 0; i < n; i += 101) {
+                auto value = tree.lookup(3 * i);
+                auto inserted = tree.lookup(3 * i + 1);
+                ASSERT_WITH_MESSAGE(value && *value == i && inserted && *inserted == i,
+                    "key=" + std::to_string(3 * i) + " is missing after reopening");
+            }
+        }
+
+        // A repeated key keeps its last value
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            std::vector<std::pair<uint64_t, uint64_t>> repeated = {{1, 1}, {1, 2}, {2, 3}};
+            tree.bulk_load(repeated.begin(), repeated.end());
+            ASSERT_WITH_MESSAGE(tree.lookup(1) == 2u && tree.lookup(2) == 3u && tree.height == 1,
+                "a repeated key did not keep its last value");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 30\033[0m" << std::endl;
+    }
+
+    // Test 31: BatchedLookups
+    if (execute_all || selected_test == "31") {
+        std::cout<<"...Starting Test 31"<<std::endl;
+        constexpr uint64_t n = 100000;
+        std::mt19937_64 engine(0);
+        auto check_batch = [](BTree& tree, const std::vector<uint64_t>& batch) {
+            auto values = tree.lookup_batch(batch);
+            ASSERT_WITH_MESSAGE(values.size() == batch.size(), "lookup_batch returned the wrong number of values");
+            for (size_t i = 0; i < batch.size(); i++) {
+                ASSERT_WITH_MESSAGE(values[i] == tree.lookup(batch[i]),
+                    "lookup_batch disagrees with lookup on key=" + std::to_string(batch[i]));
+            }
+        };
+
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(tree.lookup_batch({}).empty(), "an empty batch returned values");
+            auto values = tree.lookup_batch({1, 2, 3});
+            ASSERT_WITH_MESSAGE(values.size() == 3 && !values[0] && !values[1] && !values[2],
+                "an empty tree returned values");
+
+            // Odd keys only, so that half of the probes miss
+            std::vector<uint64_t> keys(n);
+            std::iota(keys.begin(), keys.end(), 0);
+            std::shuffle(keys.begin(), keys.end(), engine);
+            for (uint64_t key : keys) {
+                tree.insert(2 * key + 1, key);
+            }
+            for (size_t batch_size : {1, 7, 300, 5000}) {
+                std::vector<uint64_t> batch(batch_size);
+                for (uint64_t& key : batch) {
+                    key = engine() % (2 * n + 10);
+                }
+                // Repeated keys too
+                batch.push_back(batch.front());
+                check_batch(tree, batch);
+            }
+            tree.checkpoint();
+        }
+
+        // A batch reads each node once even from a pool that holds few of them
+        {
+            // Three neighbouring keys in each of 100 distant leaves
+            std::vector<uint64_t> batch;
+            for (uint64_t leaf = 0; leaf < 100; leaf++) {
+                for (uint64_t key = 0; key < 3; key++) {
+                    batch.push_back(2 * (leaf * (n / 100) + key) + 1);
+                }
+            }
+            std::shuffle(batch.begin(), batch.end(), engine);
+            std::vector<std::optional<uint64_t>> expected;
+            uint64_t single_reads;
+            {
+                BufferManager buffer_manager(false, 16 * PAGE_SIZE);
+                BTree tree(buffer_manager);
+                for (uint64_t key : batch) {
+                    expected.push_back(tree.lookup(key));
+                }
+                single_reads = buffer_manager.getNumPageReads();
+            }
+            BufferManager buffer_manager(false, 16 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(tree.lookup_batch(batch) == expected, "lookup_batch disagrees with lookup");
+            ASSERT_WITH_MESSAGE(2 * buffer_manager.getNumPageReads() < single_reads,
+                std::to_string(buffer_manager.getNumPageReads()) + " reads for a batch, " +
+                std::to_string(single_reads) + " for single lookups");
         }
 
-        std::cout << "\033[1m\033[32mPassed: Test 8\033[0m" << std::endl;
+        // Batches stay correct while another thread splits nodes
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            for (uint64_t key = 0; key < n; key++) {
+                tree.insert(2 * key + 1, key);
+            }
+            std::thread writer([&] {
+                for (uint64_t key = 0; key < n; key++) {
+                    tree.insert(2 * key, key);
+                }
+            });
+            for (int round = 0; round < 200; round++) {
+                std::vector<uint64_t> batch(500);
+                for (uint64_t& key : batch) {
+                    key = 2 * (engine() % n) + 1;
+                }
+                auto values = tree.lookup_batch(batch);
+                for (size_t i = 0; i < batch.size(); i++) {
+                    ASSERT_WITH_MESSAGE(values[i] && *values[i] == batch[i] / 2,
+                        "key=" + std::to_string(batch[i]) + " was lost during concurrent inserts");
+                }
+            }
+            writer.join();
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 31\033[0m" << std::endl;
     }
 
-    // Test 9: LookupRandomNonRepeating
-    if (execute_all || selected_test == "9") {
-        std::cout << "...Starting Test 9" << std::endl;
+    // Test 32: MergeOnErase
+    if (execute_all || selected_test == "32") {
+        std::cout<<"...Starting Test 32"<<std::endl;
+        constexpr uint64_t n = 200000;
         BufferManager buffer_manager;
         BTree tree(buffer_manager);
-        auto n = 10 * BTree::LeafNode::kCapacity;
 
-        // Generate random non-repeating key sequence
+        // Walk the tree, checking key order against the separators, and
+        // count its nodes and the underfull ones below the root
+        struct Shape { uint64_t nodes = 0; uint64_t leaves = 0; uint64_t underfull = 0; uint64_t entries = 0; };
+        std::function<void(PageID, bool, uint64_t, uint64_t, Shape&)> walk =
+            [&](PageID page_id, bool is_root, uint64_t lo, uint64_t hi, Shape& shape) {
+            PageGuard guard = buffer_manager.pin_page(page_id);
+            auto node = guard.as<BTree::Node>();
+            shape.nodes++;
+            if (!is_root && BTree::is_underfull(node)) {
+                shape.underfull++;
+            }
+            if (node->is_leaf()) {
+                auto leaf = guard.as<BTree::LeafNode>();
+                shape.leaves++;
+                shape.entries += leaf->count;
+                for (uint32_t i = 0; i < leaf->count; i++) {
+                    ASSERT_WITH_MESSAGE(leaf->keys[i] >= lo && leaf->keys[i] < hi && (i == 0 || leaf->keys[i - 1] < leaf->keys[i]),
+                        "key=" + std::to_string(leaf->keys[i]) + " is out of place");
+                }
+                return;
+            }
+            auto inner = guard.as<BTree::InnerNode>();
+            for (uint32_t i = 0; i < inner->count; i++) {
+                walk(buffer_manager.page_id_of(inner->children[i]), false, i == 0 ? lo : inner->keys[i - 1],
+                     i + 1 == inner->count ? hi : inner->keys[i], shape);
+            }
+        };
+        auto shape = [&]() {
+            Shape result;
+            walk(*tree.root, true, 0, UINT64_MAX, result);
+            return result;
+        };
+
         std::vector<uint64_t> keys(n);
-        std::iota(keys.begin(), keys.end(), n);
+        std::iota(keys.begin(), keys.end(), 0);
         std::mt19937_64 engine(0);
         std::shuffle(keys.begin(), keys.end(), engine);
+        for (uint64_t key : keys) {
+            tree.insert(key, key);
+        }
+        Shape full = shape();
+        uint32_t full_height = tree.height;
 
-        // Insert values
-        for (auto i = 0ul; i < n; ++i) {
-            tree.insert(keys[i], 2 * keys[i]);
-            ASSERT_WITH_MESSAGE(tree.lookup(keys[i]).has_value(),
-                "searching for the just inserted key k=" + std::to_string(keys[i]) +
-                " after i=" + std::to_string(i) + " inserts yields nothing");
+        // Erase 95% in random order; the nodes shrink along with the entries
+        std::shuffle(keys.begin(), keys.end(), engine);
+        std::vector<uint64_t> kept(keys.begin() + n * 95 / 100, keys.end());
+        for (size_t i = 0; i < n * 95 / 100; i++) {
+            tree.erase(keys[i]);
         }
+        Shape sparse = shape();
+        ASSERT_WITH_MESSAGE(sparse.entries == kept.size(), "entries were lost or kept by erase");
+        ASSERT_WITH_MESSAGE(sparse.underfull == 0,
+            std::to_string(sparse.underfull) + " nodes are underfull after erasing");
+        ASSERT_WITH_MESSAGE(sparse.nodes * 5 < full.nodes,
+            std::to_string(sparse.nodes) + " nodes left of " + std::to_string(full.nodes));
+        ASSERT_WITH_MESSAGE(sparse.nodes + tree.free_list.size() + 1 == tree.next_page_id,
+            "pages of merged nodes were not freed");
+        std::sort(kept.begin(), kept.end());
+        auto entries = tree.scan(0, n);
+        ASSERT_WITH_MESSAGE(entries.size() == kept.size(), "a scan after merging returned " + std::to_string(entries.size()) + " entries");
+        for (size_t i = 0; i < kept.size(); i++) {
+            ASSERT_WITH_MESSAGE(entries[i].first == kept[i], "a scan after merging skipped key=" + std::to_string(kept[i]));
+        }
+        uint64_t backward = 0;
+        for (auto iterator = tree.seek_back(n); iterator.is_valid(); iterator.prev()) {
+            backward++;
+        }
+        ASSERT_WITH_MESSAGE(backward == kept.size(), "the leaf chain is broken backwards");
 
-        // Lookup all values
-        for (auto i = 0ul; i < n; ++i) {
-            auto v = tree.lookup(keys[i]);
-            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(keys[i]) + " is missing");
-            ASSERT_WITH_MESSAGE(*v == 2 * keys[i],
-                "key=" + std::to_string(keys[i]) + " should have the value v=" + std::to_string(2 * keys[i]));
+        // Erasing everything leaves a single leaf as root, and inserts work again
+        for (uint64_t key : kept) {
+            tree.erase(key);
         }
+        ASSERT_WITH_MESSAGE(tree.height == 1 && shape().nodes == 1,
+            "the emptied tree still has " + std::to_string(tree.height) + " levels (" + std::to_string(full_height) + " before)");
+        for (uint64_t key = 0; key < 1000; key++) {
+            tree.insert(key, key);
+        }
+        ASSERT_WITH_MESSAGE(shape().entries == 1000 && tree.lookup(999) == 999u, "inserts after emptying the tree failed");
 
-        std::cout << "\033[1m\033[32mPassed: Test 9\033[0m" << std::endl;
+        // Concurrent erasers, with readers of keys no one erases
+        {
+            for (uint64_t key = 0; key < n; key++) {
+                tree.insert(key, key);
+            }
+            std::atomic<bool> failed{false};
+            std::vector<std::thread> threads;
+            for (uint64_t t = 0; t < 4; t++) {
+                threads.emplace_back([&, t] {
+                    for (uint64_t key = t; key < n; key += 4) {
+                        if (key % 64 != 0) {
+                            tree.erase(key);
+                        }
+                    }
+                });
+            }
+            threads.emplace_back([&] {
+                std::mt19937_64 reader_engine(1);
+                for (int i = 0; i < 200000; i++) {
+                    uint64_t key = reader_engine() % (n / 64) * 64;
+                    if (tree.lookup(key) != key) {
+                        failed = true;
+                    }
+                }
+            });
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            ASSERT_WITH_MESSAGE(!failed, "a lookup missed a key during concurrent merges");
+            Shape after = shape();
+            ASSERT_WITH_MESSAGE(after.entries == n / 64 && after.underfull == 0,
+                std::to_string(after.entries) + " entries and " + std::to_string(after.underfull) +
+                " underfull nodes after concurrent erases");
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 32\033[0m" << std::endl;
     }
 
-    // Test 10: LookupRandomRepeating
-    if (execute_all || selected_test == "10") {
-        std::cout << "...Starting Test 10" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
-        auto n = 10 * BTree::LeafNode::kCapacity;
+    // Test 33: AscendingAppends
+    if (execute_all || selected_test == "33") {
+        std::cout<<"...Starting Test 33"<<std::endl;
+        const uint64_t capacity = BTree::LeafNode::kCapacity;
+        const uint64_t n = 40 * capacity;
+
+        // The number of leaves, following the chain from the leftmost one
+        auto count_leaves = [](BufferManager& buffer_manager, BTree& tree) {
+            PageID page_id = *tree.root;
+            for (uint32_t level = 1; level < tree.height; level++) {
+                page_id = buffer_manager.page_id_of(
+                    buffer_manager.pin_page(page_id).as<BTree::InnerNode>()->children[0]);
+            }
+            uint64_t num_leaves = 0;
+            for (; page_id != INVALID_PAGE; num_leaves++) {
+                page_id = buffer_manager.pin_page(page_id).as<BTree::LeafNode>()->next;
+            }
+            return num_leaves;
+        };
 
-        // Insert & updated 100 keys at random
-        std::mt19937_64 engine{0};
-        std::uniform_int_distribution<uint64_t> key_distr(0, 99);
-        std::vector<uint64_t> values(100);
+        // Ascending keys fill every leaf but the last
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            for (uint64_t key = 0; key < n; key++) {
+                tree.insert(key, 2 * key);
+            }
+            uint64_t num_leaves = count_leaves(buffer_manager, tree);
+            ASSERT_WITH_MESSAGE(num_leaves == (n + capacity - 1) / capacity,
+                std::to_string(n) + " ascending keys take " + std::to_string(num_leaves) + " leaves");
+            for (uint64_t key = 0; key < n; key++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == 2 * key, "key=" + std::to_string(key) + " is missing");
+            }
 
-        for (auto i = 1ul; i < n; ++i) {
-            uint64_t rand_key = key_distr(engine);
-            values[rand_key] = i;
-            tree.insert(rand_key, i);
+            // Keys that do not belong to the last leaf still find their place
+            tree.insert(n / 2, 7);
+            tree.insert(n - 2, 7);
+            ASSERT_WITH_MESSAGE(tree.lookup(n / 2) == 7u && tree.lookup(n - 2) == 7u, "an overwrite was lost");
 
-            auto v = tree.lookup(rand_key);
-            ASSERT_WITH_MESSAGE(v.has_value(),
-                "searching for the just inserted key k=" + std::to_string(rand_key) +
-                " after i=" + std::to_string(i - 1) + " inserts yields nothing");
-            ASSERT_WITH_MESSAGE(*v == i,
-                "overwriting k=" + std::to_string(rand_key) + " with value v=" + std::to_string(i) +
-                " failed");
+            // Appending goes on after the last leaf was merged away
+            for (uint64_t key = n - capacity; key < n; key++) {
+                tree.erase(key);
+            }
+            for (uint64_t key = n; key < n + capacity; key++) {
+                tree.insert(key, 2 * key);
+            }
+            auto entries = tree.scan(n - 2 * capacity, 2 * n);
+            ASSERT_WITH_MESSAGE(entries.size() == 2 * capacity && entries.back().first == n + capacity - 1,
+                "appending after erasing the last leaf failed");
         }
 
-        // Lookup all values
-        for (auto i = 0ul; i < 100; ++i) {
-            if (values[i] == 0) {
-                continue;
+        // Of two interleaved ascending runs, only the one at the right edge
+        // fills its leaves; leaves in the interior run split in the middle,
+        // so the next insert into them does not split them again
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            for (uint64_t key = 0; key < n / 2; key++) {
+                tree.insert(key, key);
+                tree.insert(n + key, key);
+            }
+            PageID page_id = *tree.root;
+            for (uint32_t level = 1; level < tree.height; level++) {
+                page_id = buffer_manager.page_id_of(
+                    buffer_manager.pin_page(page_id).as<BTree::InnerNode>()->children[0]);
+            }
+            std::vector<std::pair<uint64_t, uint32_t>> leaves;
+            while (page_id != INVALID_PAGE) {
+                PageGuard guard = buffer_manager.pin_page(page_id);
+                auto leaf = guard.as<BTree::LeafNode>();
+                leaves.emplace_back(leaf->keys[0], leaf->count);
+                page_id = leaf->next;
+            }
+            for (size_t i = 0; i + 1 < leaves.size(); i++) {
+                bool interior = leaves[i + 1].first < n;
+                if (interior) {
+                    ASSERT_WITH_MESSAGE(leaves[i].second < capacity,
+                        "the interior leaf from key=" + std::to_string(leaves[i].first) + " was left full");
+                } else if (leaves[i].first >= n) {
+                    ASSERT_WITH_MESSAGE(leaves[i].second == capacity,
+                        "the right edge leaf from key=" + std::to_string(leaves[i].first) + " is not full");
+                }
             }
-            auto v = tree.lookup(i);
-            ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-            ASSERT_WITH_MESSAGE(*v == values[i],
-                "key=" + std::to_string(i) + " should have the value v=" + std::to_string(values[i]));
         }
 
-        std::cout << "\033[1m\033[32mPassed: Test 10\033[0m" << std::endl;
+        // Concurrent appenders
+        {
+            BufferManager buffer_manager;
+            BTree tree(buffer_manager);
+            std::vector<std::thread> threads;
+            for (uint64_t t = 0; t < 4; t++) {
+                threads.emplace_back([&, t] {
+                    for (uint64_t i = 0; i < n; i++) {
+                        tree.insert(4 * i + t, i);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            auto entries = tree.scan(0, 4 * n);
+            ASSERT_WITH_MESSAGE(entries.size() == 4 * n, "concurrent appends lost " +
+                std::to_string(4 * n - entries.size()) + " keys");
+            for (uint64_t i = 0; i < entries.size(); i++) {
+                ASSERT_WITH_MESSAGE(entries[i].first == i && entries[i].second == i / 4,
+                    "concurrent appends misplaced key=" + std::to_string(i));
+            }
+        }
+
+        std::cout << "\033[1m\033[32mPassed: Test 33\033[0m" << std::endl;
     }
 
-    // Test 11: Erase
-    if (execute_all || selected_test == "11") {
-        std::cout << "...Starting Test 11" << std::endl;
-        BufferManager buffer_manager;
-        BTree tree(buffer_manager);
+    // Test 34: Swizzling
+    if (execute_all || selected_test == "34") {
+        std::cout<<"...Starting Test 34"<<std::endl;
+        constexpr uint64_t n = 300000;
+        std::vector<uint64_t> keys(n);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::mt19937_64 engine(0);
+        std::shuffle(keys.begin(), keys.end(), engine);
 
-        // Insert values
-        for (auto i = 0ul; i < 2 * BTree::LeafNode::kCapacity; ++i) {
-            tree.insert(i, 2 * i);
+        PageID root;
+        std::vector<PageID> root_children;
+        {
+            BufferManager buffer_manager(true, 4096 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            for (uint64_t key : keys) {
+                tree.insert(key, 2 * key);
+            }
+            for (uint64_t key : keys) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == 2 * key, "key=" + std::to_string(key) + " is missing");
+            }
+            ASSERT_WITH_MESSAGE(tree.height >= 3, "the tree is too low to swizzle inner nodes");
+
+            // The descents swizzled the inner children of the root
+            root = *tree.root;
+            {
+                PageGuard guard = buffer_manager.pin_page(root);
+                auto inner = guard.as<BTree::InnerNode>();
+                for (uint32_t i = 0; i < inner->count; i++) {
+                    ASSERT_WITH_MESSAGE(is_swizzled(inner->children[i]),
+                        "child " + std::to_string(i) + " of the root is not swizzled");
+                    PageID page_id = buffer_manager.page_id_of(inner->children[i]);
+                    ASSERT_WITH_MESSAGE(buffer_manager.pin_page(page_id).as<BTree::Node>()->level + 1 == inner->level,
+                        "a swizzled reference leads to the wrong page");
+                    root_children.push_back(page_id);
+                }
+            }
+
+            // Only page ids are written
+            tree.checkpoint();
+            BufferManager reader(false);
+            PageGuard guard = reader.pin_page(root);
+            auto inner = guard.as<BTree::InnerNode>();
+            ASSERT_WITH_MESSAGE(inner->count == root_children.size(), "the root on disk is stale");
+            for (uint32_t i = 0; i < inner->count; i++) {
+                ASSERT_WITH_MESSAGE(inner->children[i] == root_children[i],
+                    "child " + std::to_string(i) + " of the root was written swizzled");
+            }
         }
 
-        // Iteratively erase all values
-        for (auto i = 0ul; i < 2 * BTree::LeafNode::kCapacity; ++i) {
-            ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(), "k=" + std::to_string(i) + " was not in the tree");
-            tree.erase(i);
-            ASSERT_WITH_MESSAGE(!tree.lookup(i), "k=" + std::to_string(i) + " was not removed from the tree");
+        // A small pool evicts swizzled nodes, with concurrent writers
+        {
+            BufferManager buffer_manager(false, 64 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            std::atomic<bool> failed{false};
+            std::vector<std::thread> threads;
+            for (uint64_t t = 0; t < 4; t++) {
+                threads.emplace_back([&, t] {
+                    for (uint64_t key = n + t; key < 2 * n; key += 4) {
+                        tree.insert(key, 2 * key);
+                    }
+                });
+            }
+            for (uint64_t t = 0; t < 2; t++) {
+                threads.emplace_back([&, t] {
+                    std::mt19937_64 reader_engine(t);
+                    for (int i = 0; i < 100000; i++) {
+                        uint64_t key = reader_engine() % n;
+                        if (tree.lookup(key) != 2 * key) {
+                            failed = true;
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            ASSERT_WITH_MESSAGE(!failed, "a lookup through swizzled references failed");
+            ASSERT_WITH_MESSAGE(buffer_manager.getNumPageReads() > tree.next_page_id,
+                "the small pool did not evict");
         }
-        std::cout << "\033[1m\033[32mPassed: Test 11\033[0m" << std::endl;
+
+        // Everything is found again after reopening
+        {
+            BufferManager buffer_manager(false, 4096 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            for (uint64_t key = 0; key < 2 * n; key++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == 2 * key,
+                    "key=" + std::to_string(key) + " is missing after reopening");
+            }
+        }
+        std::cout << "\033[1m\033[32mPassed: Test 34\033[0m" << std::endl;
     }
 
-    // Test 12: Persistant Btree
-    if (execute_all || selected_test == "12") {
-        std::cout << "...Starting Test 12" << std::endl;
-        unsigned long n =  10 * BTree::LeafNode::kCapacity;
+    // Test 35: BlockedInnerLayout
+    if (execute_all || selected_test == "35") {
+        std::cout<<"...Starting Test 35"<<std::endl;
+        using BlockedTree = ::BTree<uint64_t, uint64_t, std::less<uint64_t>, PAGE_SIZE, BlockedInnerLayout>;
+        using InnerNode = BlockedTree::InnerNode;
+        static_assert(sizeof(InnerNode) <= PAGE_SIZE, "a blocked node does not fit in a page");
+        ASSERT_WITH_MESSAGE(InnerNode::kCapacity >= BTree::InnerNode::kCapacity * 9 / 10,
+            "the directory takes " + std::to_string(BTree::InnerNode::kCapacity - InnerNode::kCapacity) + " children");
 
-        // Build a tree
+        // The directory finds the same child as a binary search, at every fill
         {
-            BufferManager buffer_manager;
+            std::mt19937_64 engine(0);
+            std::unique_ptr<InnerNode> inner(new InnerNode());
+            ASSERT_WITH_MESSAGE((reinterpret_cast<char*>(inner->keys) - reinterpret_cast<char*>(inner.get())) % 64 == 0,
+                "the keys do not start on a cache line");
+            for (uint32_t count = 0; count <= InnerNode::kCapacity; count++) {
+                inner->count = count;
+                for (uint32_t i = 0; i + 1 < count; i++) {
+                    inner->keys[i] = 2 * (engine() % 1000);
+                }
+                std::sort(inner->keys, inner->keys + (count > 0 ? count - 1 : 0));
+                inner->rebuild_directory();
+                for (uint64_t key = 0; key < 2002; key += 1 + engine() % 16) {
+                    uint32_t expected = count > 0 ? std::upper_bound(inner->keys, inner->keys + count - 1, key) - inner->keys : 0;
+                    ASSERT_WITH_MESSAGE(inner->lower_bound(key).first == expected,
+                        "key=" + std::to_string(key) + " goes to the wrong child with " + std::to_string(count) + " children");
+                }
+            }
+        }
+
+        // Inserts, splits, merges and a reopen keep the directories current
+        constexpr uint64_t n = 300000;
+        std::vector<uint64_t> keys(n);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::mt19937_64 engine(0);
+        std::shuffle(keys.begin(), keys.end(), engine);
+        {
+            BufferManager buffer_manager(true, 1024 * PAGE_SIZE);
+            BlockedTree tree(buffer_manager);
+            for (uint64_t key : keys) {
+                tree.insert(key, 2 * key);
+            }
+            ASSERT_WITH_MESSAGE(tree.height >= 3, "the tree is too low to test inner nodes");
+            for (uint64_t i = 0; i < n / 2; i++) {
+                tree.erase(keys[i]);
+            }
+            for (uint64_t i = 0; i < n; i++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(keys[i]) == (i < n / 2 ? std::nullopt : std::optional<uint64_t>(2 * keys[i])),
+                    "key=" + std::to_string(keys[i]) + " is wrong after erasing half");
+            }
+        }
+        {
+            BufferManager buffer_manager(false, 1024 * PAGE_SIZE);
+            BlockedTree tree(buffer_manager);
+            auto entries = tree.scan(0, n);
+            ASSERT_WITH_MESSAGE(entries.size() == n - n / 2, "the scan after reopening found " + std::to_string(entries.size()));
+            for (uint64_t i = n / 2; i < n; i++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(keys[i]) == 2 * keys[i],
+                    "key=" + std::to_string(keys[i]) + " is missing after reopening");
+            }
+        }
+
+        // Bulk loaded inner nodes get their directories too
+        {
+            std::vector<std::pair<uint64_t, uint64_t>> entries;
+            for (uint64_t key = 0; key < n; key++) {
+                entries.emplace_back(3 * key, key);
+            }
+            BufferManager buffer_manager(true, 1024 * PAGE_SIZE);
+            BlockedTree tree(buffer_manager);
+            tree.bulk_load(entries.begin(), entries.end(), 0.7);
+            for (uint64_t key = 0; key < 3 * n; key++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == (key % 3 == 0 ? std::optional<uint64_t>(key / 3) : std::nullopt),
+                    "key=" + std::to_string(key) + " is wrong after bulk loading");
+            }
+            tree.checkpoint();
+            PageGuard guard = buffer_manager.pin_page(0);
+            ASSERT_WITH_MESSAGE(guard.as<BlockedTree::Superblock>()->inner_layout == BlockedInnerLayout::kId,
+                "the superblock does not record the layout");
+        }
+        std::cout << "\033[1m\033[32mPassed: Test 35\033[0m" << std::endl;
+    }
+
+    // Test 36: CrashRecoveryAndGroupCommit
+    if (execute_all || selected_test == "36") {
+        std::cout<<"...Starting Test 36"<<std::endl;
+        constexpr int num_threads = 4;
+        constexpr uint64_t lag = 100;
+        // Operation j of a thread inserts key j * num_threads + thread and,
+        // unless j is a multiple of 4, erases the key it inserted lag
+        // operations before, so leaves drain and merge behind the inserts
+        auto key_of = [](uint64_t j, int thread) { return j * num_threads + thread; };
+        auto erased = [](uint64_t j, uint64_t done) { return j % 4 != 0 && j + lag < done; };
+        // Operations committed per thread, shared with the crashing child
+        auto committed = static_cast<std::atomic<uint64_t>*>(mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+        ASSERT_WITH_MESSAGE(committed != MAP_FAILED, "unable to map the shared counters");
+        for (int thread = 0; thread < num_threads; thread++) {
+            new (&committed[thread]) std::atomic<uint64_t>(0);
+        }
+
+        for (int round = 0; round < 2; round++) {
+            uint64_t before = 0;
+            for (int thread = 0; thread < num_threads; thread++) {
+                before += committed[thread];
+            }
+            pid_t child = fork();
+            ASSERT_WITH_MESSAGE(child >= 0, "unable to fork");
+            if (child == 0) {
+                // Work on until killed, each operation durable once it returns
+                BufferManager buffer_manager(round == 0, 64 * PAGE_SIZE, LRU, 0, false, BUFFERED, SYNC_COMMIT);
+                BTree tree(buffer_manager);
+                std::vector<std::thread> threads;
+                for (int thread = 0; thread < num_threads; thread++) {
+                    threads.emplace_back([&, thread] {
+                        for (uint64_t j = committed[thread]; ; j++) {
+                            tree.insert(key_of(j, thread), key_of(j, thread) + 1);
+                            if (j >= lag && (j - lag) % 4 != 0) {
+                                tree.erase(key_of(j - lag, thread));
+                            }
+                            committed[thread] = j + 1;
+                        }
+                    });
+                }
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+                _exit(0);
+            }
+            auto start = std::chrono::steady_clock::now();
+            while (true) {
+                uint64_t done = 0;
+                for (int thread = 0; thread < num_threads; thread++) {
+                    done += committed[thread];
+                }
+                if (done >= before + 5000 || std::chrono::steady_clock::now() - start > std::chrono::seconds(20)) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(37 * (round + 1)));
+            kill(child, SIGKILL);
+            waitpid(child, nullptr, 0);
+
+            // Whatever was committed survives, whatever was erased stays
+            // gone; the operation in flight of each thread may or may not
+            BufferManager buffer_manager(false, 64 * PAGE_SIZE, LRU, 0, false, BUFFERED, SYNC_COMMIT);
             BTree tree(buffer_manager);
-            
-            // Insert values
-            for (auto i = 0ul; i < n; ++i) {
-                tree.insert(i, 2 * i);
-                ASSERT_WITH_MESSAGE(tree.lookup(i).has_value(),
-                    "searching for the just inserted key k=" + std::to_string(i) + " yields nothing");
+            uint64_t expected = 0;
+            for (int thread = 0; thread < num_threads; thread++) {
+                uint64_t done = committed[thread];
+                ASSERT_WITH_MESSAGE(done > lag, "thread " + std::to_string(thread) + " committed too little to test");
+                for (uint64_t j = 0; j < done; j++) {
+                    if (j + lag == done) {
+                        continue;
+                    }
+                    auto value = tree.lookup(key_of(j, thread));
+                    if (erased(j, done)) {
+                        ASSERT_WITH_MESSAGE(!value, "erased key=" + std::to_string(key_of(j, thread)) + " is back after a crash");
+                    } else {
+                        ASSERT_WITH_MESSAGE(value == key_of(j, thread) + 1,
+                            "committed key=" + std::to_string(key_of(j, thread)) + " was lost in a crash");
+                        expected++;
+                    }
+                }
+            }
+            auto entries = tree.scan(0, UINT64_MAX);
+            ASSERT_WITH_MESSAGE(entries.size() >= expected && entries.size() <= expected + 2 * num_threads,
+                "a scan after recovery found " + std::to_string(entries.size()) + " entries, expected " + std::to_string(expected));
+            for (size_t i = 1; i < entries.size(); i++) {
+                ASSERT_WITH_MESSAGE(entries[i - 1].first < entries[i].first, "a scan after recovery is out of order");
             }
 
-            // Lookup all values
-            for (auto i = 0ul; i < n; ++i) {
-                auto v = tree.lookup(i);
-                ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-                ASSERT_WITH_MESSAGE(*v == 2 * i,
-                    "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+            // Merges relink the leaf after the merged one; the chain links back everywhere
+            PageID page_id = *tree.root;
+            for (uint32_t level = 1; level < tree.height; level++) {
+                page_id = buffer_manager.page_id_of(
+                    buffer_manager.pin_page(page_id).as<BTree::InnerNode>()->children[0]);
+            }
+            PageID prev_id = INVALID_PAGE;
+            while (page_id != INVALID_PAGE) {
+                PageGuard guard = buffer_manager.pin_page(page_id);
+                auto leaf = guard.as<BTree::LeafNode>();
+                ASSERT_WITH_MESSAGE(leaf->is_leaf() && leaf->prev == prev_id,
+                    "leaf " + std::to_string(page_id) + " does not link back after recovery");
+                prev_id = page_id;
+                page_id = leaf->next;
             }
         }
+        munmap(committed, PAGE_SIZE);
 
-        // recreate the buffer manager and check for existence of the tree
+        // Threads committing at once share syncs of the log
         {
-            BufferManager buffer_manager(false);
+            constexpr int num_committers = 8;
+            constexpr uint64_t per_thread = 300;
+            BufferManager buffer_manager(true, 1024 * PAGE_SIZE, LRU, 0, false, BUFFERED, SYNC_COMMIT);
             BTree tree(buffer_manager);
+            uint64_t syncs_before = buffer_manager.getNumLogSyncs();
+            std::vector<std::thread> threads;
+            for (int thread = 0; thread < num_committers; thread++) {
+                threads.emplace_back([&, thread] {
+                    for (uint64_t i = 0; i < per_thread; i++) {
+                        tree.insert(i * num_committers + thread, i);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            uint64_t syncs = buffer_manager.getNumLogSyncs() - syncs_before;
+            ASSERT_WITH_MESSAGE(syncs * 2 < num_committers * per_thread,
+                std::to_string(syncs) + " syncs for " + std::to_string(num_committers * per_thread) + " commits");
+        }
+        std::cout << "\033[1m\033[32mPassed: Test 36\033[0m" << std::endl;
+    }
 
-            // Lookup all values
-            for (auto i = 0ul; i < n; ++i) {
-                auto v = tree.lookup(i);
-                ASSERT_WITH_MESSAGE(v.has_value(), "key=" + std::to_string(i) + " is missing");
-                ASSERT_WITH_MESSAGE(*v == 2 * i,
-                    "key=" + std::to_string(i) + " should have the value v=" + std::to_string(2 * i));
+    // Test 37: UpsertAndMerge
+    if (execute_all || selected_test == "37") {
+        std::cout<<"...Starting Test 37"<<std::endl;
+        constexpr uint64_t num_keys = 20000;
+        {
+            BufferManager buffer_manager(true, 1024 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            auto increment = [](const std::optional<uint64_t>& count) { return count.value_or(0) + 1; };
+
+            // Counters start at 1 and count every upsert, through splits
+            for (int round = 0; round < 3; round++) {
+                for (uint64_t i = 0; i < num_keys; i++) {
+                    uint64_t key = (i * 7919) % num_keys;
+                    uint64_t count = tree.upsert(key, increment);
+                    ASSERT_WITH_MESSAGE(count == static_cast<uint64_t>(round) + 1,
+                        "upsert of key=" + std::to_string(key) + " returned " + std::to_string(count));
+                }
+            }
+            for (uint64_t key = 0; key < num_keys; key++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == 3u, "key=" + std::to_string(key) + " was not counted 3 times");
+            }
+
+            // Ascending keys go through try_append
+            for (uint64_t key = num_keys; key < 2 * num_keys; key++) {
+                tree.merge(key, 5, std::plus<uint64_t>());
+                tree.merge(key, 7, std::plus<uint64_t>());
+            }
+            for (uint64_t key = num_keys; key < 2 * num_keys; key++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == 12u, "key=" + std::to_string(key) + " was not merged");
+            }
+
+            // A present key keeps its value and a missing one is inserted
+            for (uint64_t key = 0; key < 3 * num_keys; key += 2) {
+                bool inserted = tree.insert_if_absent(key, 42);
+                ASSERT_WITH_MESSAGE(inserted == (key >= 2 * num_keys),
+                    "insert_if_absent of key=" + std::to_string(key) + " returned " + std::to_string(inserted));
+            }
+            for (uint64_t key = 0; key < 3 * num_keys; key++) {
+                uint64_t expected = key < num_keys ? 3 : key < 2 * num_keys ? 12 : 42;
+                bool present = key < 2 * num_keys || key % 2 == 0;
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == (present ? std::optional<uint64_t>(expected) : std::nullopt),
+                    "key=" + std::to_string(key) + " is wrong");
+            }
+
+            // Concurrent upserts of the same keys lose no increments
+            constexpr int num_threads = 4;
+            std::vector<std::thread> threads;
+            for (int thread = 0; thread < num_threads; thread++) {
+                threads.emplace_back([&] {
+                    for (uint64_t i = 0; i < num_keys; i++) {
+                        tree.upsert(3 * num_keys + i % 1000, increment);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            for (uint64_t key = 3 * num_keys; key < 3 * num_keys + 1000; key++) {
+                ASSERT_WITH_MESSAGE(tree.lookup(key) == num_threads * num_keys / 1000,
+                    "key=" + std::to_string(key) + " lost increments");
             }
         }
 
-        std::cout << "\033[1m\033[32mPassed: Test 12\033[0m" << std::endl;
+        // Upserts are logged and survive a reopen
+        {
+            BufferManager buffer_manager(false, 1024 * PAGE_SIZE);
+            BTree tree(buffer_manager);
+            ASSERT_WITH_MESSAGE(tree.lookup(0) == 3u && tree.lookup(num_keys) == 12u && tree.lookup(2 * num_keys) == 42u,
+                "upserted values were lost on reopening");
+        }
+        std::cout << "\033[1m\033[32mPassed: Test 37\033[0m" << std::endl;
     }
 
     return 0;